@@ -0,0 +1,51 @@
+#include "allocators.h"
+
+#include <array>
+#include <cstdlib>
+
+#include "custom_allocator/lkl_malloc.h"
+
+// The backend this is linked with, set by the build
+#ifndef LKL_BENCH_NAME
+#define LKL_BENCH_NAME "lkl"
+#endif
+
+namespace bench {
+
+namespace {
+
+void* system_malloc(std::size_t size) { return std::malloc(size); }
+void* system_realloc(void* ptr, std::size_t size) { return std::realloc(ptr, size); }
+void system_free(void* ptr) { std::free(ptr); }
+
+// Large enough for the biggest request any workload makes
+constexpr std::size_t baseline_buffer_size = 512 * 1024;
+thread_local char baseline_buffer[baseline_buffer_size];
+
+void* baseline_malloc(std::size_t) { return baseline_buffer; }
+void* baseline_realloc(void*, std::size_t) { return baseline_buffer; }
+void baseline_free(void*) {}
+
+constexpr allocator_api baseline = {"baseline", baseline_malloc, baseline_realloc, baseline_free, nullptr};
+
+constexpr std::array<allocator_api, 2> all_allocators = {{
+  {LKL_BENCH_NAME, lkl_malloc, lkl_realloc, lkl_free, lkl_mallopt},
+  {"system", system_malloc, system_realloc, system_free, nullptr},
+}};
+
+constexpr std::array<placement_policy, 4> all_placement_policies = {{
+  {"first-fit", LKL_PLACEMENT_FIRST_FIT},
+  {"next-fit", LKL_PLACEMENT_NEXT_FIT},
+  {"best-fit", LKL_PLACEMENT_BEST_FIT},
+  {"address-ordered", LKL_PLACEMENT_ADDRESS_ORDERED},
+}};
+
+}  // namespace
+
+std::span<const allocator_api> allocators() { return all_allocators; }
+
+const allocator_api& baseline_allocator() { return baseline; }
+
+std::span<const placement_policy> placement_policies() { return all_placement_policies; }
+
+}  // namespace bench
@@ -0,0 +1,35 @@
+// The allocators the benchmark workloads can be run against
+
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+namespace bench {
+
+struct allocator_api
+{
+  std::string_view name;
+  void* (*allocate)(std::size_t size);
+  void* (*reallocate)(void* ptr, std::size_t size);
+  void (*deallocate)(void* ptr);
+  int (*mallopt)(int param, int value);  // nullptr if the allocator cannot be tuned
+};
+
+std::span<const allocator_api> allocators();
+
+// The placement policies of LKL_M_PLACEMENT by name
+struct placement_policy
+{
+  std::string_view name;
+  int value;
+};
+
+std::span<const placement_policy> placement_policies();
+
+// Does no work, handing every thread the same buffer back for each request. Running a workload
+// against it measures the cost of the workload itself so that can be taken out of the results.
+const allocator_api& baseline_allocator();
+
+}  // namespace bench
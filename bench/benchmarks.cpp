@@ -0,0 +1,275 @@
+// Runs the benchmark workloads against lkl_malloc and the system allocator.
+//
+// usage: benchmarks [--allocator NAME] [--workload NAME] [--threads N[,N...]] [--ops N] [--seed N] [--counters 0|1]
+//                   [--placement NAME[,NAME...]]
+//
+// Every workload is run twice per configuration: once without latency recording to measure
+// throughput, and once with it to get the latency percentiles. With counters on it is also
+// run under perf_counters, once against the allocator and once against the baseline allocator,
+// and the difference is divided by the number of operations to give the cost of each call.
+// Allocators that can be tuned are run once with each placement policy asked for.
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "allocators.h"
+#include "custom_allocator/lkl_malloc.h"
+#include "latency.h"
+#include "perf_counters.h"
+#include "workloads.h"
+
+namespace {
+
+struct options
+{
+  std::string_view allocator;  // Empty runs all of them
+  std::string_view workload;   // Empty runs all of them
+  std::vector<std::size_t> thread_counts = {1, 4};
+  std::size_t ops_per_thread = 1000000;
+  std::uint64_t seed = 42;
+  bool counters = true;
+  std::vector<const bench::placement_policy*> placements;  // Empty leaves the default
+};
+
+[[noreturn]] void usage(const char* program)
+{
+  std::fprintf(stderr,
+               "usage: %s [--allocator NAME] [--workload NAME] [--threads N[,N...]] [--ops N] [--seed N] [--counters 0|1] "
+               "[--placement NAME[,NAME...]]\n",
+               program);
+  std::fprintf(stderr, "\nallocators:");
+  for (const bench::allocator_api& alloc : bench::allocators()) {
+    std::fprintf(stderr, " %.*s", static_cast<int>(alloc.name.size()), alloc.name.data());
+  }
+  std::fprintf(stderr, "\nplacements:");
+  for (const bench::placement_policy& policy : bench::placement_policies()) {
+    std::fprintf(stderr, " %.*s", static_cast<int>(policy.name.size()), policy.name.data());
+  }
+  std::fprintf(stderr, "\nworkloads:\n");
+  for (const bench::workload& work : bench::workloads()) {
+    std::fprintf(stderr,
+                 "  %-18.*s %.*s\n",
+                 static_cast<int>(work.name.size()),
+                 work.name.data(),
+                 static_cast<int>(work.description.size()),
+                 work.description.data());
+  }
+  std::exit(EXIT_FAILURE);
+}
+
+template <typename T>
+bool parse_number(std::string_view text, T& value)
+{
+  auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+  return error == std::errc() && end == text.data() + text.size() && !text.empty();
+}
+
+options parse_options(int argc, char** argv)
+{
+  options opts;
+  for (int arg_idx = 1; arg_idx < argc; arg_idx++) {
+    std::string_view arg = argv[arg_idx];
+    if (arg_idx + 1 == argc) {
+      usage(argv[0]);
+    }
+    std::string_view value = argv[++arg_idx];
+
+    if (arg == "--allocator") {
+      opts.allocator = value;
+    } else if (arg == "--workload") {
+      opts.workload = value;
+    } else if (arg == "--threads") {
+      opts.thread_counts.clear();
+      while (!value.empty()) {
+        std::size_t comma = value.find(',');
+        std::size_t count = 0;
+        if (!parse_number(value.substr(0, comma), count) || count == 0) {
+          usage(argv[0]);
+        }
+        opts.thread_counts.push_back(count);
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+      }
+    } else if (arg == "--ops") {
+      if (!parse_number(value, opts.ops_per_thread) || opts.ops_per_thread == 0) {
+        usage(argv[0]);
+      }
+    } else if (arg == "--seed") {
+      if (!parse_number(value, opts.seed)) {
+        usage(argv[0]);
+      }
+    } else if (arg == "--counters") {
+      if (value != "0" && value != "1") {
+        usage(argv[0]);
+      }
+      opts.counters = value == "1";
+    } else if (arg == "--placement") {
+      opts.placements.clear();
+      while (!value.empty()) {
+        std::size_t comma = value.find(',');
+        std::span<const bench::placement_policy> policies = bench::placement_policies();
+        auto policy = std::find_if(policies.begin(), policies.end(), [&](const bench::placement_policy& known) {
+          return known.name == value.substr(0, comma);
+        });
+        if (policy == policies.end()) {
+          usage(argv[0]);
+        }
+        opts.placements.push_back(&*policy);
+        value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+      }
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (opts.thread_counts.empty()) {
+    usage(argv[0]);
+  }
+  return opts;
+}
+
+bench::perf_counters::readings count_events(const bench::workload& work, const bench::allocator_api& alloc, const bench::workload_config& config)
+{
+  bench::perf_counters counters;
+  counters.start();
+  work.run(alloc, config);
+  counters.stop();
+  return counters.read();
+}
+
+struct result_row
+{
+  const bench::allocator_api* alloc;
+  const bench::placement_policy* placement;  // nullptr for the default
+  const bench::workload* work;
+  std::size_t num_threads;
+  std::size_t total_ops;
+  double seconds;
+  bench::latency_summary latency;
+  bench::perf_counters::readings events_per_op;
+};
+
+void print_name(std::string_view name, int width) { std::printf("%-*.*s ", width, static_cast<int>(name.size()), name.data()); }
+
+void print_placement(const bench::placement_policy* placement) { print_name(placement ? placement->name : "-", 15); }
+
+void print_rows(const std::vector<result_row>& rows)
+{
+  std::printf("%-10s %-15s %-18s %7s %12s %10s %9s %9s %9s\n", "allocator", "placement", "workload", "threads", "ops", "Mops/s", "p50 ns", "p99 ns", "p999 ns");
+  for (const result_row& row : rows) {
+    print_name(row.alloc->name, 10);
+    print_placement(row.placement);
+    print_name(row.work->name, 18);
+    std::printf("%7zu %12zu %10.2f %9.0f %9.0f %9.0f\n",
+                row.num_threads,
+                row.total_ops,
+                static_cast<double>(row.total_ops) / row.seconds / 1e6,
+                row.latency.p50_ns,
+                row.latency.p99_ns,
+                row.latency.p999_ns);
+  }
+}
+
+// Events per operation, with the workload's own cost taken out. Counters that fell back to a
+// software event are marked with a *, and ones that could not be opened at all print n/a.
+void print_counter_rows(const std::vector<result_row>& rows)
+{
+  if (rows.empty()) {
+    return;
+  }
+  std::printf("\nper operation, baseline subtracted (* software event)\n");
+  std::printf("%-10s %-15s %-18s %7s", "allocator", "placement", "workload", "threads");
+  for (const bench::counter_reading& reading : rows.front().events_per_op) {
+    std::printf(" %13.*s%s", static_cast<int>(reading.name.size()), reading.name.data(), reading.software ? "*" : " ");
+  }
+  std::printf("\n");
+
+  for (const result_row& row : rows) {
+    print_name(row.alloc->name, 10);
+    print_placement(row.placement);
+    print_name(row.work->name, 18);
+    std::printf("%7zu", row.num_threads);
+    for (const bench::counter_reading& reading : row.events_per_op) {
+      if (reading.available) {
+        std::printf(" %13.2f ", reading.value);
+      } else {
+        std::printf(" %13s ", "n/a");
+      }
+    }
+    std::printf("\n");
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  const options opts = parse_options(argc, argv);
+
+  std::printf("timer overhead: %u ns (subtracted from latencies)\n\n", bench::timer_overhead_ns());
+
+  std::vector<result_row> rows;
+  for (const bench::workload& work : bench::workloads()) {
+    if (!opts.workload.empty() && opts.workload != work.name) {
+      continue;
+    }
+    for (std::size_t num_threads : opts.thread_counts) {
+      bench::workload_config config{num_threads, opts.ops_per_thread, opts.seed, false};
+
+      bench::perf_counters::readings baseline_events{};
+      if (opts.counters) {
+        baseline_events = count_events(work, bench::baseline_allocator(), config);
+      }
+
+      for (const bench::allocator_api& alloc : bench::allocators()) {
+        if (!opts.allocator.empty() && opts.allocator != alloc.name) {
+          continue;
+        }
+
+        std::vector<const bench::placement_policy*> placements = {nullptr};
+        if (alloc.mallopt && !opts.placements.empty()) {
+          placements = opts.placements;
+        }
+
+        for (const bench::placement_policy* placement : placements) {
+          if (placement && !alloc.mallopt(LKL_M_PLACEMENT, placement->value)) {
+            continue;
+          }
+          result_row row{&alloc, placement, &work, num_threads, 0, 0, {}, {}};
+
+          config.record_latency = false;
+          const bench::workload_result throughput = work.run(alloc, config);
+          row.total_ops = throughput.total_ops;
+          row.seconds = throughput.seconds;
+
+          config.record_latency = true;
+          bench::workload_result latency = work.run(alloc, config);
+          row.latency = bench::summarize(latency.latencies_ns);
+          config.record_latency = false;
+
+          if (opts.counters) {
+            row.events_per_op = count_events(work, alloc, config);
+            for (std::size_t counter = 0; counter < row.events_per_op.size(); counter++) {
+              bench::counter_reading& reading = row.events_per_op[counter];
+              reading.value = (reading.value - baseline_events[counter].value) / static_cast<double>(row.total_ops);
+            }
+          }
+          rows.push_back(row);
+        }
+      }
+    }
+  }
+
+  if (rows.empty()) {
+    usage(argv[0]);
+  }
+  print_rows(rows);
+  if (opts.counters) {
+    print_counter_rows(rows);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,54 @@
+#include "latency.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace bench {
+
+latency_recorder::latency_recorder(bool enabled, std::size_t expected_ops)
+  : enabled_(enabled)
+{
+  if (enabled_) {
+    samples_.reserve(expected_ops);
+  }
+}
+
+std::uint32_t timer_overhead_ns()
+{
+  static const std::uint32_t overhead = [] {
+    constexpr int num_reads = 10000;
+    auto min_delta = std::numeric_limits<bench_clock::duration::rep>::max();
+    for (int read = 0; read < num_reads; read++) {
+      const auto start = bench_clock::now();
+      min_delta = std::min(min_delta, (bench_clock::now() - start).count());
+    }
+    return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::duration(min_delta)).count());
+  }();
+  return overhead;
+}
+
+namespace {
+
+double percentile(std::vector<std::uint32_t>& samples_ns, double fraction)
+{
+  auto nth = samples_ns.begin() + static_cast<std::ptrdiff_t>(fraction * static_cast<double>(samples_ns.size() - 1));
+  std::nth_element(samples_ns.begin(), nth, samples_ns.end());
+  const std::uint32_t overhead = timer_overhead_ns();
+  return *nth > overhead ? *nth - overhead : 0;
+}
+
+}  // namespace
+
+latency_summary summarize(std::vector<std::uint32_t>& samples_ns)
+{
+  latency_summary summary;
+  if (samples_ns.empty()) {
+    return summary;
+  }
+  summary.p50_ns = percentile(samples_ns, 0.5);
+  summary.p99_ns = percentile(samples_ns, 0.99);
+  summary.p999_ns = percentile(samples_ns, 0.999);
+  return summary;
+}
+
+}  // namespace bench
@@ -0,0 +1,53 @@
+// Per operation latency sampling for the benchmark workloads
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace bench {
+
+using bench_clock = std::chrono::steady_clock;
+
+// Collects the latency of every allocator call made by one thread. A disabled recorder
+// makes the calls without touching the clock so the same workload can measure throughput.
+class latency_recorder
+{
+public:
+  latency_recorder(bool enabled, std::size_t expected_ops);
+
+  template <typename Fn>
+  auto time(Fn&& op)
+  {
+    if (!enabled_) {
+      return op();
+    }
+    const auto start = bench_clock::now();
+    auto result = op();
+    samples_.push_back(static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count()));
+    return result;
+  }
+
+  std::vector<std::uint32_t>& samples() { return samples_; }
+
+private:
+  bool enabled_;
+  std::vector<std::uint32_t> samples_;
+};
+
+struct latency_summary
+{
+  double p50_ns = 0;
+  double p99_ns = 0;
+  double p999_ns = 0;
+};
+
+// Smallest time the clock can measure between two back to back reads. This is subtracted
+// from every sample when summarising so it is not counted against the allocator.
+std::uint32_t timer_overhead_ns();
+
+// Reorders the samples in place.
+latency_summary summarize(std::vector<std::uint32_t>& samples_ns);
+
+}  // namespace bench
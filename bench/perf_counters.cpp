@@ -0,0 +1,136 @@
+#include "perf_counters.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+
+namespace bench {
+
+namespace {
+
+struct event_spec
+{
+  std::string_view name;
+  std::uint32_t type;
+  std::uint64_t config;
+};
+
+constexpr std::uint64_t cache_event(std::uint64_t cache, std::uint64_t op, std::uint64_t result)
+{
+  return cache | (op << 8) | (result << 16);
+}
+
+// The hardware event for each counter and the software event to count instead if it is unavailable.
+// A counter without a sensible software stand in has an empty fallback name.
+struct counter_spec
+{
+  std::string_view heading;
+  event_spec hardware;
+  event_spec software;
+};
+
+constexpr std::array<counter_spec, perf_counters::num_counters> counter_specs = {{
+  {"cycles", {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES}, {"task-clock-ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}},
+  {"instructions", {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS}, {"", 0, 0}},
+  {"L1d-misses",
+   {"L1d-misses", PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+   {"", 0, 0}},
+  {"LLC-misses", {"LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES}, {"", 0, 0}},
+  {"dTLB-misses",
+   {"dTLB-misses", PERF_TYPE_HW_CACHE, cache_event(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+   {"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}},
+}};
+
+int open_event(const event_spec& event)
+{
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = event.type;
+  attr.config = event.config;
+  attr.disabled = 1;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+}  // namespace
+
+perf_counters::perf_counters()
+{
+  for (std::size_t counter = 0; counter < num_counters; counter++) {
+    const counter_spec& spec = counter_specs[counter];
+    fds_[counter] = open_event(spec.hardware);
+    software_[counter] = false;
+    if (fds_[counter] < 0 && !spec.software.name.empty()) {
+      fds_[counter] = open_event(spec.software);
+      software_[counter] = true;
+    }
+  }
+}
+
+perf_counters::~perf_counters()
+{
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+void perf_counters::start()
+{
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+}
+
+void perf_counters::stop()
+{
+  for (int fd : fds_) {
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+}
+
+perf_counters::readings perf_counters::read() const
+{
+  readings result;
+  for (std::size_t counter = 0; counter < num_counters; counter++) {
+    const counter_spec& spec = counter_specs[counter];
+    counter_reading& reading = result[counter];
+    reading.software = software_[counter];
+    reading.name = software_[counter] ? spec.software.name : spec.hardware.name;
+
+    // value, time enabled, time running
+    std::array<std::uint64_t, 3> values{};
+    if (fds_[counter] < 0 || ::read(fds_[counter], values.data(), sizeof(values)) != sizeof(values)) {
+      continue;
+    }
+    reading.available = true;
+    reading.value = static_cast<double>(values[0]);
+    if (values[2] != 0 && values[2] < values[1]) {
+      reading.value *= static_cast<double>(values[1]) / static_cast<double>(values[2]);
+    }
+  }
+  return result;
+}
+
+std::array<std::string_view, perf_counters::num_counters> perf_counters::headings()
+{
+  std::array<std::string_view, num_counters> result;
+  for (std::size_t counter = 0; counter < num_counters; counter++) {
+    result[counter] = counter_specs[counter].heading;
+  }
+  return result;
+}
+
+}  // namespace bench
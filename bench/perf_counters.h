@@ -0,0 +1,48 @@
+// Hardware performance counters for a region of code, read through perf_event_open.
+//
+// Each counter falls back to a software event when its hardware event cannot be opened, as is
+// common in virtual machines, and is reported as unavailable when neither can be.
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+namespace bench {
+
+struct counter_reading
+{
+  std::string_view name;  // Name of the event that was actually counted
+  bool available = false;
+  bool software = false;  // True when the software fallback was used
+  double value = 0;       // Scaled up if the kernel had to multiplex the counter
+};
+
+class perf_counters
+{
+public:
+  static constexpr std::size_t num_counters = 5;
+  using readings = std::array<counter_reading, num_counters>;
+
+  // Opens the counters for the calling thread and every thread it creates afterwards.
+  // Threads must have exited before their counts show up in read(). Counts accumulate
+  // over every start/stop pair, so use a new instance for each region being measured.
+  perf_counters();
+  ~perf_counters();
+  perf_counters(const perf_counters&) = delete;
+  perf_counters& operator=(const perf_counters&) = delete;
+
+  void start();
+  void stop();
+  readings read() const;
+
+  // Column headings for the counters in the order read() returns them
+  static std::array<std::string_view, num_counters> headings();
+
+private:
+  std::array<int, num_counters> fds_;
+  std::array<bool, num_counters> software_;
+};
+
+}  // namespace bench
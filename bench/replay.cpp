@@ -0,0 +1,421 @@
+// Replays an allocation trace recorded by the preload library against the backend this is linked with.
+//
+// usage: lkl_replay TRACE [--heap-size BYTES] [--mallopt NAME=VALUE]...
+//
+// Placement policies can be compared on the same trace with --mallopt placement=NAME.
+//
+// The trace is first resolved into a list of calls on numbered objects so the timed replay does no
+// lookups of its own. Calls are replayed one after another on a single thread in the order they were
+// recorded, so every run of a trace makes the same calls. The heap is the mock sbrk of the tests over a
+// reserved region, so its peak is how far the break was ever moved. Slabs and requests large enough to
+// be mapped are not part of it, so the peak footprint adds the mapped bytes of lkl_get_stats after each
+// call. Reading the stats walks the free lists, so that is done by a forked copy of the process replaying
+// the trace untimed, from the same empty heap.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "custom_allocator/lkl_malloc.h"
+#include "custom_allocator/lkl_trace.h"
+
+extern "C" {
+#include "mock_sbrk.h"
+}
+
+namespace {
+
+struct mallopt_setting
+{
+  int param;
+  int value;
+};
+
+struct options
+{
+  const char* trace_path = nullptr;
+  std::size_t heap_size = std::size_t{4} << 30;
+  std::vector<mallopt_setting> settings;
+};
+
+struct mallopt_name
+{
+  std::string_view name;
+  int param;
+};
+
+constexpr std::array<mallopt_name, 10> mallopt_names = {{
+  {"tcache_count", LKL_M_TCACHE_COUNT},
+  {"mmap_threshold", LKL_M_MMAP_THRESHOLD},
+  {"slab_max", LKL_M_SLAB_MAX},
+  {"trim_threshold", LKL_M_TRIM_THRESHOLD},
+  {"top_pad", LKL_M_TOP_PAD},
+  {"release_threshold", LKL_M_RELEASE_THRESHOLD},
+  {"placement", LKL_M_PLACEMENT},
+  {"percpu_count", LKL_M_PERCPU_COUNT},
+  {"heap_segment", LKL_M_HEAP_SEGMENT},
+  {"hugetlb", LKL_M_HUGETLB},
+}};
+
+struct mallopt_value
+{
+  std::string_view name;
+  int value;
+};
+
+// Values that may be given by name, as in --mallopt placement=best-fit
+constexpr std::array<mallopt_value, 4> mallopt_values = {{
+  {"first-fit", LKL_PLACEMENT_FIRST_FIT},
+  {"next-fit", LKL_PLACEMENT_NEXT_FIT},
+  {"best-fit", LKL_PLACEMENT_BEST_FIT},
+  {"address-ordered", LKL_PLACEMENT_ADDRESS_ORDERED},
+}};
+
+[[noreturn]] void usage(const char* program)
+{
+  std::fprintf(stderr, "usage: %s TRACE [--heap-size BYTES] [--mallopt NAME=VALUE]...\n", program);
+  std::fprintf(stderr, "\nmallopt parameters:");
+  for (const mallopt_name& name : mallopt_names) {
+    std::fprintf(stderr, " %.*s", static_cast<int>(name.name.size()), name.name.data());
+  }
+  std::fprintf(stderr, "\nnamed values:");
+  for (const mallopt_value& value : mallopt_values) {
+    std::fprintf(stderr, " %.*s", static_cast<int>(value.name.size()), value.name.data());
+  }
+  std::fprintf(stderr, "\n");
+  std::exit(EXIT_FAILURE);
+}
+
+template <typename T>
+bool parse_number(std::string_view text, T& value)
+{
+  auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+  return error == std::errc() && end == text.data() + text.size() && !text.empty();
+}
+
+bool parse_mallopt_value(std::string_view text, int& value)
+{
+  auto named = std::find_if(mallopt_values.begin(), mallopt_values.end(), [&](const mallopt_value& known) { return known.name == text; });
+  if (named != mallopt_values.end()) {
+    value = named->value;
+    return true;
+  }
+  return parse_number(text, value);
+}
+
+options parse_options(int argc, char** argv)
+{
+  options opts;
+  for (int arg_idx = 1; arg_idx < argc; arg_idx++) {
+    std::string_view arg = argv[arg_idx];
+    if (!arg.starts_with("--")) {
+      if (opts.trace_path) {
+        usage(argv[0]);
+      }
+      opts.trace_path = argv[arg_idx];
+      continue;
+    }
+    if (arg_idx + 1 == argc) {
+      usage(argv[0]);
+    }
+    std::string_view value = argv[++arg_idx];
+
+    if (arg == "--heap-size") {
+      if (!parse_number(value, opts.heap_size) || opts.heap_size == 0) {
+        usage(argv[0]);
+      }
+    } else if (arg == "--mallopt") {
+      std::size_t equals = value.find('=');
+      auto name = std::find_if(mallopt_names.begin(), mallopt_names.end(), [&](const mallopt_name& known) {
+        return known.name == value.substr(0, equals);
+      });
+      mallopt_setting setting{};
+      if (equals == std::string_view::npos || name == mallopt_names.end() || !parse_mallopt_value(value.substr(equals + 1), setting.value)) {
+        usage(argv[0]);
+      }
+      setting.param = name->param;
+      opts.settings.push_back(setting);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if (!opts.trace_path) {
+    usage(argv[0]);
+  }
+  return opts;
+}
+
+// A call of the malloc family on numbered objects. A reallocated object keeps its number.
+struct replay_call
+{
+  std::uint32_t op;
+  std::uint32_t object;
+  std::size_t size;
+  std::size_t alignment;
+};
+
+struct resolved_trace
+{
+  std::vector<replay_call> calls;
+  std::size_t num_objects = 0;
+  std::size_t num_threads = 0;
+  std::size_t skipped = 0;  // Failed calls and ones on objects the trace never allocated
+  std::uint64_t dropped = 0;
+};
+
+// Reads the trace and numbers its objects, reusing the numbers of freed ones to keep the table small.
+bool resolve_trace(const char* path, resolved_trace& resolved)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    std::perror(path);
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || static_cast<std::size_t>(file_stat.st_size) < sizeof(lkl_trace_header)) {
+    std::fprintf(stderr, "%s: not a trace\n", path);
+    close(fd);
+    return false;
+  }
+  const std::size_t file_size = static_cast<std::size_t>(file_stat.st_size);
+  void* mapping = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    std::perror(path);
+    return false;
+  }
+
+  const auto* header = static_cast<const lkl_trace_header*>(mapping);
+  if (std::memcmp(header->magic, LKL_TRACE_MAGIC, sizeof(header->magic)) != 0 || header->version != LKL_TRACE_VERSION
+      || header->record_size != sizeof(lkl_trace_record)
+      || header->capacity > (file_size - sizeof(lkl_trace_header)) / sizeof(lkl_trace_record)) {
+    std::fprintf(stderr, "%s: not a version %d trace\n", path, LKL_TRACE_VERSION);
+    munmap(mapping, file_size);
+    return false;
+  }
+
+  const std::uint64_t num_records = std::min(header->num_records, header->capacity);
+  resolved.dropped = header->num_records - num_records;
+  const auto* records = reinterpret_cast<const lkl_trace_record*>(header + 1);
+
+  std::unordered_map<std::uint64_t, std::uint32_t> live_objects;
+  std::unordered_set<std::uint32_t> threads;
+  std::vector<std::uint32_t> free_numbers;
+  auto new_object = [&](std::uint64_t address) {
+    std::uint32_t number;
+    if (free_numbers.empty()) {
+      number = static_cast<std::uint32_t>(resolved.num_objects++);
+    } else {
+      number = free_numbers.back();
+      free_numbers.pop_back();
+    }
+    live_objects[address] = number;
+    return number;
+  };
+
+  resolved.calls.reserve(num_records);
+  for (std::uint64_t idx = 0; idx < num_records; idx++) {
+    const lkl_trace_record& record = records[idx];
+    threads.insert(record.thread);
+
+    if (record.op == LKL_TRACE_FREE || record.op == LKL_TRACE_REALLOC) {
+      const std::uint64_t address = record.op == LKL_TRACE_FREE ? record.object : record.argument;
+      auto found = live_objects.find(address);
+      if (found == live_objects.end() || (record.op == LKL_TRACE_REALLOC && !record.object)) {
+        resolved.skipped++;
+        continue;
+      }
+      const std::uint32_t number = found->second;
+      live_objects.erase(found);
+      if (record.op == LKL_TRACE_FREE) {
+        free_numbers.push_back(number);
+      } else {
+        live_objects[record.object] = number;
+      }
+      resolved.calls.push_back({record.op, number, record.size, 0});
+    } else if (record.op == LKL_TRACE_MALLOC || record.op == LKL_TRACE_CALLOC || record.op == LKL_TRACE_MEMALIGN) {
+      if (!record.object) {
+        resolved.skipped++;
+        continue;
+      }
+      // An address still live was freed by a thread that recorded it late. The old object is left allocated.
+      resolved.skipped += live_objects.count(record.object);
+      resolved.calls.push_back({record.op, new_object(record.object), record.size, record.argument});
+    } else {
+      resolved.skipped++;
+    }
+  }
+  resolved.num_threads = threads.size();
+
+  munmap(mapping, file_size);
+  return true;
+}
+
+struct replay_result
+{
+  double seconds = 0;
+  std::size_t failed = 0;
+  std::size_t peak_heap = 0;
+  std::size_t peak_footprint = 0;
+  std::size_t peak_requested = 0;
+  lkl_stats end_stats{};
+};
+
+// Reads the heap and mapped bytes after every call when footprint is set, which is too slow to time
+replay_result replay(const resolved_trace& resolved, bool footprint)
+{
+  replay_result result;
+  std::vector<void*> objects(resolved.num_objects, nullptr);
+  std::vector<std::size_t> sizes(resolved.num_objects, 0);
+  std::size_t requested = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (const replay_call& call : resolved.calls) {
+    void*& object = objects[call.object];
+    std::size_t& size = sizes[call.object];
+    void* made = nullptr;
+
+    // Zero sizes are treated as the preload library does
+    switch (call.op) {
+    case LKL_TRACE_MALLOC:
+      made = lkl_malloc(call.size ? call.size : 1);
+      break;
+    case LKL_TRACE_CALLOC:
+      made = lkl_calloc(1, call.size ? call.size : 1);
+      break;
+    case LKL_TRACE_MEMALIGN:
+      made = lkl_memalign(call.alignment, call.size ? call.size : 1);
+      break;
+    case LKL_TRACE_REALLOC:
+      made = object ? lkl_realloc(object, call.size) : nullptr;
+      break;
+    case LKL_TRACE_FREE:
+      lkl_free(object);
+      object = nullptr;
+      requested -= size;
+      size = 0;
+      continue;
+    default:
+      continue;
+    }
+
+    if (!made) {
+      result.failed++;
+      continue;
+    }
+    object = made;
+    requested += call.size - size;
+    size = call.size;
+    result.peak_requested = std::max(result.peak_requested, requested);
+    result.peak_heap = std::max(result.peak_heap, heap_top);
+    if (footprint) {
+      result.peak_footprint = std::max(result.peak_footprint, heap_top + lkl_get_stats().mapped_bytes);
+    }
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  result.end_stats = lkl_get_stats();
+  std::for_each(objects.begin(), objects.end(), lkl_free);
+  return result;
+}
+
+// Replays the trace in a child for its peak footprint, so the replay that is timed starts from the same
+// empty heap. Returns false if the child could not report it.
+bool replay_footprint(const resolved_trace& resolved, std::size_t& peak_footprint)
+{
+  int fds[2];
+  if (pipe(fds) != 0) {
+    std::perror("pipe");
+    return false;
+  }
+  const pid_t child = fork();
+  if (child < 0) {
+    std::perror("fork");
+    close(fds[0]);
+    close(fds[1]);
+    return false;
+  }
+  if (child == 0) {
+    close(fds[0]);
+    const std::size_t peak = replay(resolved, true).peak_footprint;
+    const bool written = write(fds[1], &peak, sizeof(peak)) == static_cast<ssize_t>(sizeof(peak));
+    _exit(written ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  close(fds[1]);
+  const bool read_all = read(fds[0], &peak_footprint, sizeof(peak_footprint)) == static_cast<ssize_t>(sizeof(peak_footprint));
+  close(fds[0]);
+  int status = 0;
+  waitpid(child, &status, 0);
+  if (!read_all || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+    std::fprintf(stderr, "the replay for the peak footprint did not finish\n");
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+  const options opts = parse_options(argc, argv);
+
+  resolved_trace resolved;
+  if (!resolve_trace(opts.trace_path, resolved)) {
+    return EXIT_FAILURE;
+  }
+
+  // Reserved without being committed, so only what the replay touches is ever backed
+  void* heap = mmap(nullptr, opts.heap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (heap == MAP_FAILED) {
+    std::perror("heap");
+    return EXIT_FAILURE;
+  }
+  init_heap(static_cast<char*>(heap), opts.heap_size);
+
+  for (const mallopt_setting& setting : opts.settings) {
+    if (!lkl_mallopt(setting.param, setting.value)) {
+      std::fprintf(stderr, "lkl_mallopt(%d, %d) is not supported by this backend\n", setting.param, setting.value);
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::size_t peak_footprint = 0;
+  if (!replay_footprint(resolved, peak_footprint)) {
+    return EXIT_FAILURE;
+  }
+  const replay_result result = replay(resolved, false);
+  const double num_calls = static_cast<double>(std::max<std::size_t>(resolved.calls.size(), 1));
+
+  std::printf("calls            %zu from %zu threads (%zu skipped, %llu dropped while recording)\n",
+              resolved.calls.size(),
+              resolved.num_threads,
+              resolved.skipped,
+              static_cast<unsigned long long>(resolved.dropped));
+  std::printf("failed           %zu\n", result.failed);
+  std::printf("time             %.3f ms (%.1f ns per call)\n", result.seconds * 1e3, result.seconds * 1e9 / num_calls);
+  std::printf("peak heap        %zu bytes\n", result.peak_heap);
+  std::printf("peak footprint   %zu bytes, heap and mappings\n", peak_footprint);
+  std::printf("peak requested   %zu bytes, mapped requests included\n", result.peak_requested);
+  std::printf("at the end       %zu bytes live, %zu free, %zu mapped, fragmentation %.3f\n",
+              result.end_stats.live_bytes,
+              result.end_stats.free_bytes,
+              result.end_stats.mapped_bytes,
+              result.end_stats.fragmentation);
+  return EXIT_SUCCESS;
+}
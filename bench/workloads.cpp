@@ -0,0 +1,288 @@
+#include "workloads.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <barrier>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <latch>
+#include <random>
+#include <thread>
+
+#include "latency.h"
+
+namespace bench {
+
+namespace {
+
+// Runs body(thread_idx, recorder) on every thread once they have all started, timing from
+// the moment they are released until the last one finishes.
+template <typename Body>
+workload_result run_threads(const workload_config& config, std::size_t ops_per_thread, Body&& body)
+{
+  std::vector<latency_recorder> recorders;
+  recorders.reserve(config.num_threads);
+  for (std::size_t thread_idx = 0; thread_idx < config.num_threads; thread_idx++) {
+    recorders.emplace_back(config.record_latency, ops_per_thread);
+  }
+
+  std::vector<std::size_t> ops(config.num_threads, 0);
+  std::latch ready(static_cast<std::ptrdiff_t>(config.num_threads) + 1);
+  std::latch start(1);
+
+  std::vector<std::jthread> threads;
+  for (std::size_t thread_idx = 0; thread_idx < config.num_threads; thread_idx++) {
+    threads.emplace_back([&, thread_idx] {
+      ready.count_down();
+      start.wait();
+      ops[thread_idx] = body(thread_idx, recorders[thread_idx]);
+    });
+  }
+
+  ready.arrive_and_wait();
+  const auto begin = bench_clock::now();
+  start.count_down();
+  for (std::jthread& thread : threads) {
+    thread.join();
+  }
+  const auto end = bench_clock::now();
+
+  workload_result result;
+  result.seconds = std::chrono::duration<double>(end - begin).count();
+  for (std::size_t thread_idx = 0; thread_idx < config.num_threads; thread_idx++) {
+    result.total_ops += ops[thread_idx];
+    std::vector<std::uint32_t>& samples = recorders[thread_idx].samples();
+    result.latencies_ns.insert(result.latencies_ns.end(), samples.begin(), samples.end());
+  }
+  return result;
+}
+
+// A workload cannot go on without the memory it asked for, and its results would mean nothing if it did
+[[noreturn]] void allocation_failed(const allocator_api& alloc, std::size_t size)
+{
+  std::fprintf(stderr, "%.*s failed to allocate %zu bytes, stopping the run\n", static_cast<int>(alloc.name.size()), alloc.name.data(), size);
+  std::abort();
+}
+
+void* allocate(const allocator_api& alloc, latency_recorder& recorder, std::size_t size)
+{
+  void* ptr = recorder.time([&] { return alloc.allocate(size); });
+  if (!ptr) {
+    allocation_failed(alloc, size);
+  }
+  // Touch the memory as a real caller would
+  static_cast<volatile char*>(ptr)[0] = 1;
+  return ptr;
+}
+
+void deallocate(const allocator_api& alloc, latency_recorder& recorder, void* ptr)
+{
+  recorder.time([&] {
+    alloc.deallocate(ptr);
+    return 0;
+  });
+}
+
+// Sizes are drawn log-uniformly so every power of two between min_size and max_size is equally likely
+std::vector<std::size_t> random_sizes(std::mt19937_64& gen, std::size_t count, std::size_t min_size, std::size_t max_size)
+{
+  std::uniform_real_distribution<double> log_size(std::log2(static_cast<double>(min_size)), std::log2(static_cast<double>(max_size)));
+  std::vector<std::size_t> sizes(count);
+  std::generate(sizes.begin(), sizes.end(), [&] { return static_cast<std::size_t>(std::exp2(log_size(gen))); });
+  return sizes;
+}
+
+// Every thread cycles through a set of slots, freeing the slot's object if it has one and
+// allocating a new one of the same size if not.
+workload_result fixed_size_churn(const allocator_api& alloc, const workload_config& config)
+{
+  constexpr std::size_t num_slots = 1024;
+  constexpr std::size_t alloc_size = 64;
+
+  return run_threads(config, config.ops_per_thread, [&](std::size_t, latency_recorder& recorder) {
+    std::array<void*, num_slots> slots{};
+    for (std::size_t op = 0; op < config.ops_per_thread; op++) {
+      void*& slot = slots[op % num_slots];
+      if (slot) {
+        deallocate(alloc, recorder, slot);
+        slot = nullptr;
+      } else {
+        slot = allocate(alloc, recorder, alloc_size);
+      }
+    }
+    std::for_each(slots.begin(), slots.end(), alloc.deallocate);
+    return config.ops_per_thread;
+  });
+}
+
+// Like fixed_size_churn but with random slots and sizes, which leaves the heap fragmented.
+workload_result random_size_churn(const allocator_api& alloc, const workload_config& config)
+{
+  constexpr std::size_t num_slots = 4096;
+  constexpr std::size_t table_size = 1 << 16;
+
+  return run_threads(config, config.ops_per_thread, [&](std::size_t thread_idx, latency_recorder& recorder) {
+    // Drawn up front so the random number generator is not part of the measurement
+    std::mt19937_64 gen(config.seed + thread_idx);
+    std::vector<std::size_t> sizes = random_sizes(gen, table_size, 8, 4096);
+    std::vector<std::size_t> slot_order(table_size);
+    std::uniform_int_distribution<std::size_t> slot_rng(0, num_slots - 1);
+    std::generate(slot_order.begin(), slot_order.end(), [&] { return slot_rng(gen); });
+
+    std::vector<void*> slots(num_slots, nullptr);
+    for (std::size_t op = 0; op < config.ops_per_thread; op++) {
+      void*& slot = slots[slot_order[op % table_size]];
+      if (slot) {
+        deallocate(alloc, recorder, slot);
+        slot = nullptr;
+      } else {
+        slot = allocate(alloc, recorder, sizes[op % table_size]);
+      }
+    }
+    std::for_each(slots.begin(), slots.end(), alloc.deallocate);
+    return config.ops_per_thread;
+  });
+}
+
+// After Larson and Krishnan. Each thread replaces random objects in a set of slots, and between
+// rounds the sets are passed on to the next thread so most objects are freed by a thread other
+// than the one that allocated them.
+workload_result larson(const allocator_api& alloc, const workload_config& config)
+{
+  constexpr std::size_t num_slots = 1000;
+  constexpr std::size_t num_rounds = 10;
+  const std::size_t ops_per_round = std::max<std::size_t>(config.ops_per_thread / num_rounds / 2, 1);
+
+  std::vector<std::vector<void*>> slot_sets(config.num_threads, std::vector<void*>(num_slots, nullptr));
+  std::vector<std::vector<std::size_t>> slot_sizes(config.num_threads);
+  std::barrier round_barrier(static_cast<std::ptrdiff_t>(config.num_threads));
+
+  workload_result result = run_threads(config, config.ops_per_thread, [&](std::size_t thread_idx, latency_recorder& recorder) {
+    std::mt19937_64 gen(config.seed + thread_idx);
+    std::vector<std::size_t> sizes = random_sizes(gen, num_slots, 16, 512);
+    std::uniform_int_distribution<std::size_t> slot_rng(0, num_slots - 1);
+
+    std::size_t ops = 0;
+    for (void*& slot : slot_sets[thread_idx]) {
+      slot = allocate(alloc, recorder, sizes[ops++ % num_slots]);
+    }
+    round_barrier.arrive_and_wait();
+
+    for (std::size_t round = 0; round < num_rounds; round++) {
+      std::vector<void*>& slots = slot_sets[(thread_idx + round) % config.num_threads];
+      for (std::size_t op = 0; op < ops_per_round; op++) {
+        std::size_t slot_idx = slot_rng(gen);
+        deallocate(alloc, recorder, slots[slot_idx]);
+        slots[slot_idx] = allocate(alloc, recorder, sizes[op % num_slots]);
+        ops += 2;
+      }
+      round_barrier.arrive_and_wait();
+    }
+    return ops;
+  });
+
+  for (std::vector<void*>& slots : slot_sets) {
+    std::for_each(slots.begin(), slots.end(), alloc.deallocate);
+  }
+  return result;
+}
+
+// Bounded single producer single consumer queue of pointers
+class handoff_queue
+{
+public:
+  void push(void* ptr)
+  {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    while (tail - head_.load(std::memory_order_acquire) == capacity) {
+      std::this_thread::yield();
+    }
+    items_[tail % capacity] = ptr;
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  void* pop()
+  {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    while (tail_.load(std::memory_order_acquire) == head) {
+      std::this_thread::yield();
+    }
+    void* ptr = items_[head % capacity];
+    head_.store(head + 1, std::memory_order_release);
+    return ptr;
+  }
+
+private:
+  static constexpr std::size_t capacity = 1024;
+  std::array<void*, capacity> items_{};
+  alignas(64) std::atomic<std::size_t> head_{0};
+  alignas(64) std::atomic<std::size_t> tail_{0};
+};
+
+// Threads are paired up. One of each pair allocates objects and hands them to the other which frees them.
+workload_result producer_consumer(const allocator_api& alloc, const workload_config& config)
+{
+  workload_config paired_config = config;
+  paired_config.num_threads = std::max<std::size_t>(config.num_threads / 2, 1) * 2;
+  std::vector<handoff_queue> queues(paired_config.num_threads / 2);
+
+  return run_threads(paired_config, config.ops_per_thread, [&](std::size_t thread_idx, latency_recorder& recorder) {
+    handoff_queue& queue = queues[thread_idx / 2];
+    if (thread_idx % 2 == 0) {
+      std::mt19937_64 gen(config.seed + thread_idx);
+      std::vector<std::size_t> sizes = random_sizes(gen, 1024, 16, 1024);
+      for (std::size_t op = 0; op < config.ops_per_thread; op++) {
+        queue.push(allocate(alloc, recorder, sizes[op % sizes.size()]));
+      }
+    } else {
+      for (std::size_t op = 0; op < config.ops_per_thread; op++) {
+        deallocate(alloc, recorder, queue.pop());
+      }
+    }
+    return config.ops_per_thread;
+  });
+}
+
+// Every thread builds up buffers by appending a small chunk at a time with realloc.
+workload_result realloc_append(const allocator_api& alloc, const workload_config& config)
+{
+  constexpr std::size_t chunk_size = 64;
+  constexpr std::size_t max_buffer_size = 256 * 1024;
+
+  return run_threads(config, config.ops_per_thread, [&](std::size_t, latency_recorder& recorder) {
+    char* buffer = nullptr;
+    std::size_t buffer_size = 0;
+    for (std::size_t op = 0; op < config.ops_per_thread; op++) {
+      if (buffer_size == max_buffer_size) {
+        deallocate(alloc, recorder, buffer);
+        buffer = nullptr;
+        buffer_size = 0;
+        continue;
+      }
+      buffer = static_cast<char*>(recorder.time([&] { return alloc.reallocate(buffer, buffer_size + chunk_size); }));
+      if (!buffer) {
+        allocation_failed(alloc, buffer_size + chunk_size);
+      }
+      buffer[buffer_size] = 1;
+      buffer_size += chunk_size;
+    }
+    alloc.deallocate(buffer);
+    return config.ops_per_thread;
+  });
+}
+
+constexpr std::array<workload, 5> all_workloads = {{
+  {"fixed-churn", "allocate and free 64 byte objects in a fixed order", fixed_size_churn},
+  {"random-churn", "allocate and free random sizes of 8 B to 4 KiB in random order", random_size_churn},
+  {"larson", "replace random objects, passing them between threads every round", larson},
+  {"producer-consumer", "one thread of each pair allocates, the other frees", producer_consumer},
+  {"realloc-append", "grow buffers to 256 KiB 64 bytes at a time with realloc", realloc_append},
+}};
+
+}  // namespace
+
+std::span<const workload> workloads() { return all_workloads; }
+
+}  // namespace bench
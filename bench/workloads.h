@@ -0,0 +1,40 @@
+// Standard allocator workloads. Each one runs a number of threads against a single allocator
+// and counts every allocate, reallocate and deallocate call as one operation.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "allocators.h"
+
+namespace bench {
+
+struct workload_config
+{
+  std::size_t num_threads = 1;
+  std::size_t ops_per_thread = 0;
+  std::uint64_t seed = 0;
+  bool record_latency = false;
+};
+
+struct workload_result
+{
+  std::size_t total_ops = 0;
+  double seconds = 0;
+  std::vector<std::uint32_t> latencies_ns;  // Empty unless latencies were recorded
+};
+
+struct workload
+{
+  std::string_view name;
+  std::string_view description;
+  workload_result (*run)(const allocator_api& alloc, const workload_config& config);
+};
+
+std::span<const workload> workloads();
+
+}  // namespace bench
@@ -6,6 +6,7 @@ set(ALL_CMAKE_FILES
     cmake/Conan.cmake
     src/CMakeLists.txt
     test/CMakeLists.txt
+    bench/CMakeLists.txt
     CMakeLists.txt)
 
 foreach(SOURCE_FILE ${ALL_CMAKE_FILES})
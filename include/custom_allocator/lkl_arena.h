@@ -0,0 +1,36 @@
+#pragma once
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A region of memory handed out by bumping a pointer. Objects are never freed one at a time,
+// instead the whole arena is reset or destroyed at once, however many objects it holds.
+struct lkl_arena;
+
+// Arenas grow by chunks of chunk_size bytes taken from lkl_malloc, or a default size if 0.
+// Returns NULL if there is no space for the first chunk.
+struct lkl_arena* lkl_arena_create(size_t chunk_size);
+
+// An arena whose chunks, and the arena itself, are allocated from parent. They stay allocated from the
+// parent after the child is destroyed until the parent is reset or destroyed, which also ends the child.
+// Returns NULL if the parent has no space for the first chunk.
+struct lkl_arena* lkl_arena_create_child(struct lkl_arena* parent, size_t chunk_size);
+
+// Allocates size bytes aligned to alignof(max_align_t). Returns NULL if size is 0 or there is no space.
+void* lkl_arena_alloc(struct lkl_arena* arena, size_t size);
+
+// Allocates size bytes aligned to alignment, which must be a power of two.
+void* lkl_arena_alloc_aligned(struct lkl_arena* arena, size_t size, size_t alignment);
+
+// Frees everything allocated from the arena while keeping its chunks to allocate from again.
+void lkl_arena_reset(struct lkl_arena* arena);
+
+// Frees everything allocated from the arena along with the arena itself.
+void lkl_arena_destroy(struct lkl_arena* arena);
+
+#ifdef __cplusplus
+}
+#endif
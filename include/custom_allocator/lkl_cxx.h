@@ -0,0 +1,308 @@
+#pragma once
+
+// Header only C++ layer over the allocator, so standard containers can allocate from it:
+//
+//   lkl::heap_memory_resource()  a std::pmr::memory_resource over lkl_malloc, shared by the whole program
+//   lkl::arena_resource          a std::pmr::memory_resource over an lkl_arena, freed all at once
+//   lkl::pool_resource           a std::pmr::memory_resource over an lkl_pool of objects of one size
+//   lkl::allocator<T>            a stateless allocator over lkl_malloc for containers without pmr
+//
+// Defining LKL_REPLACE_GLOBAL_NEW before including this header in exactly one source file of a program
+// also replaces the global operator new and delete, so everything allocated with new goes to lkl_malloc.
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "custom_allocator/lkl_arena.h"
+#include "custom_allocator/lkl_malloc.h"
+#include "custom_allocator/lkl_pool.h"
+
+namespace lkl {
+
+namespace detail {
+
+// Returns NULL if there is no space. A size of 0 still gets an allocation of its own, as new requires.
+inline void* allocate(std::size_t size, std::size_t alignment) noexcept
+{
+  if (size == 0) {
+    size = 1;
+  }
+  return alignment <= alignof(std::max_align_t) ? lkl_malloc(size) : lkl_memalign(alignment, size);
+}
+
+// Every allocation made by allocate is freed here, with the size and alignment it was made with.
+// The size is passed on, rounded up as allocate did, so the backend can skip reading the block's header.
+inline void deallocate(void* ptr, std::size_t size, std::size_t alignment) noexcept
+{
+  if (alignment <= alignof(std::max_align_t)) {
+    lkl_free_sized(ptr, size ? size : 1);
+  } else {
+    lkl_free(ptr);
+  }
+}
+
+// Calls the new handler until allocate succeeds, as operator new does. Throws std::bad_alloc once there is none.
+inline void* allocate_or_throw(std::size_t size, std::size_t alignment)
+{
+  for (;;) {
+    void* ptr = allocate(size, alignment);
+    if (ptr) {
+      return ptr;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (!handler) {
+      throw std::bad_alloc();
+    }
+    handler();
+  }
+}
+
+}  // namespace detail
+
+// Allocates from lkl_malloc, or lkl_memalign when more than alignof(max_align_t) is asked for.
+// Every heap_resource is interchangeable with every other.
+class heap_resource : public std::pmr::memory_resource
+{
+protected:
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override { return detail::allocate_or_throw(bytes, alignment); }
+
+  void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override { detail::deallocate(ptr, bytes, alignment); }
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return dynamic_cast<const heap_resource*>(&other) != nullptr; }
+};
+
+inline std::pmr::memory_resource* heap_memory_resource() noexcept
+{
+  static heap_resource resource;
+  return &resource;
+}
+
+// Allocates by bumping a pointer through an arena's chunks. Deallocating does nothing, the memory is only
+// reused after release, and given back when the resource is destroyed.
+class arena_resource : public std::pmr::memory_resource
+{
+public:
+  // Chunks are chunk_size bytes, or the arena's default if 0. Throws std::bad_alloc if there is no space for the first.
+  explicit arena_resource(std::size_t chunk_size = 0) : arena_(lkl_arena_create(chunk_size))
+  {
+    if (!arena_) {
+      throw std::bad_alloc();
+    }
+  }
+
+  arena_resource(const arena_resource&) = delete;
+  arena_resource& operator=(const arena_resource&) = delete;
+
+  ~arena_resource() override { lkl_arena_destroy(arena_); }
+
+  // Frees everything allocated from the resource, keeping its chunks to allocate from again
+  void release() noexcept { lkl_arena_reset(arena_); }
+
+  struct lkl_arena* arena() const noexcept { return arena_; }
+
+protected:
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    void* ptr = lkl_arena_alloc_aligned(arena_, bytes ? bytes : 1, alignment);
+    if (!ptr) {
+      throw std::bad_alloc();
+    }
+    return ptr;
+  }
+
+  void do_deallocate(void*, std::size_t, std::size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+  struct lkl_arena* arena_;
+};
+
+// Allocates objects of up to object_size bytes from a pool, and anything larger or more aligned from upstream.
+// The size and alignment given back on deallocation pick the same side again, so no lookup is needed.
+class pool_resource : public std::pmr::memory_resource
+{
+public:
+  // Throws std::bad_alloc on a bad size or alignment, or if the pool could not be made.
+  explicit pool_resource(std::size_t object_size, std::size_t alignment = alignof(std::max_align_t),
+                         std::pmr::memory_resource* upstream = heap_memory_resource())
+    : pool_(lkl_pool_create(object_size, alignment)), object_size_(object_size), alignment_(alignment), upstream_(upstream)
+  {
+    if (!pool_) {
+      throw std::bad_alloc();
+    }
+  }
+
+  pool_resource(const pool_resource&) = delete;
+  pool_resource& operator=(const pool_resource&) = delete;
+
+  ~pool_resource() override { lkl_pool_destroy(pool_); }
+
+  std::pmr::memory_resource* upstream_resource() const noexcept { return upstream_; }
+
+protected:
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    if (!from_pool(bytes, alignment)) {
+      return upstream_->allocate(bytes, alignment);
+    }
+    void* ptr = lkl_pool_alloc(pool_);
+    if (!ptr) {
+      throw std::bad_alloc();
+    }
+    return ptr;
+  }
+
+  void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override
+  {
+    if (from_pool(bytes, alignment)) {
+      lkl_pool_free(pool_, ptr);
+    } else {
+      upstream_->deallocate(ptr, bytes, alignment);
+    }
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+  bool from_pool(std::size_t bytes, std::size_t alignment) const noexcept { return bytes <= object_size_ && alignment <= alignment_; }
+
+  struct lkl_pool* pool_;
+  std::size_t object_size_;
+  std::size_t alignment_;
+  std::pmr::memory_resource* upstream_;
+};
+
+// What allocator<T>::allocate_at_least gave: the objects and how many of them there is room for.
+template <typename T>
+struct allocation_result
+{
+  T* ptr;
+  std::size_t count;
+};
+
+// Allocates from lkl_malloc like heap_resource, for containers that take an allocator type rather than a resource.
+template <typename T>
+struct allocator
+{
+  using value_type = T;
+
+  allocator() noexcept = default;
+
+  template <typename U>
+  allocator(const allocator<U>&) noexcept
+  {}
+
+  [[nodiscard]] T* allocate(std::size_t num_elems)
+  {
+    if (num_elems > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+      throw std::bad_array_new_length();
+    }
+    void* ptr = detail::allocate(num_elems * sizeof(T), alignof(T));
+    if (!ptr) {
+      throw std::bad_alloc();
+    }
+    return static_cast<T*>(ptr);
+  }
+
+  // As allocate, also saying how many objects fit in the block that was given, so a growing buffer can use
+  // all of it before asking for more. It is given back to deallocate with either count.
+  [[nodiscard]] allocation_result<T> allocate_at_least(std::size_t num_elems)
+  {
+    T* ptr = allocate(num_elems);
+    return {ptr, lkl_malloc_usable_size(ptr) / sizeof(T)};
+  }
+
+  void deallocate(T* ptr, std::size_t num_elems) noexcept { detail::deallocate(ptr, num_elems * sizeof(T), alignof(T)); }
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept
+{
+  return true;
+}
+
+}  // namespace lkl
+
+#ifdef LKL_REPLACE_GLOBAL_NEW
+
+// Replacement functions may not be inline, hence defining them in only one source file.
+
+void* operator new(std::size_t size) { return lkl::detail::allocate_or_throw(size, alignof(std::max_align_t)); }
+
+void* operator new[](std::size_t size) { return lkl::detail::allocate_or_throw(size, alignof(std::max_align_t)); }
+
+void* operator new(std::size_t size, std::align_val_t alignment) { return lkl::detail::allocate_or_throw(size, static_cast<std::size_t>(alignment)); }
+
+void* operator new[](std::size_t size, std::align_val_t alignment) { return lkl::detail::allocate_or_throw(size, static_cast<std::size_t>(alignment)); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  try {
+    return lkl::detail::allocate_or_throw(size, alignof(std::max_align_t));
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  try {
+    return lkl::detail::allocate_or_throw(size, alignof(std::max_align_t));
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+  try {
+    return lkl::detail::allocate_or_throw(size, static_cast<std::size_t>(alignment));
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+  try {
+    return lkl::detail::allocate_or_throw(size, static_cast<std::size_t>(alignment));
+  } catch (const std::bad_alloc&) {
+    return nullptr;
+  }
+}
+
+void operator delete(void* ptr) noexcept { lkl_free(ptr); }
+
+void operator delete[](void* ptr) noexcept { lkl_free(ptr); }
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { lkl_free(ptr); }
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { lkl_free(ptr); }
+
+void operator delete(void* ptr, std::align_val_t) noexcept { lkl_free(ptr); }
+
+void operator delete[](void* ptr, std::align_val_t) noexcept { lkl_free(ptr); }
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { lkl_free(ptr); }
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { lkl_free(ptr); }
+
+// The sized forms pass the size on
+void operator delete(void* ptr, std::size_t size) noexcept { lkl::detail::deallocate(ptr, size, alignof(std::max_align_t)); }
+
+void operator delete[](void* ptr, std::size_t size) noexcept { lkl::detail::deallocate(ptr, size, alignof(std::max_align_t)); }
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t alignment) noexcept
+{
+  lkl::detail::deallocate(ptr, size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete[](void* ptr, std::size_t size, std::align_val_t alignment) noexcept
+{
+  lkl::detail::deallocate(ptr, size, static_cast<std::size_t>(alignment));
+}
+
+#endif
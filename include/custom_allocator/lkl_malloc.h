@@ -2,10 +2,100 @@
 
 #include <sys/types.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Every allocation is aligned to at least alignof(max_align_t).
 void* lkl_malloc(size_t size);
 
 void* lkl_realloc(void* ptr, size_t requested_size);
 
 void* lkl_calloc(size_t num_elem, size_t elem_size);
 
-void lkl_free(void* ptr);
\ No newline at end of file
+void lkl_free(void* ptr);
+
+// Frees ptr like lkl_free, given the size it was requested with from lkl_malloc or lkl_calloc (their total).
+// Backends serving that size from a size class find where the block goes from the size alone, without reading
+// the block. Any size up to its lkl_malloc_usable_size rounds to the same class and may be given instead. Any
+// other size is undefined, and debug builds assert on it. Blocks from lkl_realloc or lkl_memalign must be
+// freed with lkl_free.
+void lkl_free_sized(void* ptr, size_t size);
+
+// Allocates num blocks of size bytes each into out, taking the heap lock once and carving as many of them
+// as fit from each free block found, or from a single extension of the heap. Returns how many were
+// allocated, into the start of out, which is fewer than num only if there was no space for the rest.
+size_t lkl_malloc_batch(size_t size, size_t num, void** out);
+
+// Frees each of the num pointers in ptrs, skipping NULLs, taking the heap lock once rather than once per pointer.
+void lkl_free_batch(void** ptrs, size_t num);
+
+// Allocates size bytes whose address is a multiple of alignment, which must be a power of two.
+// The result is released with lkl_free. Returns NULL on a bad alignment or if there is no space.
+void* lkl_memalign(size_t alignment, size_t size);
+
+// C11 aligned_alloc. Any power of two alignment is accepted, including 64 for a cache line and the page size.
+void* lkl_aligned_alloc(size_t alignment, size_t size);
+
+// POSIX posix_memalign. alignment must be a power of two multiple of sizeof(void*). Returns 0 and stores the
+// allocation in *memptr, which is NULL for a size of 0, or returns EINVAL or ENOMEM leaving *memptr untouched.
+int lkl_posix_memalign(void** memptr, size_t alignment, size_t size);
+
+// Number of bytes that can be used at ptr, which is at least the size it was allocated with. A growing
+// buffer can use all of them before it has to be reallocated.
+size_t lkl_malloc_usable_size(void* ptr);
+
+// Parameters for lkl_mallopt
+#define LKL_M_TCACHE_COUNT 1    // Most blocks of each small size class a thread caches, 0 disables the cache
+#define LKL_M_MMAP_THRESHOLD 2  // Requests of at least this many bytes get a mapping of their own
+#define LKL_M_SLAB_MAX 3        // Largest request served from a slab of equal slots, below 1024, 0 disables slabs
+#define LKL_M_TRIM_THRESHOLD 4  // Size the free top of the heap reaches before the break is moved down
+#define LKL_M_TOP_PAD 5         // Bytes left at the top of the heap when it is trimmed as blocks are freed
+#define LKL_M_RELEASE_THRESHOLD 6  // Freeing at least this many bytes within the heap gives their pages back
+#define LKL_M_PLACEMENT 7          // Which free block serves a request, one of the policies below
+#define LKL_M_PERCPU_COUNT 8       // Most blocks of each small size class each CPU caches, instead of each thread, 0 to cache per thread
+#define LKL_M_HEAP_SEGMENT 9       // Bytes the heap grows and shrinks by, a power of two of at least a page, 0 for only what is needed
+#define LKL_M_HUGETLB 10           // 1 to try explicit huge pages for requests that get a mapping of their own
+
+// Placement policies for LKL_M_PLACEMENT
+#define LKL_PLACEMENT_FIRST_FIT 0        // The block freed longest ago that fits
+#define LKL_PLACEMENT_NEXT_FIT 1         // The first that fits after the one last taken from the same size class
+#define LKL_PLACEMENT_BEST_FIT 2         // The smallest that fits
+#define LKL_PLACEMENT_ADDRESS_ORDERED 3  // The lowest in memory that fits, among those of its size class
+
+// Gives free memory back to the OS: the top of the heap down to pad free bytes and the whole pages
+// inside every other free block. The calling thread's cache is emptied first. Returns 1 if anything was released.
+int lkl_trim(size_t pad);
+
+// Adjusts a tunable allocator parameter. Returns 1 on success and 0 on an unknown parameter or bad value.
+int lkl_mallopt(int param, int value);
+
+#define LKL_STATS_CLASSES 128       // Size classes whose free lists lkl_get_stats reports
+#define LKL_STATS_SEARCH_BUCKETS 16  // Buckets of the free list search length histogram
+
+// A snapshot of the allocator returned by lkl_get_stats. Sizes are in bytes. Blocks held in a thread's
+// cache count as freed. Fields a backend has no use for are left 0.
+struct lkl_stats
+{
+  size_t live_bytes;          // Usable size of every allocation not yet freed
+  size_t live_allocations;    // Allocations not yet freed
+  size_t heap_bytes;          // Taken from sbrk and not given back
+  size_t mapped_bytes;        // Mapped for large allocations and slabs
+  size_t free_bytes;          // Held in free blocks of the heap
+  size_t largest_free_block;  // Largest single free block of the heap
+  double fragmentation;       // 1 - largest_free_block / free_bytes, 0 when nothing is free
+  size_t free_blocks[LKL_STATS_CLASSES];  // Length of each size class's free list
+  unsigned long long sbrk_calls;          // Calls that moved the break, up or down
+  unsigned long long mmap_calls;          // Mappings made or resized
+  // Free blocks looked at to serve each allocation from the heap. Bucket 0 counts searches that found
+  // nothing to look at, bucket k lengths in [2^(k-1), 2^k) and the last bucket anything longer.
+  unsigned long long search_lengths[LKL_STATS_SEARCH_BUCKETS];
+};
+
+// Collects the allocator's counters. They are kept per thread and summed here so they are cheap enough
+// to leave on, but a snapshot taken while other threads allocate may be slightly out of date.
+struct lkl_stats lkl_get_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A pool of objects of a single size. Objects carry no header of their own, and a freed object
+// holds the link to the next free one, so allocating and freeing only push and pop a list.
+struct lkl_pool;
+
+// Objects are at least obj_size bytes and aligned to align, which must be a power of two or 0 for
+// alignof(max_align_t). Returns NULL on a bad alignment, a size of 0, or if there is no space.
+struct lkl_pool* lkl_pool_create(size_t obj_size, size_t align);
+
+// Returns NULL if there is no space for another slab of objects.
+void* lkl_pool_alloc(struct lkl_pool* pool);
+
+// obj must have come from lkl_pool_alloc on the same pool. obj may be NULL.
+void lkl_pool_free(struct lkl_pool* pool, void* obj);
+
+// Frees every object in the pool along with the pool itself.
+void lkl_pool_destroy(struct lkl_pool* pool);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,51 @@
+#pragma once
+
+// Format of the allocation traces the preload library writes when run with
+//
+//     LKL_TRACE=<file> LD_PRELOAD=liblkl_malloc.so <program>
+//
+// A trace is a header followed by fixed size records, one for each call of the malloc family in the order
+// the calls claimed their record. Objects are identified by the address they were given, which is unique
+// among live objects. Threads racing on the same address, such as one freeing an object before the thread
+// that allocated it has recorded the allocation, may leave records out of order.
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LKL_TRACE_MAGIC "LKLTRACE"
+#define LKL_TRACE_VERSION 1
+
+enum lkl_trace_op
+{
+  LKL_TRACE_MALLOC = 1,
+  LKL_TRACE_FREE,
+  LKL_TRACE_CALLOC,
+  LKL_TRACE_REALLOC,
+  LKL_TRACE_MEMALIGN,  // Also posix_memalign, aligned_alloc, valloc and pvalloc
+};
+
+struct lkl_trace_header
+{
+  char magic[8];         // LKL_TRACE_MAGIC, without its terminator
+  uint32_t version;      // LKL_TRACE_VERSION
+  uint32_t record_size;  // sizeof(struct lkl_trace_record)
+  uint64_t capacity;     // Records the file has room for
+  uint64_t num_records;  // Records claimed. Any past capacity were dropped as the file was full.
+};
+
+struct lkl_trace_record
+{
+  uint64_t timestamp;  // Nanoseconds since tracing started
+  uint64_t object;     // Address of the object allocated, or freed by LKL_TRACE_FREE. 0 if the call failed.
+  uint64_t argument;   // The address realloc was given, or the alignment asked for by LKL_TRACE_MEMALIGN
+  uint64_t size;       // Bytes requested, both counts multiplied for calloc
+  uint32_t thread;     // Kernel thread id of the caller
+  uint32_t op;         // One of enum lkl_trace_op
+};
+
+#ifdef __cplusplus
+}
+#endif
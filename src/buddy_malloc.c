@@ -0,0 +1,725 @@
+// Binary buddy implementation of malloc. Links in place of lkl_malloc.c, exporting the same functions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // mremap
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "custom_allocator/lkl_malloc.h"
+
+// The heap is made of top blocks of 2^BUDDY_MAX_ORDER bytes taken from sbrk, each split into power of two
+// blocks down to 2^BUDDY_MIN_ORDER bytes. A block of order k at offset o into its top block has its buddy
+// at offset o ^ 2^k, and the two merge back into the block of order k + 1 they were split from once both are free.
+#define BUDDY_MIN_ORDER 5
+#define BUDDY_MAX_ORDER 20
+#define BUDDY_NUM_ORDERS (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1)
+#define BUDDY_TOP_SIZE ((size_t)1 << BUDDY_MAX_ORDER)
+
+// Each top block starts with a bitmap holding a bit for every possible block of every order, set while that
+// block is free, so a buddy's state is found without touching the buddy. The bitmap fills the first block
+// of BUDDY_BITMAP_ORDER, which is never handed out, so the largest block the heap hands out is half a top block.
+#define BUDDY_BITMAP_BITS ((size_t)1 << BUDDY_NUM_ORDERS)
+#define BUDDY_BITMAP_ORDER 13
+#define BUDDY_BITMAP_WORD_BITS 64
+
+static_assert(BUDDY_BITMAP_BITS / 8 == (size_t)1 << BUDDY_BITMAP_ORDER, "BUDDY_BITMAP_ORDER must match the bitmap size");
+
+// Sits directly before the payload of an allocated block
+struct buddy_header
+{
+  size_t block_size;       // Size of the buddy block, or of the whole mapping for a mapped one
+  unsigned int lead;       // Bytes from the start of the block to this header when the payload was aligned further
+  unsigned int is_mmapped;  // The block is a mapping of its own and is not part of the heap
+};
+
+static_assert(sizeof(struct buddy_header) % __alignof__(max_align_t) == 0, "headers must keep payloads aligned");
+
+// Free blocks of each order are kept in a circular doubly linked list headed by a sentinel,
+// with the links held in the blocks themselves.
+struct buddy_free_block
+{
+  struct buddy_free_block* next;
+  struct buddy_free_block* prev;
+};
+
+static char* buddy_base = NULL;  // Start of the first top block, and of the heap
+static struct buddy_free_block free_lists[BUDDY_NUM_ORDERS];
+static unsigned int nonempty_orders;  // Bit k - BUDDY_MIN_ORDER is set while free_lists has a block of order k
+
+// Requests of at least mmap_threshold bytes are given a private anonymous mapping of their own,
+// as is anything that does not fit in the largest block the heap hands out.
+#define MMAP_DEFAULT_THRESHOLD (128 * 1024)
+
+static size_t mmap_threshold = MMAP_DEFAULT_THRESHOLD;
+static size_t lowest_mmap_threshold = MMAP_DEFAULT_THRESHOLD;  // Smaller requests have never been mapped
+
+// Guards all of the shared heap state above as well as the break itself.
+// It is held across fork so the child never inherits it locked by a thread that no longer exists.
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Counters for lkl_get_stats. There is no thread cache to keep them in, and every heap call takes heap_lock
+// anyway, so those counted outside it are shared and added to atomically.
+static unsigned long long allocations = 0;
+static unsigned long long frees = 0;
+static unsigned long long allocated_bytes = 0;
+static unsigned long long freed_bytes = 0;
+static size_t mapped_bytes = 0;
+static unsigned long long mmap_calls = 0;
+static size_t heap_bytes = 0;  // Guarded by heap_lock
+static unsigned long long sbrk_calls = 0;  // Guarded by heap_lock
+
+static_assert(BUDDY_MAX_ORDER < LKL_STATS_CLASSES, "lkl_get_stats reports each order as its own class");
+
+static inline unsigned int order_for(size_t total_size);
+static inline void* heap_malloc(size_t total_size, size_t alignment);
+static inline void* mmap_malloc(size_t requested_size, size_t alignment);
+static inline struct buddy_header* get_header(void* ptr);
+static inline char* block_start(struct buddy_header* header);
+static inline void* place_header(char* block, size_t block_size, size_t alignment, int is_mmapped);
+
+static inline char* buddy_alloc(unsigned int order);
+static inline void buddy_free(char* block, unsigned int order);
+static inline void buddy_shrink(char* block, unsigned int order, unsigned int new_order);
+static inline int add_top_block(void);
+static inline char* top_block_of(char* block);
+static inline size_t bit_index(unsigned int order, size_t offset);
+static inline int is_free_block(char* top, unsigned int order, size_t offset);
+static inline void push_free_block(char* block, unsigned int order);
+static inline void remove_free_block(char* block, unsigned int order);
+static inline size_t page_align(size_t size);
+static inline void* count_malloc(void* payload);
+static inline void count_resize(size_t old_size, size_t new_size);
+
+static void heap_lock_prepare(void);
+static void heap_lock_parent(void);
+static void heap_lock_child(void);
+
+void* lkl_malloc(size_t requested_size)
+{
+  return lkl_memalign(__alignof__(max_align_t), requested_size);
+}
+
+void* lkl_realloc(void* ptr, size_t requested_size)
+{
+  // NULL case: Allocate some new memory
+  if (!ptr) {
+    return lkl_malloc(requested_size);
+  }
+
+  struct buddy_header* header = get_header(ptr);
+  char* block = block_start(header);
+
+  if (header->is_mmapped) {
+    if (requested_size > (size_t)-1 - header->lead - sizeof(struct buddy_header)) {
+      return NULL;
+    }
+    size_t new_size = page_align(header->lead + sizeof(struct buddy_header) + requested_size);
+    if (!new_size) {
+      return NULL;
+    }
+    if (new_size == header->block_size) {
+      return ptr;
+    }
+    // The header may move with the mapping, so nothing is read from it after the remap
+    size_t old_size = header->block_size;
+    size_t lead = header->lead;
+    char* mapping = (char*)mremap(block, old_size, new_size, MREMAP_MAYMOVE);
+    if (mapping == (char*)MAP_FAILED) {
+      return NULL;
+    }
+    header = (struct buddy_header*)(mapping + lead);
+    header->block_size = new_size;
+    __atomic_fetch_add(&mmap_calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&mapped_bytes, new_size - old_size, __ATOMIC_RELAXED);
+    count_resize(old_size, new_size);
+    return (header + 1);
+  }
+
+  // Resizing on 0 size where memory for new object is not allocated
+  // is implementation specific on freeing the old object (see 7.22.3.5).
+  // For this implementation it is chosen to not free, the block is shrunk as far as it can be.
+  size_t usable_size = lkl_malloc_usable_size(ptr);
+  if (requested_size <= usable_size) {
+    // A shrink hands back the upper halves the block no longer needs. Blocks with an aligned payload are left alone.
+    if (header->lead == 0) {
+      unsigned int order = (unsigned int)__builtin_ctzll(header->block_size);
+      unsigned int new_order = order_for(requested_size + sizeof(struct buddy_header));
+      if (new_order < order) {
+        pthread_mutex_lock(&heap_lock);
+        buddy_shrink(block, order, new_order);
+        pthread_mutex_unlock(&heap_lock);
+        header->block_size = (size_t)1 << new_order;
+        count_resize((size_t)1 << order, header->block_size);
+      }
+    }
+    return ptr;
+  }
+
+  // The block cannot grow where it is. Allocate some new memory
+  // and free up the existing memory after the copy.
+  void* new_allocation = lkl_malloc(requested_size);
+  if (!new_allocation) {
+    return NULL;
+  }
+  memcpy(new_allocation, ptr, usable_size);
+  lkl_free(ptr);
+  return new_allocation;
+}
+
+void* lkl_calloc(size_t num_elem, size_t elem_size)
+{
+  size_t total_size;
+  if (__builtin_mul_overflow(num_elem, elem_size, &total_size)) {
+    return NULL;
+  }
+  void* new_allocation = lkl_malloc(total_size);
+
+  if (new_allocation == NULL) {
+    return NULL;
+  }
+
+  // Fresh anonymous mappings are already zero filled
+  if (get_header(new_allocation)->is_mmapped) {
+    return new_allocation;
+  }
+
+  memset(new_allocation, 0, total_size);
+  return new_allocation;
+}
+
+void lkl_free(void* ptr)
+{
+  if (!ptr) {
+    return;
+  }
+
+  __atomic_fetch_add(&frees, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&freed_bytes, lkl_malloc_usable_size(ptr), __ATOMIC_RELAXED);
+
+  struct buddy_header* header = get_header(ptr);
+  char* block = block_start(header);
+
+  if (header->is_mmapped) {
+    size_t map_size = header->block_size;
+    munmap(block, map_size);
+    __atomic_fetch_sub(&mapped_bytes, map_size, __ATOMIC_RELAXED);
+    return;
+  }
+
+  unsigned int order = (unsigned int)__builtin_ctzll(header->block_size);
+  pthread_mutex_lock(&heap_lock);
+  buddy_free(block, order);
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// A block lkl_malloc gave out for size bytes has the order that holds them and its header, and its header
+// sits at the start of the block, so neither the order nor where the block starts is read from the header.
+void lkl_free_sized(void* ptr, size_t size)
+{
+  if (!ptr || !size || size >= lowest_mmap_threshold || size > (size_t)-1 - sizeof(struct buddy_header)) {
+    lkl_free(ptr);
+    return;
+  }
+  unsigned int order = order_for(size + sizeof(struct buddy_header));
+  if (order >= BUDDY_MAX_ORDER) {
+    lkl_free(ptr);
+    return;
+  }
+  char* block = (char*)ptr - sizeof(struct buddy_header);
+  assert(get_header(ptr)->block_size == (size_t)1 << order && !get_header(ptr)->is_mmapped && !get_header(ptr)->lead);
+
+  __atomic_fetch_add(&frees, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&freed_bytes, ((size_t)1 << order) - sizeof(struct buddy_header), __ATOMIC_RELAXED);
+  pthread_mutex_lock(&heap_lock);
+  buddy_free(block, order);
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// Every block of a batch is of the same order, so each is taken off the free lists in turn under a single lock.
+size_t lkl_malloc_batch(size_t requested_size, size_t num, void** out)
+{
+  if (requested_size <= 0 || requested_size > (size_t)-1 - sizeof(struct buddy_header)) {
+    return 0;
+  }
+  size_t total_size = requested_size + sizeof(struct buddy_header);
+  unsigned int order = order_for(total_size);
+
+  // Mappings are made without the lock anyway
+  size_t count = 0;
+  if (requested_size >= mmap_threshold || order >= BUDDY_MAX_ORDER) {
+    while (count < num && (out[count] = lkl_malloc(requested_size))) {
+      count++;
+    }
+    return count;
+  }
+
+  pthread_mutex_lock(&heap_lock);
+  while (count < num && (out[count] = buddy_alloc(order))) {
+    count++;
+  }
+  pthread_mutex_unlock(&heap_lock);
+
+  for (size_t idx = 0; idx < count; idx++) {
+    out[idx] = count_malloc(place_header((char*)out[idx], (size_t)1 << order, __alignof__(max_align_t), 0));
+  }
+  return count;
+}
+
+// The lock is only taken once a pointer needs it, so a batch of mappings never takes it.
+void lkl_free_batch(void** ptrs, size_t num)
+{
+  int locked = 0;
+  for (size_t idx = 0; idx < num; idx++) {
+    void* ptr = ptrs[idx];
+    if (!ptr) {
+      continue;
+    }
+    struct buddy_header* header = get_header(ptr);
+    if (header->is_mmapped) {
+      lkl_free(ptr);
+      continue;
+    }
+    __atomic_fetch_add(&frees, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&freed_bytes, lkl_malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    if (!locked) {
+      pthread_mutex_lock(&heap_lock);
+      locked = 1;
+    }
+    buddy_free(block_start(header), (unsigned int)__builtin_ctzll(header->block_size));
+  }
+  if (locked) {
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+void* lkl_memalign(size_t alignment, size_t requested_size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    return NULL;
+  }
+  if (alignment < __alignof__(max_align_t)) {
+    alignment = __alignof__(max_align_t);
+  }
+
+  if (requested_size <= 0) {
+    return NULL;
+  }
+
+  // Blocks start on a multiple of the header size, so the header and payload fit within this
+  // wherever the payload has to be moved along to for it to be aligned
+  size_t padding = sizeof(struct buddy_header) + alignment - __alignof__(max_align_t);
+  if (requested_size > (size_t)-1 - padding) {
+    return NULL;
+  }
+  size_t total_size = requested_size + padding;
+
+  unsigned int order = order_for(total_size);
+  if (requested_size >= mmap_threshold || order >= BUDDY_MAX_ORDER) {
+    void* mapped = mmap_malloc(requested_size, alignment);
+    if (mapped || order >= BUDDY_MAX_ORDER) {
+      return count_malloc(mapped);
+    }
+    // Fall back to the heap if the mapping could not be made
+  }
+
+  return count_malloc(heap_malloc(total_size, alignment));
+}
+
+void* lkl_aligned_alloc(size_t alignment, size_t requested_size)
+{
+  return lkl_memalign(alignment, requested_size);
+}
+
+int lkl_posix_memalign(void** memptr, size_t alignment, size_t requested_size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void*) != 0) {
+    return EINVAL;
+  }
+
+  if (requested_size == 0) {
+    *memptr = NULL;
+    return 0;
+  }
+
+  void* new_allocation = lkl_memalign(alignment, requested_size);
+  if (!new_allocation) {
+    return ENOMEM;
+  }
+  *memptr = new_allocation;
+  return 0;
+}
+
+size_t lkl_malloc_usable_size(void* ptr)
+{
+  if (!ptr) {
+    return 0;
+  }
+  struct buddy_header* header = get_header(ptr);
+  return header->block_size - header->lead - sizeof(struct buddy_header);
+}
+
+// The heap is never shrunk as its top blocks are aligned from buddy_base. Instead the pages of
+// free blocks past the first page, which holds the free list links, are dropped.
+int lkl_trim(size_t pad)
+{
+  (void)pad;
+  int released = 0;
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+  pthread_mutex_lock(&heap_lock);
+  if (buddy_base) {
+    for (unsigned int order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++) {
+      size_t block_size = (size_t)1 << order;
+      if (block_size <= page_size) {
+        continue;
+      }
+      struct buddy_free_block* list = &free_lists[order - BUDDY_MIN_ORDER];
+      for (struct buddy_free_block* block = list->next; block != list; block = block->next) {
+        released |= madvise((char*)block + page_size, block_size - page_size, MADV_DONTNEED) == 0;
+      }
+    }
+  }
+  pthread_mutex_unlock(&heap_lock);
+
+  return released;
+}
+
+// Free blocks are reported by order, free_blocks[k] counting those of 2^k bytes. Nothing is ever
+// searched for, so search_lengths stays empty.
+struct lkl_stats lkl_get_stats(void)
+{
+  struct lkl_stats stats;
+  memset(&stats, 0, sizeof(stats));
+
+  pthread_mutex_lock(&heap_lock);
+  if (buddy_base) {
+    for (unsigned int order = BUDDY_MIN_ORDER; order <= BUDDY_MAX_ORDER; order++) {
+      struct buddy_free_block* list = &free_lists[order - BUDDY_MIN_ORDER];
+      for (struct buddy_free_block* block = list->next; block != list; block = block->next) {
+        stats.free_blocks[order]++;
+      }
+      stats.free_bytes += stats.free_blocks[order] << order;
+      if (stats.free_blocks[order]) {
+        stats.largest_free_block = (size_t)1 << order;
+      }
+    }
+  }
+  stats.heap_bytes = heap_bytes;
+  stats.sbrk_calls = sbrk_calls;
+  pthread_mutex_unlock(&heap_lock);
+
+  stats.mapped_bytes = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+  stats.mmap_calls = __atomic_load_n(&mmap_calls, __ATOMIC_RELAXED);
+
+  // A free can be counted before the allocation made by another thread
+  unsigned long long total_frees = __atomic_load_n(&frees, __ATOMIC_RELAXED);
+  unsigned long long total_allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+  unsigned long long total_freed = __atomic_load_n(&freed_bytes, __ATOMIC_RELAXED);
+  unsigned long long total_allocated = __atomic_load_n(&allocated_bytes, __ATOMIC_RELAXED);
+  if (total_allocations > total_frees) {
+    stats.live_allocations = (size_t)(total_allocations - total_frees);
+  }
+  if (total_allocated > total_freed) {
+    stats.live_bytes = (size_t)(total_allocated - total_freed);
+  }
+  if (stats.free_bytes) {
+    stats.fragmentation = 1.0 - (double)stats.largest_free_block / (double)stats.free_bytes;
+  }
+  return stats;
+}
+
+// There is no thread cache so only LKL_M_MMAP_THRESHOLD is supported.
+int lkl_mallopt(int param, int value)
+{
+  switch (param) {
+  case LKL_M_MMAP_THRESHOLD:
+    if (value <= 0) {
+      return 0;
+    }
+    mmap_threshold = (size_t)value;
+    if (mmap_threshold < lowest_mmap_threshold) {
+      lowest_mmap_threshold = mmap_threshold;
+    }
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// Smallest order whose blocks hold total_size bytes, which is more than BUDDY_MAX_ORDER if there is none.
+unsigned int order_for(size_t total_size)
+{
+  if (total_size <= (size_t)1 << BUDDY_MIN_ORDER) {
+    return BUDDY_MIN_ORDER;
+  }
+  if (total_size > BUDDY_TOP_SIZE) {
+    return BUDDY_MAX_ORDER + 1;
+  }
+  return (unsigned int)(sizeof(unsigned long long) * 8) - (unsigned int)__builtin_clzll((unsigned long long)(total_size - 1));
+}
+
+void* heap_malloc(size_t total_size, size_t alignment)
+{
+  unsigned int order = order_for(total_size);
+
+  pthread_mutex_lock(&heap_lock);
+  char* block = buddy_alloc(order);
+  pthread_mutex_unlock(&heap_lock);
+
+  if (!block) {
+    return NULL;
+  }
+  return place_header(block, (size_t)1 << order, alignment, 0);
+}
+
+// The mapping is kept whole so the header can always find its start, even when the payload was aligned past the first page.
+void* mmap_malloc(size_t requested_size, size_t alignment)
+{
+  size_t padding = sizeof(struct buddy_header) + alignment - __alignof__(max_align_t);
+  if (requested_size > (size_t)-1 - padding) {
+    return NULL;
+  }
+  size_t map_size = page_align(requested_size + padding);
+  if (!map_size) {
+    return NULL;
+  }
+
+  char* mapping = (char*)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == (char*)MAP_FAILED) {
+    return NULL;
+  }
+  __atomic_fetch_add(&mmap_calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mapped_bytes, map_size, __ATOMIC_RELAXED);
+  return place_header(mapping, map_size, alignment, 1);
+}
+
+struct buddy_header* get_header(void* ptr)
+{
+  return ((struct buddy_header*)ptr - 1);
+}
+
+char* block_start(struct buddy_header* header)
+{
+  return (char*)header - header->lead;
+}
+
+// Puts the header as close to the start of the block as it can go with the payload after it aligned.
+void* place_header(char* block, size_t block_size, size_t alignment, int is_mmapped)
+{
+  uintptr_t earliest = (uintptr_t)block + sizeof(struct buddy_header);
+  struct buddy_header* header = (struct buddy_header*)((earliest + alignment - 1) & ~(alignment - 1)) - 1;
+  header->block_size = block_size;
+  header->lead = (unsigned int)((char*)header - block);
+  header->is_mmapped = (unsigned int)is_mmapped;
+  return (header + 1);
+}
+
+// Takes the smallest free block of at least the given order, splitting it down and freeing the upper
+// halves until it is the right size. Must be called with heap_lock held.
+char* buddy_alloc(unsigned int order)
+{
+  if (order > BUDDY_MAX_ORDER) {
+    return NULL;
+  }
+
+  unsigned int candidates = nonempty_orders & (~0u << (order - BUDDY_MIN_ORDER));
+  if (!candidates) {
+    if (!add_top_block()) {
+      return NULL;
+    }
+    candidates = nonempty_orders & (~0u << (order - BUDDY_MIN_ORDER));
+    if (!candidates) {
+      return NULL;
+    }
+  }
+
+  unsigned int found_order = BUDDY_MIN_ORDER + (unsigned int)__builtin_ctz(candidates);
+  char* block = (char*)free_lists[found_order - BUDDY_MIN_ORDER].next;
+  remove_free_block(block, found_order);
+  buddy_shrink(block, found_order, order);
+  return block;
+}
+
+// Frees a block, merging it with its buddy for as long as the buddy is free. Must be called with heap_lock held.
+void buddy_free(char* block, unsigned int order)
+{
+  char* top = top_block_of(block);
+  size_t offset = (size_t)(block - top);
+
+  // The block holding the bitmap is never free so merging always stops below a whole top block
+  while (order < BUDDY_MAX_ORDER) {
+    size_t buddy_offset = offset ^ ((size_t)1 << order);
+    if (!is_free_block(top, order, buddy_offset)) {
+      break;
+    }
+    remove_free_block(top + buddy_offset, order);
+    offset &= ~((size_t)1 << order);
+    order++;
+  }
+
+  push_free_block(top + offset, order);
+}
+
+// Frees the upper halves of an allocated block until it is down to new_order. Their buddies are the
+// lower halves that are kept, so there is nothing to merge with. Must be called with heap_lock held.
+void buddy_shrink(char* block, unsigned int order, unsigned int new_order)
+{
+  while (order > new_order) {
+    order--;
+    push_free_block(block + ((size_t)1 << order), order);
+  }
+}
+
+// Takes another top block from sbrk. Top blocks are kept a multiple of BUDDY_TOP_SIZE from buddy_base so
+// the top block of any block can be found, and the break is moved past anything between it and the next
+// such boundary if something else moved it. Must be called with heap_lock held.
+int add_top_block(void)
+{
+  char* current_break = (char*)sbrk(0);
+  if (current_break == (char*)-1) {
+    return 0;
+  }
+
+  size_t padding;
+  if (!buddy_base) {
+    padding = -(uintptr_t)current_break % __alignof__(max_align_t);
+  } else {
+    if (current_break < buddy_base) {
+      return 0;
+    }
+    padding = -(size_t)(current_break - buddy_base) % BUDDY_TOP_SIZE;
+  }
+
+  if (padding > (size_t)INTPTR_MAX - BUDDY_TOP_SIZE || sbrk((intptr_t)(padding + BUDDY_TOP_SIZE)) != current_break) {
+    return 0;
+  }
+
+  sbrk_calls++;
+  heap_bytes += padding + BUDDY_TOP_SIZE;
+
+  char* top = current_break + padding;
+  if (!buddy_base) {
+    buddy_base = top;
+    for (unsigned int idx = 0; idx < BUDDY_NUM_ORDERS; idx++) {
+      free_lists[idx].next = &free_lists[idx];
+      free_lists[idx].prev = &free_lists[idx];
+    }
+  }
+
+  // Everything but the bitmap at the start is free, as the upper halves of ever larger blocks
+  memset(top, 0, BUDDY_BITMAP_BITS / 8);
+  buddy_shrink(top, BUDDY_MAX_ORDER, BUDDY_BITMAP_ORDER);
+  return 1;
+}
+
+char* top_block_of(char* block)
+{
+  return buddy_base + ((size_t)(block - buddy_base) & ~(BUDDY_TOP_SIZE - 1));
+}
+
+// The bits for each order follow those of the order below, which has twice as many blocks.
+size_t bit_index(unsigned int order, size_t offset)
+{
+  size_t order_start = BUDDY_BITMAP_BITS - ((size_t)1 << (BUDDY_MAX_ORDER - order + 1));
+  return order_start + (offset >> order);
+}
+
+int is_free_block(char* top, unsigned int order, size_t offset)
+{
+  size_t idx = bit_index(order, offset);
+  unsigned long long* bitmap = (unsigned long long*)top;
+  return (bitmap[idx / BUDDY_BITMAP_WORD_BITS] >> (idx % BUDDY_BITMAP_WORD_BITS)) & 1;
+}
+
+void push_free_block(char* block, unsigned int order)
+{
+  char* top = top_block_of(block);
+  size_t idx = bit_index(order, (size_t)(block - top));
+  ((unsigned long long*)top)[idx / BUDDY_BITMAP_WORD_BITS] |= 1ULL << (idx % BUDDY_BITMAP_WORD_BITS);
+
+  struct buddy_free_block* free_block = (struct buddy_free_block*)block;
+  struct buddy_free_block* list = &free_lists[order - BUDDY_MIN_ORDER];
+  free_block->next = list->next;
+  free_block->prev = list;
+  list->next->prev = free_block;
+  list->next = free_block;
+  nonempty_orders |= 1u << (order - BUDDY_MIN_ORDER);
+}
+
+void remove_free_block(char* block, unsigned int order)
+{
+  char* top = top_block_of(block);
+  size_t idx = bit_index(order, (size_t)(block - top));
+  ((unsigned long long*)top)[idx / BUDDY_BITMAP_WORD_BITS] &= ~(1ULL << (idx % BUDDY_BITMAP_WORD_BITS));
+
+  struct buddy_free_block* free_block = (struct buddy_free_block*)block;
+  free_block->prev->next = free_block->next;
+  free_block->next->prev = free_block->prev;
+
+  struct buddy_free_block* list = &free_lists[order - BUDDY_MIN_ORDER];
+  if (list->next == list) {
+    nonempty_orders &= ~(1u << (order - BUDDY_MIN_ORDER));
+  }
+}
+
+// Rounds up to a multiple of the page size, returning 0 if that does not fit in a size_t.
+size_t page_align(size_t size)
+{
+  static size_t page_size = 0;
+  if (!page_size) {
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+  }
+
+  if (size > (size_t)-1 - (page_size - 1)) {
+    return 0;
+  }
+  return (size + page_size - 1) & ~(page_size - 1);
+}
+
+// Counts an allocation about to be handed out, if there is one, and returns it.
+void* count_malloc(void* payload)
+{
+  if (payload) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&allocated_bytes, lkl_malloc_usable_size(payload), __ATOMIC_RELAXED);
+  }
+  return payload;
+}
+
+// Counts an allocation resized where it is. Both sizes include the same header and lead.
+void count_resize(size_t old_size, size_t new_size)
+{
+  if (new_size > old_size) {
+    __atomic_fetch_add(&allocated_bytes, new_size - old_size, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_add(&freed_bytes, old_size - new_size, __ATOMIC_RELAXED);
+  }
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void)
+{
+  pthread_atfork(heap_lock_prepare, heap_lock_parent, heap_lock_child);
+}
+
+void heap_lock_prepare(void)
+{
+  pthread_mutex_lock(&heap_lock);
+}
+
+void heap_lock_parent(void)
+{
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// Only the forking thread exists in the child so the lock is simply made fresh.
+void heap_lock_child(void)
+{
+  pthread_mutex_init(&heap_lock, NULL);
+}
@@ -0,0 +1,171 @@
+// Bump pointer arenas on top of lkl_malloc
+#include "custom_allocator/lkl_arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "custom_allocator/lkl_malloc.h"
+
+#define ARENA_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define ARENA_DEFAULT_ALIGNMENT (__alignof__(max_align_t))
+
+// Chunks are chained in the order they were added so a reset arena reuses them in the same order.
+struct arena_chunk
+{
+  struct arena_chunk* next;
+  char* end;
+};
+
+// The arena lives at the start of its first chunk so creating one takes a single allocation,
+// and allocating from it only moves bump forward through the current chunk.
+struct lkl_arena
+{
+  struct arena_chunk* first;
+  struct arena_chunk* current;
+  char* bump;  // Start of the free space in current
+  size_t chunk_size;
+  struct lkl_arena* parent;  // Where chunks come from, or NULL for lkl_malloc
+};
+
+static inline struct lkl_arena* arena_create(struct lkl_arena* parent, size_t chunk_size);
+static inline struct arena_chunk* new_chunk(struct lkl_arena* parent, size_t chunk_size);
+static inline char* chunk_start(struct lkl_arena* arena, struct arena_chunk* chunk);
+static inline char* bump_alloc(struct arena_chunk* chunk, char* bump, size_t size, size_t alignment);
+static inline void* alloc_from_next_chunk(struct lkl_arena* arena, size_t size, size_t alignment);
+
+struct lkl_arena* lkl_arena_create(size_t chunk_size)
+{
+  return arena_create(NULL, chunk_size);
+}
+
+struct lkl_arena* lkl_arena_create_child(struct lkl_arena* parent, size_t chunk_size)
+{
+  return arena_create(parent, chunk_size);
+}
+
+void* lkl_arena_alloc(struct lkl_arena* arena, size_t size)
+{
+  return lkl_arena_alloc_aligned(arena, size, ARENA_DEFAULT_ALIGNMENT);
+}
+
+void* lkl_arena_alloc_aligned(struct lkl_arena* arena, size_t size, size_t alignment)
+{
+  if (size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    return NULL;
+  }
+
+  char* allocation = bump_alloc(arena->current, arena->bump, size, alignment);
+  if (!allocation) {
+    return alloc_from_next_chunk(arena, size, alignment);
+  }
+  arena->bump = allocation + size;
+  return allocation;
+}
+
+void lkl_arena_reset(struct lkl_arena* arena)
+{
+  arena->current = arena->first;
+  arena->bump = chunk_start(arena, arena->first);
+}
+
+void lkl_arena_destroy(struct lkl_arena* arena)
+{
+  if (arena->parent) {
+    return;
+  }
+
+  // The arena is freed along with its first chunk so nothing in it is read after that
+  struct arena_chunk* chunk = arena->first;
+  while (chunk) {
+    struct arena_chunk* next = chunk->next;
+    lkl_free(chunk);
+    chunk = next;
+  }
+}
+
+struct lkl_arena* arena_create(struct lkl_arena* parent, size_t chunk_size)
+{
+  if (!chunk_size) {
+    chunk_size = ARENA_DEFAULT_CHUNK_SIZE;
+  }
+  if (chunk_size < sizeof(struct arena_chunk) + sizeof(struct lkl_arena)) {
+    chunk_size = sizeof(struct arena_chunk) + sizeof(struct lkl_arena);
+  }
+
+  struct arena_chunk* chunk = new_chunk(parent, chunk_size);
+  if (!chunk) {
+    return NULL;
+  }
+
+  struct lkl_arena* arena = (struct lkl_arena*)(chunk + 1);
+  arena->first = chunk;
+  arena->current = chunk;
+  arena->chunk_size = chunk_size;
+  arena->parent = parent;
+  arena->bump = chunk_start(arena, chunk);
+  return arena;
+}
+
+struct arena_chunk* new_chunk(struct lkl_arena* parent, size_t chunk_size)
+{
+  struct arena_chunk* chunk;
+  if (parent) {
+    chunk = (struct arena_chunk*)lkl_arena_alloc(parent, chunk_size);
+  } else {
+    chunk = (struct arena_chunk*)lkl_malloc(chunk_size);
+    // Any space lkl_malloc rounded up to is used too
+    chunk_size = chunk ? lkl_malloc_usable_size(chunk) : 0;
+  }
+  if (!chunk) {
+    return NULL;
+  }
+
+  chunk->next = NULL;
+  chunk->end = (char*)chunk + chunk_size;
+  return chunk;
+}
+
+char* chunk_start(struct lkl_arena* arena, struct arena_chunk* chunk)
+{
+  if (chunk == arena->first) {
+    return (char*)(arena + 1);
+  }
+  return (char*)(chunk + 1);
+}
+
+// Returns where an allocation starting at or after bump would go, or NULL if it does not fit in the chunk.
+char* bump_alloc(struct arena_chunk* chunk, char* bump, size_t size, size_t alignment)
+{
+  uintptr_t start = ((uintptr_t)bump + alignment - 1) & ~(alignment - 1);
+  if (start < (uintptr_t)bump || start > (uintptr_t)chunk->end || size > (uintptr_t)chunk->end - start) {
+    return NULL;
+  }
+  return (char*)start;
+}
+
+// Moves on to the chunk after the current one, which is there if the arena was reset, or adds a new chunk
+// there if the request does not fit. Space left at the end of the current chunk goes unused until a reset.
+void* alloc_from_next_chunk(struct lkl_arena* arena, size_t size, size_t alignment)
+{
+  struct arena_chunk* next = arena->current->next;
+  char* allocation = next ? bump_alloc(next, chunk_start(arena, next), size, alignment) : NULL;
+
+  if (!allocation) {
+    if (size > (size_t)-1 - alignment - sizeof(struct arena_chunk)) {
+      return NULL;
+    }
+    size_t needed = sizeof(struct arena_chunk) + alignment + size;
+    struct arena_chunk* added = new_chunk(arena->parent, needed > arena->chunk_size ? needed : arena->chunk_size);
+    if (!added) {
+      return NULL;
+    }
+    added->next = next;
+    arena->current->next = added;
+    next = added;
+    allocation = bump_alloc(next, chunk_start(arena, next), size, alignment);
+  }
+
+  arena->current = next;
+  arena->bump = allocation + size;
+  return allocation;
+}
@@ -1,54 +1,457 @@
 // Linked list implementation of malloc
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // mremap
+#endif
+
 #include "custom_allocator/lkl_malloc.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Restartable sequences are used on x86-64 when glibc registers every thread for them, which it does from 2.35
+#if defined(__x86_64__) && defined(__GLIBC__) && __has_include(<sys/rseq.h>)
+#include <linux/membarrier.h>
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#define LKL_HAVE_RSEQ 1
+#endif
+
 static void* global_base = NULL;
 
+// Every block starts with a single word holding the size of the whole block, header included,
+// with the flags below packed into its low bits. Use get_block_size and get_block_flag to read it.
 struct block_meta
 {
-  size_t block_size;
-  struct block_meta* next;
-  int is_free;
+  size_t size_and_flags;
+};
+
+#define BLOCK_FREE 0x1       // The block is in a bin
+#define BLOCK_PREV_FREE 0x2  // The block physically before this one is free so its footer is valid
+#define BLOCK_LAST 0x4       // No block physically follows this one in its region of the heap
+#define BLOCK_MMAPPED 0x8    // The block is a mapping of its own and is not part of the heap
+
+// A mapped block has no neighbour to be free, so for it that bit says the mapping is of explicit huge pages
+#define BLOCK_HUGETLB BLOCK_PREV_FREE
+
+// A free block keeps the links of its bin in its payload, so an allocated block pays only for the header.
+struct free_block
+{
+  struct block_meta meta;
+  struct free_block* next;  // Next free block in the same bin
+  struct free_block* prev;  // Previous free block in the same bin
+};
+
+// Every payload is aligned to SIZE_CLASS_GRANULE, which is at least alignof(max_align_t), so any object
+// can be stored in a block and vector loads on the payload never split a cache line. Whole blocks are
+// multiples of it, so each header sits in the last word of a granule and the break is moved to such a
+// word before the heap grows. That leaves the low bits of every block size free for the flags.
+#define SIZE_CLASS_GRANULE (2 * sizeof(size_t))
+#define BLOCK_FLAGS (SIZE_CLASS_GRANULE - 1)
+
+static_assert(SIZE_CLASS_GRANULE >= __alignof__(max_align_t), "payloads must be aligned for any object");
+static_assert(BLOCK_MMAPPED <= BLOCK_FLAGS, "flags must fit below the size granule");
+
+// Free blocks repeat their payload size in its last word (a boundary tag) so the block that follows can
+// find its start without walking the heap. The payload must therefore fit the bin links and that word.
+#define MIN_BLOCK_PAYLOAD (sizeof(struct free_block) - sizeof(struct block_meta) + sizeof(size_t))
+
+static_assert((MIN_BLOCK_PAYLOAD + sizeof(struct block_meta)) % SIZE_CLASS_GRANULE == 0, "smallest block must fill whole granules");
+
+// The most recently created block and the end of the space it occupies. New space is only joined to
+// heap_tail when sbrk hands back memory starting at heap_end, otherwise something else moved the break
+// and the new space starts a separate region.
+static struct block_meta* heap_tail = NULL;
+static char* heap_end = NULL;
+
+// Free blocks are kept in segregated bins so a request only ever looks at blocks that could satisfy it.
+// Requests are rounded up to fill whole granules. Below SMALL_BIN_LIMIT every bin holds
+// exactly one size, at and above it each bin holds a power of two range [2^k, 2^(k+1)).
+//
+// Each bin is a circular doubly linked list headed by a sentinel so blocks can be unlinked in O(1)
+// and appended to the tail, which keeps reuse within a bin in the order blocks were freed unless
+// the placement policy below says otherwise.
+// binmap has a bit set for every non-empty bin so the next usable bin is found without walking empty ones.
+#define NUM_SMALL_BINS 64
+#define SMALL_BIN_LIMIT (NUM_SMALL_BINS * SIZE_CLASS_GRANULE)
+#define SMALL_BIN_LIMIT_LOG2 10
+#define NUM_BINS 128
+#define BINMAP_WORD_BITS 64
+#define BINMAP_WORDS (NUM_BINS / BINMAP_WORD_BITS)
+
+static_assert(SMALL_BIN_LIMIT == (size_t)1 << SMALL_BIN_LIMIT_LOG2, "SMALL_BIN_LIMIT_LOG2 must match SMALL_BIN_LIMIT");
+
+static struct free_block bins[NUM_BINS];
+static unsigned long long binmap[BINMAP_WORDS];
+
+// Which of the blocks that could serve a request is taken. A small bin holds one size so the policy only
+// picks which block of it is reused, but a large bin is also searched as far as the policy needs:
+//   first fit: the first block in the order blocks were freed
+//   next fit: the first block after the one the last search of the bin took, kept in bin_rovers
+//   best fit: the smallest block of the bin
+//   address ordered: the lowest block, as bins are kept sorted by address while the policy is in use
+// The default can be set at build time with LKL_DEFAULT_PLACEMENT and changed with LKL_M_PLACEMENT.
+#ifndef LKL_DEFAULT_PLACEMENT
+#define LKL_DEFAULT_PLACEMENT LKL_PLACEMENT_FIRST_FIT
+#endif
+
+static int placement = LKL_DEFAULT_PLACEMENT;
+static struct free_block* bin_rovers[NUM_BINS];  // Where the next search of each bin starts, its sentinel for the head
+
+// While best fit is in use the blocks of each large bin are also kept in a bitwise trie keyed by size, as
+// in dlmalloc, so the smallest block that fits is found in as many steps as the bin's sizes have bits
+// rather than by walking the bin. The bin's sizes share their leading one and a block sits wherever the
+// bits below it led when it was inserted, so every block under a node shares the bits that lead there.
+// A block whose size is already in the trie joins that node's ring instead. The trie lives in the payload
+// of the blocks, which large blocks always have room for.
+struct tree_block
+{
+  struct free_block list;
+  struct tree_block* child[2];    // Blocks whose next bit of size is 0 and 1
+  struct tree_block* parent;      // The root is its own parent, blocks that only hang off a ring have NULL
+  struct tree_block* same_next;  // Ring of the blocks of the same size
+  struct tree_block* same_prev;
+};
+
+#define NUM_TREES (NUM_BINS - NUM_SMALL_BINS)
+
+static_assert(sizeof(struct tree_block) + sizeof(size_t) <= SMALL_BIN_LIMIT, "large blocks must have room for the trie");
+
+static struct tree_block* size_trees[NUM_TREES];
+
+// Requests of at least mmap_threshold bytes are given a private anonymous mapping of their own
+// rather than a block of the heap. Freeing one unmaps it so the memory goes straight back to the OS,
+// and growing one is done with mremap which moves page table entries instead of copying.
+#define MMAP_DEFAULT_THRESHOLD (128 * 1024)
+
+static size_t mmap_threshold = MMAP_DEFAULT_THRESHOLD;
+
+// Memory is given back to the OS as it is freed. Once the free block at the top of the heap reaches
+// trim_threshold bytes the break is moved down, keeping top_pad bytes so a heap that shrinks and grows
+// again does not call sbrk every time. Freeing at least release_threshold bytes anywhere else drops the
+// whole pages of what was freed with madvise. Only the freed block's own pages are dropped, so allocating
+// and freeing next to a large free block does not drop and fault in the same pages on every call.
+// lkl_trim does both for every free block.
+#define TRIM_DEFAULT_THRESHOLD (128 * 1024)
+#define TOP_DEFAULT_PAD (64 * 1024)
+#define RELEASE_DEFAULT_THRESHOLD (1024 * 1024)
+
+static size_t trim_threshold = TRIM_DEFAULT_THRESHOLD;
+static size_t top_pad = TOP_DEFAULT_PAD;
+static size_t release_threshold = RELEASE_DEFAULT_THRESHOLD;
+
+// The heap grows and shrinks a segment at a time, keeping the break just below a multiple of heap_segment,
+// so a growing heap moves the break once per segment rather than once for every request that does not fit.
+// The whole huge pages of each new segment are marked with MADV_HUGEPAGE so the kernel can back them with
+// transparent huge pages, cutting the dTLB misses of a large heap. If the break cannot be moved to the end
+// of a segment the heap grows by only what is needed. A heap_segment of 0 always grows by only that.
+//
+// Mappings of their own of at least a huge page are marked the same way. With use_hugetlb they are first
+// tried with MAP_HUGETLB, falling back to normal pages if no explicit huge pages are reserved.
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define HEAP_DEFAULT_SEGMENT HUGE_PAGE_SIZE
+
+static size_t heap_segment = HEAP_DEFAULT_SEGMENT;
+static int use_hugetlb = 0;
+
+// Small requests are served from slabs: page sized runs of equal slots of one small size class.
+// A slab's occupancy is kept apart from it in a descriptor with a bit per slot, so slots carry no
+// header and finding a free one never touches payload memory.
+//
+// Every slab is carved from one region of address space reserved on first use, so whether a pointer
+// is a slot is a range check and its descriptor is found from its offset into the region. The
+// descriptors sit at the start of the region and both are committed SLAB_COMMIT_SLABS slabs at a time.
+// Slabs with a free slot are kept on a circular list per size class headed by a sentinel, and
+// completely free slabs are kept on empty_slabs for reuse by any size class.
+//
+// A slab is owned by the thread that last took slots from it. Slots freed by any other thread without
+// being cached, as in a producer consumer pipeline, are pushed onto the slab's remote_frees without a lock
+// and without touching the bitmap, which sits on another cache line. The first slot pushed also pushes the
+// slab onto remote_slabs, and the next allocation from the slabs collects every slab there in one batch.
+#define SLAB_SIZE 4096
+#define SLAB_MAX_SLOTS (SLAB_SIZE / SIZE_CLASS_GRANULE)
+#define SLAB_BITMAP_WORDS (SLAB_MAX_SLOTS / 64)
+#define SLAB_REGION_SLABS ((size_t)1 << 18)
+#define SLAB_COMMIT_SLABS 16
+#define SLAB_DEFAULT_MAX (SMALL_BIN_LIMIT - SIZE_CLASS_GRANULE)
+
+struct slab
+{
+  unsigned long long free_slots[SLAB_BITMAP_WORDS];  // A set bit is a free slot
+  struct slab* next;
+  struct slab* prev;
+  unsigned int slot_size;
+  unsigned int num_slots;
+  unsigned int num_free;
+  struct thread_cache* owner __attribute__((aligned(64)));  // Only a hint, so it is read without heap_lock
+  void* remote_frees;        // Slots freed by other threads, chained through their first word
+  struct slab* next_remote;  // Next slab on remote_slabs
+} __attribute__((aligned(64)));
+
+static_assert(SLAB_MAX_SLOTS % 256 == 0, "the bitmap is scanned 256 bits at a time");
+
+static struct slab* slab_descriptors = NULL;
+static char* slab_area = NULL;
+static size_t slab_area_size = 0;  // 0 until the region is reserved
+static size_t slabs_committed = 0;
+static struct slab* empty_slabs = NULL;
+static struct slab slab_lists[NUM_SMALL_BINS];
+static struct slab* remote_slabs = NULL;
+
+// Largest request served from a slab. Set to 0 if the region cannot be reserved.
+static size_t slab_max_size = SLAB_DEFAULT_MAX;
+
+// Counters of the shared heap for lkl_get_stats. Everything they count already happens under heap_lock,
+// so they are plain variables, apart from those of mappings made without it which are added to atomically.
+static size_t heap_bytes = 0;
+static unsigned long long sbrk_calls = 0;
+static unsigned long long search_lengths[LKL_STATS_SEARCH_BUCKETS];
+static size_t mapped_bytes = 0;
+static unsigned long long mmap_calls = 0;
+
+static_assert(NUM_BINS == LKL_STATS_CLASSES, "lkl_get_stats reports the free list of every bin");
+
+// Guards all of the shared heap state above as well as the break itself.
+// It is held across fork so the child never inherits it locked by a thread that no longer exists.
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Each thread keeps a cache of recently freed blocks for every small size class so most
+// lkl_malloc/lkl_free calls never touch heap_lock. Cached blocks still look allocated to the
+// shared heap or slab and are chained through the first word of their payload. A block is cached
+// under the largest multiple of SIZE_CLASS_GRANULE it holds and a request looks in the class of
+// its size rounded up to one, as heap blocks and slots of a class differ in size. An empty cache is refilled
+// and a full one drained TCACHE_BATCH_DIVISOR-th of the limit at a time under a single lock.
+#define TCACHE_DEFAULT_COUNT 32
+#define TCACHE_BATCH_DIVISOR 2
+
+enum tcache_state
+{
+  TCACHE_UNINITIALISED = 0,
+  TCACHE_INITIALISING,  // Registering for thread exit, which may itself allocate
+  TCACHE_ACTIVE,
+  TCACHE_DISABLED,  // The thread is exiting and its cache has been flushed
+};
+
+// Each thread also counts the allocations it hands out and frees in its cache, so counting never
+// contends with another thread. Caches are linked on live_caches while their thread runs and lkl_get_stats
+// sums them under heap_lock. An exiting thread folds its counts into retired_stats, which is also
+// added to atomically by any thread that has no cache.
+enum thread_stat
+{
+  STAT_ALLOCATIONS = 0,
+  STAT_FREES,
+  STAT_ALLOCATED_BYTES,
+  STAT_FREED_BYTES,
+  NUM_THREAD_STATS,
+};
+
+struct thread_cache
+{
+  void* entries[NUM_SMALL_BINS];
+  unsigned int counts[NUM_SMALL_BINS];
+  enum tcache_state state;
+  unsigned long long stats[NUM_THREAD_STATS];
+  struct thread_cache* next_live;
+  struct thread_cache* prev_live;
 };
 
-static inline struct block_meta* find_free_block(struct block_meta** last_block, size_t request_size);
-static inline struct block_meta* request_space(struct block_meta* last_block, size_t request_size);
+// initial-exec so reaching the cache never calls into the dynamic loader, which may itself allocate,
+// when the allocator is built as a shared library standing in for malloc.
+static __thread struct thread_cache tcache __attribute__((tls_model("initial-exec")));
+static unsigned int tcache_max_count = TCACHE_DEFAULT_COUNT;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static struct thread_cache* live_caches = NULL;
+static unsigned long long retired_stats[NUM_THREAD_STATS];
+
+// With LKL_M_PERCPU_COUNT set, small blocks are cached per CPU instead of per thread, so a process of
+// thousands of mostly idle threads caches no more than one with a thread per CPU. Each CPU keeps a stack
+// of blocks for every small size class, filled and emptied in batches like the thread caches.
+//
+// With rseq a push or pop is a restartable sequence: it indexes the stacks with the CPU number the kernel
+// keeps in the thread's rseq area and ends in a single store that commits it. The kernel sends a thread
+// that is preempted or migrated before that store back to the start, so no atomic instruction is needed.
+// Without rseq the CPU comes from sched_getcpu and its stacks are guarded by a spin lock that is only
+// contended when its holder was preempted or moved, so a waiter yields rather than spins. CPU numbers
+// are not promised to stay below the configured count, so one more cache, always used under its lock,
+// is shared by any CPU without a cache of its own.
+//
+// percpu_max_count is stored last when the mode is turned on, with release ordering, so a thread that
+// reads it as non zero also sees the caches. Lowering it first sets it to 0, which every sequence reads
+// inside itself, then fences off the sequences already running with membarrier. No cache is touched
+// from then on, so every one of them can be emptied back to the heap before the new count is stored.
+#define PERCPU_MAX_COUNT 64
+
+struct cpu_cache
+{
+  size_t counts[NUM_SMALL_BINS];
+  void* entries[NUM_SMALL_BINS][PERCPU_MAX_COUNT];
+  int lock;  // Only used without rseq, and for the spare
+} __attribute__((aligned(64)));
+
+static struct cpu_cache* cpu_caches = NULL;  // One for every configured CPU and the spare, mapped when first turned on
+static size_t num_cpus = 0;                  // Configured CPUs, which is also the index of the spare
+static unsigned int percpu_max_count = 0;    // Read and written atomically, 0 when the mode is off
+static int percpu_use_rseq = 0;
+
+static inline size_t align_request(size_t requested_size);
+static inline size_t align_granule(size_t size);
+static inline struct block_meta* heap_malloc(size_t request_size);
+static inline size_t heap_malloc_batch(size_t request_size, size_t num, void** out);
+static inline size_t carve_blocks(struct block_meta* block, size_t request_size, void** out);
+static inline struct block_meta* heap_align_block(struct block_meta* block, size_t alignment, size_t request_size);
+static inline void heap_free(struct block_meta* block);
+static inline struct block_meta* return_free_block(struct block_meta* block);
+static inline int heap_resize(struct block_meta* block, size_t request_size);
+static inline struct block_meta* find_free_block(size_t request_size);
+static inline struct free_block* search_bin(size_t idx, size_t request_size, size_t* length);
+static inline struct block_meta* take_free_tail(size_t request_size);
+static inline struct block_meta* request_space(size_t request_size);
+static inline void* sbrk_aligned(size_t increment);
+static inline void* grow_heap(size_t* increment);
+static inline void advise_huge_pages(char* start, char* end);
+static inline void* move_break(intptr_t increment);
+static inline struct block_meta* add_heap_block(void* start, size_t block_size);
+static inline int extend_heap_tail(size_t increment);
 static inline struct block_meta* get_block_ptr(void* ptr);
+static inline int heap_trim(size_t pad);
+static inline int release_free_pages(struct block_meta* block, uintptr_t start, uintptr_t end);
+static inline size_t get_block_size(struct block_meta* block);
+static inline void set_block_size(struct block_meta* block, size_t block_size);
+static inline int get_block_flag(struct block_meta* block, size_t flag);
+static inline void set_block_flag(struct block_meta* block, size_t flag, int value);
+static inline void init_block(struct block_meta* block, size_t block_size, size_t flags);
+
+static inline void init_bins(void);
+static inline struct block_meta* next_block(struct block_meta* block);
+static inline struct block_meta* prev_block(struct block_meta* block);
+static inline void set_footer(struct block_meta* block);
+static inline void split_block(struct block_meta* block, size_t request_size);
+static inline struct block_meta* coalesce(struct block_meta* block);
+static inline size_t bin_index(size_t size);
+static inline size_t next_nonempty_bin(size_t start_idx);
+static inline void insert_free_block(struct block_meta* block);
+static inline void remove_free_block(struct block_meta* block);
+static inline void set_placement(int policy);
+static inline size_t tree_key(size_t idx, size_t size);
+static inline void tree_insert(size_t idx, struct free_block* block);
+static inline void tree_remove(size_t idx, struct free_block* block);
+static inline struct free_block* tree_search(size_t idx, size_t request_size, size_t* length);
+
+static inline void* locked_malloc(size_t requested_size);
+static inline void locked_free(void* ptr);
+static inline void free_slot(void* ptr, size_t slot_size);
+
+static inline int is_slab_slot(void* ptr);
+static inline struct slab* slab_of(void* ptr);
+static inline char* slab_start(struct slab* slab);
+static inline void* slab_malloc(size_t request_size);
+static inline void slab_free(void* ptr);
+static inline struct slab* slab_new(size_t slot_size);
+static inline size_t slab_find_free_slot(struct slab* slab);
+static inline void slab_free_remote(struct slab* slab, void* first, void* last);
+static inline void slab_collect_remote(void);
+static inline int slab_reserve(void);
+static inline int slab_commit(void);
+
+static inline size_t get_page_size(void);
+static inline size_t page_align(size_t size);
+static inline char* mapping_start(struct block_meta* block);
+static inline struct block_meta* mmap_block(size_t request_size, size_t alignment);
+static inline void munmap_block(struct block_meta* block);
+static inline struct block_meta* mremap_block(struct block_meta* block, size_t request_size);
+
+static inline int tcache_usable(void);
+static inline void* tcache_get(size_t requested_size);
+static inline int tcache_put(void* ptr, size_t size);
+static inline void* tcache_refill(size_t requested_size);
+static inline void tcache_drain(size_t idx, unsigned int num_blocks);
+static void tcache_flush(void);
+static void tcache_thread_exit(void* unused);
+static void tcache_create_key(void);
+
+static inline int percpu_enable(void);
+static inline void* percpu_pop(size_t idx);
+static inline int percpu_push(size_t idx, void* ptr);
+static inline struct cpu_cache* percpu_lock(void);
+static inline void percpu_lock_cache(struct cpu_cache* cache);
+static inline void percpu_unlock(struct cpu_cache* cache);
+static inline void* percpu_refill(size_t requested_size);
+static inline int percpu_put(void* ptr, size_t size);
+static inline void percpu_drain(size_t idx, unsigned int num_blocks);
+static inline void percpu_flush(void);
+static inline void percpu_set_count(unsigned int count);
+#ifdef LKL_HAVE_RSEQ
+static inline struct rseq* rseq_area(void);
+static inline int rseq_pop(size_t idx, void** ptr);
+static inline int rseq_push(size_t idx, void* ptr, int* pushed);
+#endif
+static inline int cache_put(void* ptr, size_t size);
+
+static inline void stats_add(enum thread_stat stat, size_t amount);
+static inline void* stats_malloc(void* payload);
+static inline void stats_free(void* ptr);
+static inline void stats_resize(size_t old_size, size_t new_size);
+static inline void stats_search(size_t length);
+
+static void heap_lock_prepare(void);
+static void heap_lock_parent(void);
+static void heap_lock_child(void);
 
-// TODO: Thread safe version
 void* lkl_malloc(size_t requested_size)
 {
   struct block_meta* block_to_give;
-  // TODO: Align size
+  void* payload;
 
   if (requested_size <= 0) {
     return NULL;
   }
 
-  if (!global_base) {
-    block_to_give = request_space(NULL, requested_size);
-    if (!block_to_give) {
-      return NULL;
+  size_t request_size = align_request(requested_size);
+  if (!request_size) {
+    return NULL;
+  }
+
+  if (request_size >= mmap_threshold) {
+    block_to_give = mmap_block(request_size, SIZE_CLASS_GRANULE);
+    if (block_to_give) {
+      return stats_malloc(block_to_give + 1);
     }
-    global_base = block_to_give;
-  } else {
-    struct block_meta* last = (struct block_meta*)global_base;
-    block_to_give = find_free_block(&last, requested_size);
-    if (!block_to_give) {
-      block_to_give = request_space(last, requested_size);
-      if (!block_to_give) {
-        return NULL;
-      }
-    } else {
-      // TODO: split block
-      block_to_give->is_free = 0;
+    // Fall back to the heap if the mapping could not be made
+  }
+
+  if (align_granule(requested_size) < SMALL_BIN_LIMIT && __atomic_load_n(&percpu_max_count, __ATOMIC_ACQUIRE)) {
+    // The thread is still registered so it keeps counting into counters of its own
+    if (tcache.state == TCACHE_UNINITIALISED) {
+      tcache_usable();
+    }
+    payload = percpu_pop(bin_index(align_granule(requested_size)));
+    if (!payload) {
+      payload = percpu_refill(requested_size);
     }
+  } else if (align_granule(requested_size) < SMALL_BIN_LIMIT && tcache_usable()) {
+    payload = tcache_get(requested_size);
+    if (!payload) {
+      payload = tcache_refill(requested_size);
+    }
+  } else {
+    pthread_mutex_lock(&heap_lock);
+    payload = locked_malloc(requested_size);
+    pthread_mutex_unlock(&heap_lock);
   }
 
-  return (block_to_give + 1);
+  return stats_malloc(payload);
 }
 
 void* lkl_realloc(void* ptr, size_t requested_size)
@@ -58,26 +461,66 @@ void* lkl_realloc(void* ptr, size_t requested_size)
     return lkl_malloc(requested_size);
   }
 
-  // Requested size is a shrink relative to block. 
-  // At the moment do nothing.
-  // Potentially do a block split in the future.
-  //
-  // Resizing on 0 size where memory for new object is not allocated
-  // is implementation specific on freeing the old object (see 7.22.3.5).
-  // For this implementation it is chosen to not free.
-  struct block_meta* curr_block_ptr = get_block_ptr(ptr);
-  if (curr_block_ptr->block_size >= requested_size) {
-    return ptr;
+  size_t curr_size;
+  if (is_slab_slot(ptr)) {
+    // A slot cannot change size, so the object only stays where it is if it still fits
+    curr_size = slab_of(ptr)->slot_size;
+    if (requested_size <= curr_size) {
+      return ptr;
+    }
+  } else {
+    struct block_meta* curr_block_ptr = get_block_ptr(ptr);
+    if (get_block_flag(curr_block_ptr, BLOCK_MMAPPED)) {
+      curr_size = get_block_size(curr_block_ptr);
+      struct block_meta* remapped = mremap_block(curr_block_ptr, requested_size);
+      if (remapped) {
+        stats_resize(curr_size, get_block_size(remapped));
+        return (remapped + 1);
+      }
+      // Older kernels cannot resize mappings of explicit huge pages at all
+      if (requested_size <= curr_size) {
+        return ptr;
+      }
+    } else {
+      // Try to resize the block where it is. A shrink releases the tail of the block if it is large
+      // enough to be a block of its own, and a grow takes over a free block that follows or moves
+      // the break if the block is at the top of the heap. Growing past the mmap threshold moves the
+      // block to a mapping instead so any further growth is done with mremap.
+      //
+      // Resizing on 0 size where memory for new object is not allocated
+      // is implementation specific on freeing the old object (see 7.22.3.5).
+      // For this implementation it is chosen to not free, the block is shrunk as far as it can be.
+      size_t request_size = requested_size ? align_request(requested_size) : MIN_BLOCK_PAYLOAD;
+      if (!request_size) {
+        errno = ENOMEM;
+        return NULL;
+      }
+
+      curr_size = get_block_size(curr_block_ptr);
+      if (curr_size >= request_size && curr_size < request_size + sizeof(struct block_meta) + MIN_BLOCK_PAYLOAD) {
+        return ptr;
+      }
+
+      if (request_size <= curr_size || request_size < mmap_threshold) {
+        pthread_mutex_lock(&heap_lock);
+        int resized = heap_resize(curr_block_ptr, request_size);
+        pthread_mutex_unlock(&heap_lock);
+        if (resized) {
+          stats_resize(curr_size, get_block_size(curr_block_ptr));
+          return ptr;
+        }
+      }
+    }
   }
 
-  // Requested size is a expand. Allocate some new memory
+  // The block cannot grow where it is. Allocate some new memory
   // and free up the existing memory after the copy.
   void* new_allocation = lkl_malloc(requested_size);
   if (!new_allocation) {
-    // TODO: set ERRNO
+    errno = ENOMEM;
     return NULL;
   }
-  memcpy(new_allocation, ptr, curr_block_ptr->block_size);
+  memcpy(new_allocation, ptr, curr_size);
   lkl_free(ptr);
   return new_allocation;
 }
@@ -91,17 +534,25 @@ void* lkl_realloc(void* ptr, size_t requested_size)
 //       an error, or the behavior is as if the size were
 //       some nonzero value, except that the returned pointer
 //       shall not be used to access an object.
-//       C17dr  7.22.3 1"
+//       C17dr � 7.22.3 1"
 //
 void* lkl_calloc(size_t num_elem, size_t elem_size)
 {
-  size_t total_size = num_elem * elem_size;  // Potential overflow if product is too large
+  size_t total_size;
+  if (__builtin_mul_overflow(num_elem, elem_size, &total_size)) {
+    return NULL;
+  }
   void* new_allocation = lkl_malloc(total_size);
 
   if (new_allocation == NULL) {
     return NULL;
   }
 
+  // Fresh anonymous mappings are already zero filled
+  if (!is_slab_slot(new_allocation) && get_block_flag(get_block_ptr(new_allocation), BLOCK_MMAPPED)) {
+    return new_allocation;
+  }
+
   memset(new_allocation, 0, total_size);
   return new_allocation;
 }
@@ -111,46 +562,2089 @@ void lkl_free(void* ptr)
   if (!ptr) {
     return;
   }
+  stats_free(ptr);
+
+  if (is_slab_slot(ptr)) {
+    free_slot(ptr, slab_of(ptr)->slot_size);
+    return;
+  }
 
-  // TODO: merge blocks
   struct block_meta* block_ptr = get_block_ptr(ptr);
-  assert(block_ptr->is_free == 0);
-  block_ptr->is_free = 1;
+  assert(!get_block_flag(block_ptr, BLOCK_FREE));
+
+  if (get_block_flag(block_ptr, BLOCK_MMAPPED)) {
+    munmap_block(block_ptr);
+    return;
+  }
+
+  size_t block_size = get_block_size(block_ptr);
+  if (block_size < SMALL_BIN_LIMIT && cache_put(ptr, block_size)) {
+    return;
+  }
+
+  pthread_mutex_lock(&heap_lock);
+  heap_free(block_ptr);
+  pthread_mutex_unlock(&heap_lock);
 }
 
-struct block_meta* find_free_block(struct block_meta** last_block, size_t request_size)
+// Slots are told apart from heap blocks by their address alone and the requested size rounds up to the
+// slot size, so a slot is freed without touching its slab's descriptor unless it has to go back to the slab.
+// Heap blocks vary in size and may be mappings, so they are freed by lkl_free.
+void lkl_free_sized(void* ptr, size_t size)
 {
-  struct block_meta* current = (struct block_meta*)global_base;
-  while (current && !(current->is_free && current->block_size >= request_size)) {
-    *last_block = current;
-    current = current->next;
+  if (!ptr || !size || size >= SMALL_BIN_LIMIT || !is_slab_slot(ptr)) {
+    lkl_free(ptr);
+    return;
   }
-  return current;
+  size_t slot_size = align_granule(size);
+  assert(slab_of(ptr)->slot_size == slot_size);
+
+  stats_add(STAT_FREES, 1);
+  stats_add(STAT_FREED_BYTES, slot_size);
+  free_slot(ptr, slot_size);
 }
 
-struct block_meta* request_space(struct block_meta* last_block, size_t request_size)
+size_t lkl_malloc_batch(size_t requested_size, size_t num, void** out)
 {
-  struct block_meta* requested_block = (struct block_meta*)sbrk(0);
-  void* requested_alloc = (struct block_meta*)sbrk((intptr_t)(request_size + sizeof(struct block_meta)));
+  if (requested_size <= 0) {
+    return 0;
+  }
+  size_t request_size = align_request(requested_size);
+  if (!request_size) {
+    return 0;
+  }
 
-  if (requested_alloc == (void*)-1) {
+  // Mappings are made without the lock anyway
+  size_t count = 0;
+  if (request_size >= mmap_threshold) {
+    while (count < num && (out[count] = lkl_malloc(requested_size))) {
+      count++;
+    }
+    return count;
+  }
+
+  pthread_mutex_lock(&heap_lock);
+  if (requested_size <= slab_max_size) {
+    while (count < num && (out[count] = slab_malloc(align_granule(requested_size)))) {
+      count++;
+    }
+  }
+  count += heap_malloc_batch(request_size, num - count, out + count);
+  pthread_mutex_unlock(&heap_lock);
+
+  for (size_t idx = 0; idx < count; idx++) {
+    stats_malloc(out[idx]);
+  }
+  return count;
+}
+
+// The lock is only taken once a pointer needs it, so a batch of mappings never takes it.
+void lkl_free_batch(void** ptrs, size_t num)
+{
+  int locked = 0;
+  for (size_t idx = 0; idx < num; idx++) {
+    void* ptr = ptrs[idx];
+    if (!ptr) {
+      continue;
+    }
+    stats_free(ptr);
+    if (!is_slab_slot(ptr) && get_block_flag(get_block_ptr(ptr), BLOCK_MMAPPED)) {
+      munmap_block(get_block_ptr(ptr));
+      continue;
+    }
+    if (!locked) {
+      pthread_mutex_lock(&heap_lock);
+      locked = 1;
+    }
+    locked_free(ptr);
+  }
+  if (locked) {
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+void* lkl_memalign(size_t alignment, size_t requested_size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    return NULL;
+  }
+  if (alignment <= SIZE_CLASS_GRANULE) {
+    return lkl_malloc(requested_size);
+  }
+
+  if (requested_size <= 0) {
+    return NULL;
+  }
+
+  size_t request_size = align_request(requested_size);
+  if (!request_size || request_size > (size_t)-1 - alignment - sizeof(struct block_meta) - MIN_BLOCK_PAYLOAD) {
     return NULL;
   }
 
-  assert(requested_alloc == requested_block);
+  // Enough room that wherever the block lands an aligned payload can be carved out of it
+  // with a free block of its own in front.
+  size_t padded_size = request_size + alignment + sizeof(struct block_meta) + MIN_BLOCK_PAYLOAD;
 
-  if (last_block) {
-    last_block->next = requested_block;
+  struct block_meta* block_to_give;
+  if (padded_size >= mmap_threshold) {
+    block_to_give = mmap_block(request_size, alignment);
+    if (block_to_give) {
+      return stats_malloc(block_to_give + 1);
+    }
   }
 
-  requested_block->block_size = request_size;
-  requested_block->next = NULL;
-  requested_block->is_free = 0;
+  pthread_mutex_lock(&heap_lock);
+  block_to_give = heap_malloc(padded_size);
+  if (block_to_give) {
+    block_to_give = heap_align_block(block_to_give, alignment, request_size);
+  }
+  pthread_mutex_unlock(&heap_lock);
 
-  return requested_block;
+  if (!block_to_give) {
+    return NULL;
+  }
+  return stats_malloc(block_to_give + 1);
 }
 
-struct block_meta* get_block_ptr(void* ptr)
+void* lkl_aligned_alloc(size_t alignment, size_t requested_size)
 {
-  return ((struct block_meta*)ptr - 1);
-}
\ No newline at end of file
+  return lkl_memalign(alignment, requested_size);
+}
+
+int lkl_posix_memalign(void** memptr, size_t alignment, size_t requested_size)
+{
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void*) != 0) {
+    return EINVAL;
+  }
+
+  if (requested_size == 0) {
+    *memptr = NULL;
+    return 0;
+  }
+
+  void* new_allocation = lkl_memalign(alignment, requested_size);
+  if (!new_allocation) {
+    return ENOMEM;
+  }
+  *memptr = new_allocation;
+  return 0;
+}
+
+size_t lkl_malloc_usable_size(void* ptr)
+{
+  if (!ptr) {
+    return 0;
+  }
+  if (is_slab_slot(ptr)) {
+    return slab_of(ptr)->slot_size;
+  }
+  return get_block_size(get_block_ptr(ptr));
+}
+
+int lkl_trim(size_t pad)
+{
+  int released = 0;
+
+  // Cached blocks look allocated to the heap and could keep the top of it in use
+  if (tcache.state == TCACHE_ACTIVE) {
+    tcache_flush();
+  }
+  if (cpu_caches) {
+    percpu_flush();
+  }
+
+  pthread_mutex_lock(&heap_lock);
+  if (global_base) {
+    released |= heap_trim(pad);
+    for (size_t idx = 0; idx < NUM_BINS; idx++) {
+      for (struct free_block* current = bins[idx].next; current != &bins[idx]; current = current->next) {
+        if (&current->meta != heap_tail) {
+          uintptr_t payload = (uintptr_t)(&current->meta + 1);
+          released |= release_free_pages(&current->meta, payload, payload + get_block_size(&current->meta));
+        }
+      }
+    }
+  }
+  for (struct slab* slab = empty_slabs; slab; slab = slab->next) {
+    released |= madvise(slab_start(slab), SLAB_SIZE, MADV_DONTNEED) == 0;
+  }
+  pthread_mutex_unlock(&heap_lock);
+
+  return released;
+}
+
+int lkl_mallopt(int param, int value)
+{
+  switch (param) {
+  case LKL_M_TCACHE_COUNT:
+    if (value < 0) {
+      return 0;
+    }
+    tcache_max_count = (unsigned int)value;
+    return 1;
+  case LKL_M_MMAP_THRESHOLD:
+    if (value <= 0) {
+      return 0;
+    }
+    mmap_threshold = (size_t)value;
+    return 1;
+  case LKL_M_SLAB_MAX:
+    if (value < 0 || (size_t)value >= SMALL_BIN_LIMIT) {
+      return 0;
+    }
+    slab_max_size = (size_t)value;
+    return 1;
+  case LKL_M_TRIM_THRESHOLD:
+    if (value <= 0) {
+      return 0;
+    }
+    trim_threshold = (size_t)value;
+    return 1;
+  case LKL_M_TOP_PAD:
+    if (value < 0) {
+      return 0;
+    }
+    top_pad = (size_t)value;
+    return 1;
+  case LKL_M_RELEASE_THRESHOLD:
+    if (value <= 0) {
+      return 0;
+    }
+    release_threshold = (size_t)value;
+    return 1;
+  case LKL_M_PLACEMENT:
+    if (value < LKL_PLACEMENT_FIRST_FIT || value > LKL_PLACEMENT_ADDRESS_ORDERED) {
+      return 0;
+    }
+    pthread_mutex_lock(&heap_lock);
+    set_placement(value);
+    pthread_mutex_unlock(&heap_lock);
+    return 1;
+  case LKL_M_PERCPU_COUNT: {
+    if (value < 0 || value > PERCPU_MAX_COUNT) {
+      return 0;
+    }
+    pthread_mutex_lock(&heap_lock);
+    int enabled = value == 0 || cpu_caches || percpu_enable();
+    if (enabled) {
+      percpu_set_count((unsigned int)value);
+    }
+    pthread_mutex_unlock(&heap_lock);
+    return enabled;
+  }
+  case LKL_M_HEAP_SEGMENT:
+    if (value < 0 || (value & (value - 1)) != 0 || (value && (size_t)value < get_page_size())) {
+      return 0;
+    }
+    pthread_mutex_lock(&heap_lock);
+    heap_segment = (size_t)value;
+    pthread_mutex_unlock(&heap_lock);
+    return 1;
+  case LKL_M_HUGETLB:
+    if (value != 0 && value != 1) {
+      return 0;
+    }
+    use_hugetlb = value;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+struct lkl_stats lkl_get_stats(void)
+{
+  struct lkl_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  unsigned long long totals[NUM_THREAD_STATS];
+
+  pthread_mutex_lock(&heap_lock);
+  for (size_t stat = 0; stat < NUM_THREAD_STATS; stat++) {
+    totals[stat] = __atomic_load_n(&retired_stats[stat], __ATOMIC_RELAXED);
+    for (struct thread_cache* cache = live_caches; cache; cache = cache->next_live) {
+      totals[stat] += __atomic_load_n(&cache->stats[stat], __ATOMIC_RELAXED);
+    }
+  }
+
+  if (global_base) {
+    for (size_t idx = 0; idx < NUM_BINS; idx++) {
+      for (struct free_block* current = bins[idx].next; current != &bins[idx]; current = current->next) {
+        size_t block_size = get_block_size(&current->meta);
+        stats.free_blocks[idx]++;
+        stats.free_bytes += block_size;
+        if (block_size > stats.largest_free_block) {
+          stats.largest_free_block = block_size;
+        }
+      }
+    }
+  }
+
+  stats.heap_bytes = heap_bytes;
+  stats.sbrk_calls = sbrk_calls;
+  memcpy(stats.search_lengths, search_lengths, sizeof(search_lengths));
+  stats.mapped_bytes = slabs_committed * SLAB_SIZE + page_align(slabs_committed * sizeof(struct slab));
+  pthread_mutex_unlock(&heap_lock);
+
+  stats.mapped_bytes += __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+  stats.mmap_calls = __atomic_load_n(&mmap_calls, __ATOMIC_RELAXED);
+
+  // A free counted by one thread can be seen before the allocation another thread counted
+  if (totals[STAT_ALLOCATIONS] > totals[STAT_FREES]) {
+    stats.live_allocations = (size_t)(totals[STAT_ALLOCATIONS] - totals[STAT_FREES]);
+  }
+  if (totals[STAT_ALLOCATED_BYTES] > totals[STAT_FREED_BYTES]) {
+    stats.live_bytes = (size_t)(totals[STAT_ALLOCATED_BYTES] - totals[STAT_FREED_BYTES]);
+  }
+  if (stats.free_bytes) {
+    stats.fragmentation = 1.0 - (double)stats.largest_free_block / (double)stats.free_bytes;
+  }
+  return stats;
+}
+
+// Rounds a request up to the payload of the smallest block that holds it, returning 0 if that does
+// not fit in a size_t. The block and its header fill whole granules.
+size_t align_request(size_t requested_size)
+{
+  if (requested_size > (size_t)-1 - SIZE_CLASS_GRANULE - sizeof(struct block_meta)) {
+    return 0;
+  }
+  size_t request_size = align_granule(requested_size + sizeof(struct block_meta)) - sizeof(struct block_meta);
+  return request_size < MIN_BLOCK_PAYLOAD ? MIN_BLOCK_PAYLOAD : request_size;
+}
+
+// Rounds up to a multiple of SIZE_CLASS_GRANULE. The size must leave room for that.
+size_t align_granule(size_t size)
+{
+  return (size + SIZE_CLASS_GRANULE - 1) & ~(SIZE_CLASS_GRANULE - 1);
+}
+
+// Serves a request from a slab if it is small enough and from the heap otherwise.
+// Returns the payload. Must be called with heap_lock held.
+void* locked_malloc(size_t requested_size)
+{
+  if (requested_size <= slab_max_size) {
+    void* slot = slab_malloc(align_granule(requested_size));
+    if (slot) {
+      return slot;
+    }
+    // Fall back to the heap if no slab could be made
+  }
+
+  size_t request_size = align_request(requested_size);
+  if (!request_size) {
+    return NULL;
+  }
+  struct block_meta* block = heap_malloc(request_size);
+  if (!block) {
+    return NULL;
+  }
+  return (block + 1);
+}
+
+// Caches a slot for reuse, or gives it back to its slab: through the slab's remote list if another thread
+// owns it, so only the slab's owner takes the lock.
+void free_slot(void* ptr, size_t slot_size)
+{
+  if (cache_put(ptr, slot_size)) {
+    return;
+  }
+  struct slab* slab = slab_of(ptr);
+  if (__atomic_load_n(&slab->owner, __ATOMIC_RELAXED) != &tcache) {
+    slab_free_remote(slab, ptr, ptr);
+    return;
+  }
+  pthread_mutex_lock(&heap_lock);
+  slab_free(ptr);
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// Must be called with heap_lock held.
+void locked_free(void* ptr)
+{
+  if (is_slab_slot(ptr)) {
+    slab_free(ptr);
+  } else {
+    heap_free(get_block_ptr(ptr));
+  }
+}
+
+// Must be called with heap_lock held.
+struct block_meta* heap_malloc(size_t request_size)
+{
+  struct block_meta* block_to_give;
+
+  if (!global_base) {
+    init_bins();
+    heap_tail = NULL;
+    heap_end = NULL;
+    block_to_give = request_space(request_size);
+    if (!block_to_give) {
+      return NULL;
+    }
+    global_base = block_to_give;
+  } else {
+    block_to_give = find_free_block(request_size);
+    if (block_to_give) {
+      remove_free_block(block_to_give);
+    } else {
+      block_to_give = take_free_tail(request_size);
+    }
+
+    if (!block_to_give) {
+      block_to_give = request_space(request_size);
+      if (!block_to_give) {
+        return NULL;
+      }
+    } else {
+      set_block_flag(block_to_give, BLOCK_FREE, 0);
+      split_block(block_to_give, request_size);
+
+      struct block_meta* following = next_block(block_to_give);
+      if (following) {
+        set_block_flag(following, BLOCK_PREV_FREE, 0);
+      }
+    }
+  }
+
+  return block_to_give;
+}
+
+// Allocates up to num blocks of request_size bytes by carving them out of as few heap blocks as it can,
+// each found with a single search or heap extension. A run that does not fit anywhere is halved until it
+// does. Returns how many were allocated. Must be called with heap_lock held.
+size_t heap_malloc_batch(size_t request_size, size_t num, void** out)
+{
+  size_t stride = request_size + sizeof(struct block_meta);
+  size_t count = 0;
+  size_t run = num;
+  while (count < num) {
+    if (run > num - count) {
+      run = num - count;
+    }
+    size_t run_size;
+    struct block_meta* block = NULL;
+    if (!__builtin_mul_overflow(run, stride, &run_size)) {
+      block = heap_malloc(run_size - sizeof(struct block_meta));
+    }
+    if (!block) {
+      if (run == 1) {
+        break;
+      }
+      run /= 2;
+      continue;
+    }
+    count += carve_blocks(block, request_size, out + count);
+  }
+  return count;
+}
+
+// Splits an allocated block into allocated blocks of request_size bytes, the last of which keeps
+// whatever was too small to split off. Stores their payloads in out and returns how many there are.
+size_t carve_blocks(struct block_meta* block, size_t request_size, void** out)
+{
+  size_t stride = request_size + sizeof(struct block_meta);
+  size_t last_flag = block->size_and_flags & BLOCK_LAST;
+  size_t remaining = get_block_size(block);
+  size_t count = 0;
+
+  while (remaining >= stride + request_size) {
+    struct block_meta* following = (struct block_meta*)((char*)(block + 1) + request_size);
+    init_block(following, remaining - stride, last_flag);
+    set_block_size(block, request_size);
+    set_block_flag(block, BLOCK_LAST, 0);
+    if (heap_tail == block) {
+      heap_tail = following;
+    }
+    out[count++] = block + 1;
+    remaining -= stride;
+    block = following;
+  }
+  out[count++] = block + 1;
+  return count;
+}
+
+// Frees a block that was in use, dropping its pages if it is large enough. Its free neighbours were
+// released when they were freed themselves, so their pages are left alone. Must be called with heap_lock held.
+void heap_free(struct block_meta* block)
+{
+  uintptr_t freed_start = (uintptr_t)(block + 1);
+  uintptr_t freed_end = freed_start + get_block_size(block);
+
+  block = return_free_block(block);
+  if (block != heap_tail && freed_end - freed_start >= release_threshold) {
+    release_free_pages(block, freed_start, freed_end);
+  }
+}
+
+// Merges a block with its free neighbours and puts the result in its bin, trimming the heap if it is a
+// large enough tail. Returns the merged block. Must be called with heap_lock held.
+struct block_meta* return_free_block(struct block_meta* block)
+{
+  set_block_flag(block, BLOCK_FREE, 1);
+  block = coalesce(block);
+
+  set_footer(block);
+  struct block_meta* following = next_block(block);
+  if (following) {
+    set_block_flag(following, BLOCK_PREV_FREE, 1);
+  }
+  insert_free_block(block);
+
+  if (block == heap_tail && get_block_size(block) >= trim_threshold) {
+    heap_trim(top_pad);
+  }
+  return block;
+}
+
+// Moves the start of an allocated block forward until its payload is aligned, freeing the space
+// skipped over as a block of its own, then releases whatever is left past request_size.
+// The block must have room for both. Must be called with heap_lock held.
+struct block_meta* heap_align_block(struct block_meta* block, size_t alignment, size_t request_size)
+{
+  char* payload = (char*)(block + 1);
+  if ((uintptr_t)payload % alignment != 0) {
+    uintptr_t earliest = (uintptr_t)payload + sizeof(struct block_meta) + MIN_BLOCK_PAYLOAD;
+    struct block_meta* aligned_block = (struct block_meta*)((earliest + alignment - 1) & ~(alignment - 1)) - 1;
+    size_t lead_size = (size_t)((char*)aligned_block - payload);
+
+    init_block(aligned_block, get_block_size(block) - lead_size - sizeof(struct block_meta),
+      block->size_and_flags & BLOCK_LAST);
+
+    set_block_size(block, lead_size);
+    set_block_flag(block, BLOCK_LAST, 0);
+    if (heap_tail == block) {
+      heap_tail = aligned_block;
+    }
+    return_free_block(block);
+    block = aligned_block;
+  }
+
+  split_block(block, request_size);
+  return block;
+}
+
+// Resizes an allocated block without moving it. Returns 0, leaving the block as it was,
+// if there is not enough room after it. Must be called with heap_lock held.
+int heap_resize(struct block_meta* block, size_t request_size)
+{
+  size_t curr_size = get_block_size(block);
+
+  if (curr_size < request_size) {
+    struct block_meta* following = next_block(block);
+    if (following && get_block_flag(following, BLOCK_FREE)) {
+      remove_free_block(following);
+      set_block_size(block, curr_size + sizeof(struct block_meta) + get_block_size(following));
+      set_block_flag(block, BLOCK_LAST, get_block_flag(following, BLOCK_LAST));
+      if (heap_tail == following) {
+        heap_tail = block;
+      }
+    }
+
+    if (get_block_size(block) < request_size
+      && !(block == heap_tail && extend_heap_tail(request_size - get_block_size(block)))) {
+      // Give back the free block that was taken over, if any
+      split_block(block, curr_size);
+      return 0;
+    }
+
+    following = next_block(block);
+    if (following) {
+      set_block_flag(following, BLOCK_PREV_FREE, 0);
+    }
+  }
+
+  split_block(block, request_size);
+  return 1;
+}
+
+struct block_meta* find_free_block(size_t request_size)
+{
+  size_t length = 0;
+  struct free_block* found = search_bin(bin_index(request_size), request_size, &length);
+
+  // Every block in a higher bin is large enough, so only the next non-empty one is searched
+  if (!found) {
+    size_t idx = next_nonempty_bin(bin_index(request_size) + 1);
+    if (idx != NUM_BINS) {
+      found = search_bin(idx, request_size, &length);
+    }
+  }
+
+  stats_search(length);
+  return found ? &found->meta : NULL;
+}
+
+// Finds a block of at least request_size bytes in a bin as the placement policy picks it, adding the
+// number of blocks looked at to length. Returns NULL if there is none.
+struct free_block* search_bin(size_t idx, size_t request_size, size_t* length)
+{
+  struct free_block* bin = &bins[idx];
+
+  if (placement == LKL_PLACEMENT_NEXT_FIT) {
+    struct free_block* rover = bin_rovers[idx];
+    struct free_block* current = rover;
+    do {
+      if (current != bin) {
+        (*length)++;
+        if (get_block_size(&current->meta) >= request_size) {
+          bin_rovers[idx] = current->next;
+          return current;
+        }
+      }
+      current = current->next;
+    } while (current != rover);
+    return NULL;
+  }
+
+  // A small bin holds blocks of a single size, so if its first block fits it is the first fit, the best fit
+  // and, when the bin is kept in address order, the lowest
+  if (idx < NUM_SMALL_BINS) {
+    if (bin->next == bin) {
+      return NULL;
+    }
+    (*length)++;
+    return get_block_size(&bin->next->meta) >= request_size ? bin->next : NULL;
+  }
+
+  if (placement == LKL_PLACEMENT_BEST_FIT) {
+    return tree_search(idx, request_size, length);
+  }
+
+  for (struct free_block* current = bin->next; current != bin; current = current->next) {
+    (*length)++;
+    if (get_block_size(&current->meta) >= request_size) {
+      return current;
+    }
+  }
+  return NULL;
+}
+
+// Grows a free block at the top of the heap to request_size by moving the break, so the space it
+// already has, such as what trimming left behind, is used rather than stranded below a new block.
+// Returns the block taken out of its bin, or NULL. Must be called with heap_lock held.
+struct block_meta* take_free_tail(size_t request_size)
+{
+  struct block_meta* tail = heap_tail;
+  if (!tail || !get_block_flag(tail, BLOCK_FREE) || sbrk(0) != heap_end) {
+    return NULL;
+  }
+
+  remove_free_block(tail);
+  if (!extend_heap_tail(request_size - get_block_size(tail))) {
+    insert_free_block(tail);
+    return NULL;
+  }
+  return tail;
+}
+
+// Grows the heap by a new block of request_size bytes. The rest of the segment it was taken
+// from, if any, is freed. Must be called with heap_lock held.
+struct block_meta* request_space(size_t request_size)
+{
+  if (request_size > (size_t)-1 - sizeof(struct block_meta)) {
+    return NULL;
+  }
+  size_t increment = request_size + sizeof(struct block_meta);
+  void* requested_alloc = grow_heap(&increment);
+
+  if (requested_alloc == (void*)-1) {
+    return NULL;
+  }
+
+  struct block_meta* new_block = add_heap_block(requested_alloc, increment - sizeof(struct block_meta));
+  split_block(new_block, request_size);
+  return new_block;
+}
+
+// Moves the break by at least increment, on to the end of a segment if it can, updating increment to how
+// far it moved. Returns the start of the new space as sbrk_aligned does.
+void* grow_heap(size_t* increment)
+{
+  if (heap_segment && *increment <= (size_t)INTPTR_MAX - heap_segment) {
+    void* current_break = sbrk(0);
+    if (current_break != (void*)-1) {
+      // Where sbrk_aligned will start the new space and where the segment it needs ends
+      uintptr_t start = (((uintptr_t)current_break + sizeof(struct block_meta) + SIZE_CLASS_GRANULE - 1) & ~(SIZE_CLASS_GRANULE - 1))
+                      - sizeof(struct block_meta);
+      uintptr_t end = ((start + *increment + sizeof(struct block_meta) + heap_segment - 1) & ~(heap_segment - 1)) - sizeof(struct block_meta);
+      if (end > start) {
+        void* segment = sbrk_aligned(end - start);
+        if (segment != (void*)-1) {
+          *increment = end - start;
+          advise_huge_pages((char*)segment, (char*)segment + *increment);
+          return segment;
+        }
+      }
+    }
+  }
+  return sbrk_aligned(*increment);
+}
+
+// Asks for the whole huge pages between start and end to be backed by transparent huge pages.
+// The advice is only a hint, so it failing, as it does where they are turned off, changes nothing.
+void advise_huge_pages(char* start, char* end)
+{
+#ifdef MADV_HUGEPAGE
+  uintptr_t first = ((uintptr_t)start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+  uintptr_t last = page_align((uintptr_t)end) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+  if (last > first) {
+    madvise((void*)first, last - first, MADV_HUGEPAGE);
+  }
+#else
+  (void)start;
+  (void)end;
+#endif
+}
+
+// Moves the break by increment, after first moving it up so a header placed there leaves the payload
+// aligned to SIZE_CLASS_GRANULE if something else left it elsewhere. The few bytes skipped are never used.
+// Returns the start of the new space, which is placed that way unless the break was moved by another
+// thread in between.
+void* sbrk_aligned(size_t increment)
+{
+  // sbrk takes a signed increment, so anything larger would move the break down
+  if (increment > (size_t)INTPTR_MAX - SIZE_CLASS_GRANULE) {
+    return (void*)-1;
+  }
+
+  void* current_break = sbrk(0);
+  if (current_break == (void*)-1) {
+    return current_break;
+  }
+
+  size_t misalignment = ((uintptr_t)current_break + sizeof(struct block_meta)) % SIZE_CLASS_GRANULE;
+  if (misalignment && move_break((intptr_t)(SIZE_CLASS_GRANULE - misalignment)) == (void*)-1) {
+    return (void*)-1;
+  }
+  return move_break((intptr_t)increment);
+}
+
+// sbrk, counting the call and how far the heap moved. Must be called with heap_lock held.
+void* move_break(intptr_t increment)
+{
+  void* old_break = sbrk(increment);
+  if (old_break != (void*)-1) {
+    sbrk_calls++;
+    heap_bytes += (size_t)increment;
+  }
+  return old_break;
+}
+
+// Sets up an allocated block over space fresh from sbrk.
+struct block_meta* add_heap_block(void* start, size_t block_size)
+{
+  struct block_meta* new_block = (struct block_meta*)start;
+  init_block(new_block, block_size, BLOCK_LAST);
+
+  // Join the new block onto the end of the heap if the break has not been moved by anyone else.
+  if (heap_tail && (char*)start == heap_end) {
+    set_block_flag(heap_tail, BLOCK_LAST, 0);
+    set_block_flag(new_block, BLOCK_PREV_FREE, get_block_flag(heap_tail, BLOCK_FREE));
+  }
+
+  heap_tail = new_block;
+  heap_end = (char*)(new_block + 1) + block_size;
+
+  return new_block;
+}
+
+// Grows heap_tail by moving the break. Returns 0 if the break could not be moved
+// or the new space does not directly follow heap_tail.
+int extend_heap_tail(size_t increment)
+{
+  void* requested_alloc = grow_heap(&increment);
+
+  if (requested_alloc == (void*)-1) {
+    return 0;
+  }
+
+  if ((char*)requested_alloc != heap_end) {
+    // Something else moved the break. Keep the space as a free block of a new region if it can hold one.
+    if (increment >= sizeof(struct block_meta) + MIN_BLOCK_PAYLOAD
+      && ((uintptr_t)requested_alloc + sizeof(struct block_meta)) % SIZE_CLASS_GRANULE == 0) {
+      return_free_block(add_heap_block(requested_alloc, increment - sizeof(struct block_meta)));
+    }
+    return 0;
+  }
+
+  set_block_size(heap_tail, get_block_size(heap_tail) + increment);
+  heap_end += increment;
+  return 1;
+}
+
+// Moves the break down over a free block at the top of the heap, leaving it pad bytes and ending it
+// just before a page boundary, or a segment boundary while the heap grows by segments, so the next
+// header still leaves its payload aligned. Returns 0 if nothing
+// could be given back, including when something else has moved the break past the heap.
+// Must be called with heap_lock held.
+int heap_trim(size_t pad)
+{
+  if (!heap_tail || !get_block_flag(heap_tail, BLOCK_FREE) || sbrk(0) != heap_end) {
+    return 0;
+  }
+
+  size_t block_size = get_block_size(heap_tail);
+  if (pad >= block_size) {
+    return 0;
+  }
+  size_t keep_size = pad < MIN_BLOCK_PAYLOAD ? MIN_BLOCK_PAYLOAD : pad;
+  uintptr_t keep_end = page_align((uintptr_t)(heap_tail + 1) + keep_size + sizeof(struct block_meta));
+  if (heap_segment) {
+    keep_end = (keep_end + heap_segment - 1) & ~(heap_segment - 1);
+  }
+  char* new_end = (char*)keep_end - sizeof(struct block_meta);
+  if (!keep_end || new_end >= heap_end) {
+    return 0;
+  }
+
+  size_t release_size = (size_t)(heap_end - new_end);
+  if (release_size > (size_t)INTPTR_MAX || move_break(-(intptr_t)release_size) == (void*)-1) {
+    return 0;
+  }
+
+  remove_free_block(heap_tail);
+  set_block_size(heap_tail, block_size - release_size);
+  set_footer(heap_tail);
+  insert_free_block(heap_tail);
+  heap_end = new_end;
+  return 1;
+}
+
+// Drops the whole pages between start and end inside a free block's payload, leaving its bin links, trie
+// node and boundary tag. The pages read back as zeros when next touched. Returns 0 if there is no such page.
+int release_free_pages(struct block_meta* block, uintptr_t start, uintptr_t end)
+{
+  uintptr_t first = (uintptr_t)((struct tree_block*)block + 1);
+  uintptr_t last = (uintptr_t)(block + 1) + get_block_size(block) - sizeof(size_t);
+  start = page_align(start > first ? start : first);
+  end = (end < last ? end : last) & ~(get_page_size() - 1);
+  if (end <= start) {
+    return 0;
+  }
+  return madvise((void*)start, end - start, MADV_DONTNEED) == 0;
+}
+
+struct block_meta* get_block_ptr(void* ptr)
+{
+  return ((struct block_meta*)ptr - 1);
+}
+
+// Size of the block's payload, which is what the caller may use.
+size_t get_block_size(struct block_meta* block)
+{
+  return (block->size_and_flags & ~BLOCK_FLAGS) - sizeof(struct block_meta);
+}
+
+// The payload and header together must fill whole granules.
+void set_block_size(struct block_meta* block, size_t block_size)
+{
+  block->size_and_flags = (block_size + sizeof(struct block_meta)) | (block->size_and_flags & BLOCK_FLAGS);
+}
+
+int get_block_flag(struct block_meta* block, size_t flag)
+{
+  return (block->size_and_flags & flag) != 0;
+}
+
+void set_block_flag(struct block_meta* block, size_t flag, int value)
+{
+  if (value) {
+    block->size_and_flags |= flag;
+  } else {
+    block->size_and_flags &= ~flag;
+  }
+}
+
+void init_block(struct block_meta* block, size_t block_size, size_t flags)
+{
+  block->size_and_flags = (block_size + sizeof(struct block_meta)) | flags;
+}
+
+struct block_meta* next_block(struct block_meta* block)
+{
+  if (get_block_flag(block, BLOCK_LAST)) {
+    return NULL;
+  }
+  return (struct block_meta*)((char*)(block + 1) + get_block_size(block));
+}
+
+// Only valid when BLOCK_PREV_FREE is set, as an allocated block has no footer.
+struct block_meta* prev_block(struct block_meta* block)
+{
+  size_t prev_size = *((size_t*)block - 1);
+  return (struct block_meta*)((char*)block - prev_size - sizeof(struct block_meta));
+}
+
+void set_footer(struct block_meta* block)
+{
+  size_t block_size = get_block_size(block);
+  *(size_t*)((char*)(block + 1) + block_size - sizeof(size_t)) = block_size;
+}
+
+// Carves the part of an allocated block past request_size off and puts it back in a bin, as long as that
+// part is large enough to be a block of its own. Its pages are kept, as it is mostly a free block being
+// split and lkl_trim drops them otherwise. Must be called with heap_lock held.
+void split_block(struct block_meta* block, size_t request_size)
+{
+  size_t block_size = get_block_size(block);
+  if (block_size < request_size + sizeof(struct block_meta) + MIN_BLOCK_PAYLOAD) {
+    return;
+  }
+
+  struct block_meta* remainder = (struct block_meta*)((char*)(block + 1) + request_size);
+  init_block(remainder, block_size - request_size - sizeof(struct block_meta), block->size_and_flags & BLOCK_LAST);
+
+  set_block_size(block, request_size);
+  set_block_flag(block, BLOCK_LAST, 0);
+  if (heap_tail == block) {
+    heap_tail = remainder;
+  }
+
+  return_free_block(remainder);
+}
+
+// Merges a freed block with its free physical neighbours. The neighbours are unlinked from their
+// bins and the returned block, which may start before the given one, is not in any bin.
+struct block_meta* coalesce(struct block_meta* block)
+{
+  struct block_meta* following = next_block(block);
+  if (following && get_block_flag(following, BLOCK_FREE)) {
+    remove_free_block(following);
+    set_block_size(block, get_block_size(block) + sizeof(struct block_meta) + get_block_size(following));
+    set_block_flag(block, BLOCK_LAST, get_block_flag(following, BLOCK_LAST));
+    if (heap_tail == following) {
+      heap_tail = block;
+    }
+  }
+
+  if (get_block_flag(block, BLOCK_PREV_FREE)) {
+    struct block_meta* preceding = prev_block(block);
+    remove_free_block(preceding);
+    set_block_size(preceding, get_block_size(preceding) + sizeof(struct block_meta) + get_block_size(block));
+    set_block_flag(preceding, BLOCK_LAST, get_block_flag(block, BLOCK_LAST));
+    if (heap_tail == block) {
+      heap_tail = preceding;
+    }
+    block = preceding;
+  }
+
+  return block;
+}
+
+void init_bins(void)
+{
+  for (size_t idx = 0; idx < NUM_BINS; idx++) {
+    bins[idx].next = &bins[idx];
+    bins[idx].prev = &bins[idx];
+    bin_rovers[idx] = &bins[idx];
+  }
+  memset(binmap, 0, sizeof(binmap));
+  memset(size_trees, 0, sizeof(size_trees));
+}
+
+size_t bin_index(size_t size)
+{
+  if (size < SMALL_BIN_LIMIT) {
+    return size / SIZE_CLASS_GRANULE;
+  }
+  size_t size_log2 = (sizeof(unsigned long long) * 8 - 1) - (size_t)__builtin_clzll((unsigned long long)size);
+  return NUM_SMALL_BINS + (size_log2 - SMALL_BIN_LIMIT_LOG2);
+}
+
+// Returns the index of the first non-empty bin at or after start_idx, or NUM_BINS if there is none.
+size_t next_nonempty_bin(size_t start_idx)
+{
+  size_t word_idx = start_idx / BINMAP_WORD_BITS;
+  if (word_idx >= BINMAP_WORDS) {
+    return NUM_BINS;
+  }
+
+  unsigned long long word = binmap[word_idx] & (~0ULL << (start_idx % BINMAP_WORD_BITS));
+  while (!word) {
+    if (++word_idx == BINMAP_WORDS) {
+      return NUM_BINS;
+    }
+    word = binmap[word_idx];
+  }
+  return word_idx * BINMAP_WORD_BITS + (size_t)__builtin_ctzll(word);
+}
+
+// Appends the block to its bin, or puts it before the first block above it when bins are kept sorted by address.
+void insert_free_block(struct block_meta* block)
+{
+  size_t idx = bin_index(get_block_size(block));
+  struct free_block* bin = &bins[idx];
+  struct free_block* free_block = (struct free_block*)block;
+
+  struct free_block* following = bin;
+  if (placement == LKL_PLACEMENT_ADDRESS_ORDERED) {
+    following = bin->next;
+    while (following != bin && following < free_block) {
+      following = following->next;
+    }
+  }
+
+  free_block->next = following;
+  free_block->prev = following->prev;
+  following->prev->next = free_block;
+  following->prev = free_block;
+  if (placement == LKL_PLACEMENT_BEST_FIT && idx >= NUM_SMALL_BINS) {
+    tree_insert(idx, free_block);
+  }
+
+  binmap[idx / BINMAP_WORD_BITS] |= 1ULL << (idx % BINMAP_WORD_BITS);
+}
+
+void remove_free_block(struct block_meta* block)
+{
+  struct free_block* free_block = (struct free_block*)block;
+  free_block->prev->next = free_block->next;
+  free_block->next->prev = free_block->prev;
+
+  size_t idx = bin_index(get_block_size(block));
+  if (placement == LKL_PLACEMENT_BEST_FIT && idx >= NUM_SMALL_BINS) {
+    tree_remove(idx, free_block);
+  }
+  if (bin_rovers[idx] == free_block) {
+    bin_rovers[idx] = free_block->next;
+  }
+  if (bins[idx].next == &bins[idx]) {
+    binmap[idx / BINMAP_WORD_BITS] &= ~(1ULL << (idx % BINMAP_WORD_BITS));
+  }
+}
+
+// Switching to address ordered placement sorts the blocks already in each bin by inserting them again,
+// and switching to best fit builds the tries of the large bins. Other policies leave the tries stale.
+// Must be called with heap_lock held.
+void set_placement(int policy)
+{
+  int old_policy = placement;
+  placement = policy;
+  if (policy == old_policy || !global_base) {
+    return;
+  }
+
+  if (policy == LKL_PLACEMENT_BEST_FIT) {
+    memset(size_trees, 0, sizeof(size_trees));
+    for (size_t idx = NUM_SMALL_BINS; idx < NUM_BINS; idx++) {
+      for (struct free_block* current = bins[idx].next; current != &bins[idx]; current = current->next) {
+        tree_insert(idx, current);
+      }
+    }
+  } else if (policy == LKL_PLACEMENT_ADDRESS_ORDERED) {
+    for (size_t idx = 0; idx < NUM_BINS; idx++) {
+      struct free_block* current = bins[idx].next;
+      bins[idx].next = &bins[idx];
+      bins[idx].prev = &bins[idx];
+      bin_rovers[idx] = &bins[idx];
+      while (current != &bins[idx]) {
+        struct free_block* next = current->next;
+        insert_free_block(&current->meta);
+        current = next;
+      }
+    }
+  }
+}
+
+// Returns size shifted so the bit below the leading one shared by every size of large bin idx is the top bit.
+size_t tree_key(size_t idx, size_t size)
+{
+  size_t bin_log2 = idx - NUM_SMALL_BINS + SMALL_BIN_LIMIT_LOG2;
+  return size << (sizeof(size_t) * 8 - bin_log2);
+}
+
+void tree_insert(size_t idx, struct free_block* block)
+{
+  struct tree_block* node = (struct tree_block*)block;
+  size_t block_size = get_block_size(&block->meta);
+  node->child[0] = NULL;
+  node->child[1] = NULL;
+
+  struct tree_block** root = &size_trees[idx - NUM_SMALL_BINS];
+  if (!*root) {
+    node->parent = node;
+    node->same_next = node;
+    node->same_prev = node;
+    *root = node;
+    return;
+  }
+
+  struct tree_block* current = *root;
+  for (size_t key = tree_key(idx, block_size);; key <<= 1) {
+    if (get_block_size(&current->list.meta) == block_size) {
+      node->parent = NULL;
+      node->same_next = current->same_next;
+      node->same_prev = current;
+      current->same_next->same_prev = node;
+      current->same_next = node;
+      return;
+    }
+
+    struct tree_block** slot = &current->child[key >> (sizeof(size_t) * 8 - 1)];
+    if (!*slot) {
+      node->parent = current;
+      node->same_next = node;
+      node->same_prev = node;
+      *slot = node;
+      return;
+    }
+    current = *slot;
+  }
+}
+
+// Takes a block out of its trie. A block at a node hands the node to another of its size if it has one,
+// otherwise to a leaf below it, which shares the bits that lead to the node like every block under it.
+void tree_remove(size_t idx, struct free_block* block)
+{
+  struct tree_block* node = (struct tree_block*)block;
+  struct tree_block* replacement = NULL;
+
+  if (node->same_next != node) {
+    node->same_next->same_prev = node->same_prev;
+    node->same_prev->same_next = node->same_next;
+    if (!node->parent) {
+      return;
+    }
+    replacement = node->same_next;
+  } else if (node->child[0] || node->child[1]) {
+    struct tree_block** slot = node->child[1] ? &node->child[1] : &node->child[0];
+    while ((*slot)->child[1] || (*slot)->child[0]) {
+      slot = (*slot)->child[1] ? &(*slot)->child[1] : &(*slot)->child[0];
+    }
+    replacement = *slot;
+    *slot = NULL;
+  }
+
+  struct tree_block** root = &size_trees[idx - NUM_SMALL_BINS];
+  if (node->parent == node) {
+    *root = replacement;
+  } else {
+    struct tree_block* parent = node->parent;
+    parent->child[parent->child[1] == node] = replacement;
+  }
+  if (!replacement) {
+    return;
+  }
+
+  replacement->parent = node->parent == node ? replacement : node->parent;
+  for (int side = 0; side < 2; side++) {
+    replacement->child[side] = node->child[side];
+    if (node->child[side]) {
+      node->child[side]->parent = replacement;
+    }
+  }
+}
+
+// Finds the smallest block of large bin idx of at least request_size bytes, adding the number of blocks
+// looked at to length. Returns NULL if there is none.
+struct free_block* tree_search(size_t idx, size_t request_size, size_t* length)
+{
+  struct tree_block* best = NULL;
+  size_t best_size = SIZE_MAX;
+  struct tree_block* current = size_trees[idx - NUM_SMALL_BINS];
+
+  // In a higher bin every block fits and the smallest is found by keeping left below. In the request's own
+  // bin the path its size takes is followed, remembering the last subtree of larger sizes it passed by.
+  if (bin_index(request_size) == idx) {
+    struct tree_block* larger = NULL;
+    for (size_t key = tree_key(idx, request_size); current; key <<= 1) {
+      (*length)++;
+      size_t block_size = get_block_size(&current->list.meta);
+      if (block_size >= request_size && block_size < best_size) {
+        best = current;
+        best_size = block_size;
+        if (block_size == request_size) {
+          return &best->list;
+        }
+      }
+      struct tree_block* right = current->child[1];
+      current = current->child[key >> (sizeof(size_t) * 8 - 1)];
+      if (right && right != current) {
+        larger = right;
+      }
+    }
+    current = larger;
+  }
+
+  for (; current; current = current->child[0] ? current->child[0] : current->child[1]) {
+    (*length)++;
+    size_t block_size = get_block_size(&current->list.meta);
+    if (block_size < best_size) {
+      best = current;
+      best_size = block_size;
+    }
+  }
+  return best ? &best->list : NULL;
+}
+
+int is_slab_slot(void* ptr)
+{
+  return (uintptr_t)ptr - (uintptr_t)slab_area < slab_area_size;
+}
+
+struct slab* slab_of(void* ptr)
+{
+  return &slab_descriptors[(size_t)((char*)ptr - slab_area) / SLAB_SIZE];
+}
+
+char* slab_start(struct slab* slab)
+{
+  return slab_area + (size_t)(slab - slab_descriptors) * SLAB_SIZE;
+}
+
+// Returns NULL if there is no slab with a free slot and no new one can be made.
+// Must be called with heap_lock held.
+void* slab_malloc(size_t request_size)
+{
+  if (!slab_area_size && !slab_reserve()) {
+    slab_max_size = 0;
+    return NULL;
+  }
+
+  if (__atomic_load_n(&remote_slabs, __ATOMIC_RELAXED)) {
+    slab_collect_remote();
+  }
+
+  struct slab* list = &slab_lists[bin_index(request_size)];
+  struct slab* slab = list->next;
+  if (slab == list) {
+    slab = slab_new(request_size);
+    if (!slab) {
+      return NULL;
+    }
+  }
+  if (slab->owner != &tcache) {
+    __atomic_store_n(&slab->owner, &tcache, __ATOMIC_RELAXED);
+  }
+
+  size_t slot = slab_find_free_slot(slab);
+  slab->free_slots[slot / 64] &= ~(1ULL << (slot % 64));
+  if (--slab->num_free == 0) {
+    slab->prev->next = slab->next;
+    slab->next->prev = slab->prev;
+  }
+  return slab_start(slab) + slot * slab->slot_size;
+}
+
+// A slab that becomes completely free is given up for reuse by any size class,
+// unless it is the last slab of its size class with a free slot. Must be called with heap_lock held.
+void slab_free(void* ptr)
+{
+  struct slab* slab = slab_of(ptr);
+  size_t slot = (size_t)((char*)ptr - slab_start(slab)) / slab->slot_size;
+  slab->free_slots[slot / 64] |= 1ULL << (slot % 64);
+
+  struct slab* list = &slab_lists[bin_index(slab->slot_size)];
+  if (slab->num_free++ == 0) {
+    slab->next = list->next;
+    slab->prev = list;
+    list->next->prev = slab;
+    list->next = slab;
+  }
+
+  if (slab->num_free == slab->num_slots && (list->next != slab || list->prev != slab)) {
+    slab->prev->next = slab->next;
+    slab->next->prev = slab->prev;
+    slab->next = empty_slabs;
+    empty_slabs = slab;
+  }
+}
+
+// Pushes the slots first to last of a slab, already chained through their first word, onto its remote_frees
+// with a single compare and swap. Does not need heap_lock.
+void slab_free_remote(struct slab* slab, void* first, void* last)
+{
+  void* head = __atomic_load_n(&slab->remote_frees, __ATOMIC_RELAXED);
+  do {
+    *(void**)last = head;
+  } while (!__atomic_compare_exchange_n(&slab->remote_frees, &head, first, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  // Whoever finds the list empty queues the slab, so it is queued once however many threads free into it
+  if (!head) {
+    struct slab* pending = __atomic_load_n(&remote_slabs, __ATOMIC_RELAXED);
+    do {
+      slab->next_remote = pending;
+    } while (!__atomic_compare_exchange_n(&remote_slabs, &pending, slab, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+// Frees every slot other threads have pushed onto a slab since the last collection. The queue and each
+// slab's list are taken whole, so there is nothing for a concurrent push to race with but the swap itself.
+// A slab's next_remote is read before its list is emptied, after which a push may queue it again.
+// Must be called with heap_lock held.
+void slab_collect_remote(void)
+{
+  struct slab* slab = __atomic_exchange_n(&remote_slabs, NULL, __ATOMIC_ACQUIRE);
+  while (slab) {
+    struct slab* next = slab->next_remote;
+    void* slot = __atomic_exchange_n(&slab->remote_frees, NULL, __ATOMIC_ACQ_REL);
+    while (slot) {
+      void* following = *(void**)slot;
+      slab_free(slot);
+      slot = following;
+    }
+    slab = next;
+  }
+}
+
+// Takes an empty slab for slots of slot_size and puts it on its size class list.
+// Must be called with heap_lock held.
+struct slab* slab_new(size_t slot_size)
+{
+  if (!empty_slabs && !slab_commit()) {
+    return NULL;
+  }
+  struct slab* slab = empty_slabs;
+  empty_slabs = slab->next;
+
+  size_t num_slots = SLAB_SIZE / slot_size;
+  for (size_t word = 0; word < SLAB_BITMAP_WORDS; word++) {
+    size_t first_slot = word * 64;
+    if (num_slots >= first_slot + 64) {
+      slab->free_slots[word] = ~0ULL;
+    } else if (num_slots > first_slot) {
+      slab->free_slots[word] = (1ULL << (num_slots - first_slot)) - 1;
+    } else {
+      slab->free_slots[word] = 0;
+    }
+  }
+  slab->slot_size = (unsigned int)slot_size;
+  slab->num_slots = (unsigned int)num_slots;
+  slab->num_free = (unsigned int)num_slots;
+
+  struct slab* list = &slab_lists[bin_index(slot_size)];
+  slab->next = list->next;
+  slab->prev = list;
+  list->next->prev = slab;
+  list->next = slab;
+  return slab;
+}
+
+// Returns the lowest free slot of a slab that has one. With AVX2 the bitmap is checked 256 slots
+// at a time, a whole slab of the smallest size class, and only the word holding a free slot is scanned.
+size_t slab_find_free_slot(struct slab* slab)
+{
+#if defined(__AVX2__)
+  for (size_t word = 0;; word += 4) {
+    __m256i bits = _mm256_load_si256((const __m256i*)&slab->free_slots[word]);
+    unsigned int full_words =
+      (unsigned int)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(bits, _mm256_setzero_si256())));
+    if (full_words != 0xf) {
+      word += (size_t)__builtin_ctz(~full_words);
+      return word * 64 + (size_t)__builtin_ctzll(slab->free_slots[word]);
+    }
+  }
+#else
+  for (size_t word = 0;; word++) {
+    if (slab->free_slots[word]) {
+      return word * 64 + (size_t)__builtin_ctzll(slab->free_slots[word]);
+    }
+  }
+#endif
+}
+
+// Reserves address space for every slab and its descriptor without committing any of it.
+// Must be called with heap_lock held.
+int slab_reserve(void)
+{
+  size_t descriptors_size = page_align(SLAB_REGION_SLABS * sizeof(struct slab));
+  size_t region_size = descriptors_size + SLAB_REGION_SLABS * SLAB_SIZE;
+  char* region = (char*)mmap(NULL, region_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == (char*)MAP_FAILED) {
+    return 0;
+  }
+  __atomic_fetch_add(&mmap_calls, 1, __ATOMIC_RELAXED);
+
+  for (size_t idx = 0; idx < NUM_SMALL_BINS; idx++) {
+    slab_lists[idx].next = &slab_lists[idx];
+    slab_lists[idx].prev = &slab_lists[idx];
+  }
+  slab_descriptors = (struct slab*)region;
+  slab_area = region + descriptors_size;
+  slab_area_size = SLAB_REGION_SLABS * SLAB_SIZE;
+  return 1;
+}
+
+// Makes the next SLAB_COMMIT_SLABS slabs and their descriptors usable and puts them on empty_slabs.
+// Must be called with heap_lock held.
+int slab_commit(void)
+{
+  if (slabs_committed + SLAB_COMMIT_SLABS > SLAB_REGION_SLABS) {
+    return 0;
+  }
+
+  size_t descriptors_committed = page_align(slabs_committed * sizeof(struct slab));
+  size_t descriptors_needed = page_align((slabs_committed + SLAB_COMMIT_SLABS) * sizeof(struct slab));
+  if (descriptors_needed > descriptors_committed
+    && mprotect((char*)slab_descriptors + descriptors_committed, descriptors_needed - descriptors_committed,
+         PROT_READ | PROT_WRITE)) {
+    return 0;
+  }
+  if (mprotect(slab_area + slabs_committed * SLAB_SIZE, SLAB_COMMIT_SLABS * SLAB_SIZE, PROT_READ | PROT_WRITE)) {
+    return 0;
+  }
+
+  for (size_t idx = slabs_committed + SLAB_COMMIT_SLABS; idx-- > slabs_committed;) {
+    slab_descriptors[idx].next = empty_slabs;
+    empty_slabs = &slab_descriptors[idx];
+  }
+  slabs_committed += SLAB_COMMIT_SLABS;
+  return 1;
+}
+
+size_t get_page_size(void)
+{
+  static size_t page_size = 0;
+  if (!page_size) {
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+  }
+  return page_size;
+}
+
+// Rounds up to a multiple of the page size, returning 0 if that does not fit in a size_t.
+size_t page_align(size_t size)
+{
+  size_t page_size = get_page_size();
+  if (size > (size_t)-1 - (page_size - 1)) {
+    return 0;
+  }
+  return (size + page_size - 1) & ~(page_size - 1);
+}
+
+// A mapped block's header sits in the first page of its mapping, at the start unless the payload
+// had to be aligned further, and the payload takes up the rest of its pages.
+char* mapping_start(struct block_meta* block)
+{
+  return (char*)((uintptr_t)block & ~(get_page_size() - 1));
+}
+
+// Maps an alignment larger than the header gives for free by mapping that much extra and
+// unmapping the whole pages either side of the aligned block.
+struct block_meta* mmap_block(size_t request_size, size_t alignment)
+{
+  size_t padding = alignment > SIZE_CLASS_GRANULE ? alignment : 0;
+  if (request_size > (size_t)-1 - padding - sizeof(struct block_meta)) {
+    return NULL;
+  }
+  size_t map_size = page_align(request_size + padding + sizeof(struct block_meta));
+  if (!map_size) {
+    return NULL;
+  }
+
+  // Explicit huge pages can only be unmapped whole, so they are not used when the start has to be cut off
+  char* mapping = (char*)MAP_FAILED;
+  size_t huge_flag = 0;
+#ifdef MAP_HUGETLB
+  if (use_hugetlb && !padding && map_size >= HUGE_PAGE_SIZE && map_size <= (size_t)-1 - HUGE_PAGE_SIZE) {
+    size_t huge_size = (map_size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    mapping = (char*)mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mapping != (char*)MAP_FAILED) {
+      // The payload starts a granule in, to be aligned, and takes up the rest of the mapping
+      map_size = huge_size;
+      request_size = huge_size - SIZE_CLASS_GRANULE;
+      huge_flag = BLOCK_HUGETLB;
+    }
+  }
+#endif
+  if (mapping == (char*)MAP_FAILED) {
+    mapping = (char*)mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == (char*)MAP_FAILED) {
+      return NULL;
+    }
+    advise_huge_pages(mapping, mapping + map_size);
+  }
+
+  uintptr_t earliest = (uintptr_t)mapping + sizeof(struct block_meta);
+  struct block_meta* block = (struct block_meta*)((earliest + alignment - 1) & ~(alignment - 1)) - 1;
+  char* block_start = mapping_start(block);
+  char* block_end = block_start + page_align((size_t)((char*)(block + 1) + request_size - block_start));
+  if (block_start != mapping) {
+    munmap(mapping, (size_t)(block_start - mapping));
+  }
+  if (block_end != mapping + map_size) {
+    munmap(block_end, (size_t)(mapping + map_size - block_end));
+  }
+  __atomic_fetch_add(&mmap_calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mapped_bytes, (size_t)(block_end - block_start), __ATOMIC_RELAXED);
+
+  // The block is cut down to whole granules to leave room for the flags. Its pages are unmapped whole.
+  init_block(block, ((size_t)(block_end - (char*)block) & ~BLOCK_FLAGS) - sizeof(struct block_meta), BLOCK_LAST | BLOCK_MMAPPED | huge_flag);
+  return block;
+}
+
+void munmap_block(struct block_meta* block)
+{
+  char* start = mapping_start(block);
+  size_t map_size = page_align((size_t)((char*)(block + 1) + get_block_size(block) - start));
+  munmap(start, map_size);
+  __atomic_fetch_sub(&mapped_bytes, map_size, __ATOMIC_RELAXED);
+}
+
+// Resizes the mapping, letting the kernel move it if it cannot grow where it is.
+// Returns NULL and leaves the block untouched on failure.
+struct block_meta* mremap_block(struct block_meta* block, size_t request_size)
+{
+  char* start = mapping_start(block);
+  size_t offset = (size_t)((char*)block - start);
+  size_t old_size = page_align(offset + sizeof(struct block_meta) + get_block_size(block));
+  if (request_size > (size_t)-1 - offset - sizeof(struct block_meta)) {
+    return NULL;
+  }
+  size_t new_size = page_align(offset + sizeof(struct block_meta) + request_size);
+  if (!new_size) {
+    return NULL;
+  }
+  // A mapping of explicit huge pages can only be resized by whole ones
+  if (get_block_flag(block, BLOCK_HUGETLB)) {
+    if (new_size > (size_t)-1 - HUGE_PAGE_SIZE) {
+      return NULL;
+    }
+    new_size = (new_size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+  }
+  if (new_size == old_size) {
+    return block;
+  }
+
+  char* mapping = (char*)mremap(start, old_size, new_size, MREMAP_MAYMOVE);
+  if (mapping == (char*)MAP_FAILED) {
+    return NULL;
+  }
+  __atomic_fetch_add(&mmap_calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mapped_bytes, new_size - old_size, __ATOMIC_RELAXED);
+
+  block = (struct block_meta*)(mapping + offset);
+  set_block_size(block, ((new_size - offset) & ~BLOCK_FLAGS) - sizeof(struct block_meta));
+  return block;
+}
+
+// Whether the calling thread may use its cache, setting the cache up on first use.
+int tcache_usable(void)
+{
+  if (tcache.state == TCACHE_ACTIVE) {
+    return tcache_max_count != 0;
+  }
+  if (tcache.state != TCACHE_UNINITIALISED) {
+    return 0;
+  }
+
+  // The cache is flushed back to the heap when the thread exits. Registering for that may
+  // allocate, and those allocations go straight to the heap.
+  tcache.state = TCACHE_INITIALISING;
+  pthread_once(&tcache_key_once, tcache_create_key);
+  pthread_setspecific(tcache_key, &tcache);
+
+  pthread_mutex_lock(&heap_lock);
+  tcache.next_live = live_caches;
+  tcache.prev_live = NULL;
+  if (live_caches) {
+    live_caches->prev_live = &tcache;
+  }
+  live_caches = &tcache;
+  pthread_mutex_unlock(&heap_lock);
+
+  tcache.state = TCACHE_ACTIVE;
+  return tcache_max_count != 0;
+}
+
+void* tcache_get(size_t requested_size)
+{
+  size_t idx = bin_index(align_granule(requested_size));
+  void* payload = tcache.entries[idx];
+  if (payload) {
+    tcache.entries[idx] = *(void**)payload;
+    tcache.counts[idx]--;
+  }
+  return payload;
+}
+
+// Caches a heap block or slot holding size bytes. Returns 0 when it could not be cached
+// and has to go back to the heap.
+int tcache_put(void* ptr, size_t size)
+{
+  size_t idx = bin_index(size);
+  if (tcache.counts[idx] >= tcache_max_count) {
+    unsigned int batch = tcache_max_count / TCACHE_BATCH_DIVISOR;
+    if (batch == 0) {
+      return 0;
+    }
+    tcache_drain(idx, batch);
+  }
+
+  *(void**)ptr = tcache.entries[idx];
+  tcache.entries[idx] = ptr;
+  tcache.counts[idx]++;
+  return 1;
+}
+
+// Takes a batch of blocks of the requested size from the heap under a single lock,
+// caching all but the one that is returned.
+void* tcache_refill(size_t requested_size)
+{
+  size_t class_size = align_granule(requested_size);
+  size_t idx = bin_index(class_size);
+  unsigned int batch = tcache_max_count / TCACHE_BATCH_DIVISOR;
+
+  pthread_mutex_lock(&heap_lock);
+  void* payload_to_give = locked_malloc(class_size);
+  for (unsigned int count = 1; payload_to_give && count < batch; count++) {
+    void* payload = locked_malloc(class_size);
+    if (!payload) {
+      break;
+    }
+    *(void**)payload = tcache.entries[idx];
+    tcache.entries[idx] = payload;
+    tcache.counts[idx]++;
+  }
+  pthread_mutex_unlock(&heap_lock);
+
+  return payload_to_give;
+}
+
+// Returns the most recently cached num_blocks blocks of a size class to the heap under a single lock.
+// Slots of slabs other threads own go back to their slab's remote_frees instead, a run of slots of the
+// same slab, already chained in the cache, with a single push. The lock is only taken if anything needs it.
+void tcache_drain(size_t idx, unsigned int num_blocks)
+{
+  int locked = 0;
+  unsigned int count = 0;
+  while (count < num_blocks && tcache.entries[idx]) {
+    void* payload = tcache.entries[idx];
+    struct slab* slab = is_slab_slot(payload) ? slab_of(payload) : NULL;
+
+    if (slab && __atomic_load_n(&slab->owner, __ATOMIC_RELAXED) != &tcache) {
+      void* last = payload;
+      for (count++; count < num_blocks; count++) {
+        void* following = *(void**)last;
+        if (!following || !is_slab_slot(following) || slab_of(following) != slab) {
+          break;
+        }
+        last = following;
+      }
+      tcache.entries[idx] = *(void**)last;
+      slab_free_remote(slab, payload, last);
+      continue;
+    }
+
+    if (!locked) {
+      pthread_mutex_lock(&heap_lock);
+      locked = 1;
+    }
+    tcache.entries[idx] = *(void**)payload;
+    count++;
+    locked_free(payload);
+  }
+  tcache.counts[idx] -= count;
+  if (locked) {
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+// Returns every cached block of the calling thread to the heap.
+void tcache_flush(void)
+{
+  for (size_t idx = 0; idx < NUM_SMALL_BINS; idx++) {
+    if (tcache.entries[idx]) {
+      tcache_drain(idx, tcache.counts[idx]);
+    }
+  }
+}
+
+void tcache_thread_exit(void* unused)
+{
+  (void)unused;
+  tcache_flush();
+
+  pthread_mutex_lock(&heap_lock);
+  for (size_t stat = 0; stat < NUM_THREAD_STATS; stat++) {
+    __atomic_fetch_add(&retired_stats[stat], tcache.stats[stat], __ATOMIC_RELAXED);
+  }
+  if (tcache.next_live) {
+    tcache.next_live->prev_live = tcache.prev_live;
+  }
+  if (tcache.prev_live) {
+    tcache.prev_live->next_live = tcache.next_live;
+  } else {
+    live_caches = tcache.next_live;
+  }
+  tcache.state = TCACHE_DISABLED;
+  pthread_mutex_unlock(&heap_lock);
+}
+
+void tcache_create_key(void)
+{
+  pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+// Caches a freed heap block or slot holding size bytes for the CPU, or the thread when per CPU caching
+// is off. Returns 0 when it could not be cached and has to go back to the heap.
+int cache_put(void* ptr, size_t size)
+{
+  if (__atomic_load_n(&percpu_max_count, __ATOMIC_ACQUIRE)) {
+    return percpu_put(ptr, size);
+  }
+  return tcache_usable() && tcache_put(ptr, size);
+}
+
+// Maps a cache for every configured CPU and the spare, and checks whether rseq can be used.
+// Must be called with heap_lock held.
+int percpu_enable(void)
+{
+  int num_configured = get_nprocs_conf();
+  size_t size = page_align(((size_t)(num_configured > 0 ? num_configured : 1) + 1) * sizeof(struct cpu_cache));
+  void* caches = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (caches == MAP_FAILED) {
+    return 0;
+  }
+  __atomic_fetch_add(&mmap_calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&mapped_bytes, size, __ATOMIC_RELAXED);
+
+#ifdef LKL_HAVE_RSEQ
+  // Lowering the count fences off running sequences, which the process must have registered for
+  percpu_use_rseq = __rseq_size > 0 && (int)rseq_area()->cpu_id >= 0
+    && syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+#endif
+  num_cpus = (size_t)(num_configured > 0 ? num_configured : 1);
+  cpu_caches = (struct cpu_cache*)caches;
+  return 1;
+}
+
+// Takes the most recently cached block of a size class from the CPU's cache, or returns NULL if it has none.
+void* percpu_pop(size_t idx)
+{
+  void* ptr = NULL;
+#ifdef LKL_HAVE_RSEQ
+  if (percpu_use_rseq && rseq_pop(idx, &ptr)) {
+    return ptr;
+  }
+#endif
+  struct cpu_cache* cache = percpu_lock();
+  if (cache->counts[idx]) {
+    ptr = cache->entries[idx][--cache->counts[idx]];
+  }
+  percpu_unlock(cache);
+  return ptr;
+}
+
+// Caches a block of a size class in the CPU's cache. Returns 0 if it already holds percpu_max_count of them.
+int percpu_push(size_t idx, void* ptr)
+{
+  int pushed;
+#ifdef LKL_HAVE_RSEQ
+  if (percpu_use_rseq && rseq_push(idx, ptr, &pushed)) {
+    return pushed;
+  }
+#endif
+  struct cpu_cache* cache = percpu_lock();
+  pushed = cache->counts[idx] < __atomic_load_n(&percpu_max_count, __ATOMIC_RELAXED);
+  if (pushed) {
+    cache->entries[idx][cache->counts[idx]++] = ptr;
+  }
+  percpu_unlock(cache);
+  return pushed;
+}
+
+// With rseq the CPUs' own caches are never locked, so only the spare is, by threads on a CPU without a cache.
+struct cpu_cache* percpu_lock(void)
+{
+  size_t cpu = num_cpus;
+  if (!percpu_use_rseq) {
+    int current = sched_getcpu();
+    if (current >= 0 && (size_t)current < num_cpus) {
+      cpu = (size_t)current;
+    }
+  }
+  struct cpu_cache* cache = &cpu_caches[cpu];
+  percpu_lock_cache(cache);
+  return cache;
+}
+
+void percpu_lock_cache(struct cpu_cache* cache)
+{
+  while (__atomic_exchange_n(&cache->lock, 1, __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  }
+}
+
+void percpu_unlock(struct cpu_cache* cache)
+{
+  __atomic_store_n(&cache->lock, 0, __ATOMIC_RELEASE);
+}
+
+// Takes a batch of blocks of the requested size from the heap under a single lock,
+// caching all but the one that is returned for the CPU.
+void* percpu_refill(size_t requested_size)
+{
+  size_t class_size = align_granule(requested_size);
+  size_t idx = bin_index(class_size);
+  unsigned int batch = __atomic_load_n(&percpu_max_count, __ATOMIC_RELAXED) / TCACHE_BATCH_DIVISOR;
+
+  pthread_mutex_lock(&heap_lock);
+  void* payload_to_give = locked_malloc(class_size);
+  for (unsigned int count = 1; payload_to_give && count < batch; count++) {
+    void* payload = locked_malloc(class_size);
+    if (!payload) {
+      break;
+    }
+    // The thread may have moved to a CPU whose cache is full
+    if (!percpu_push(idx, payload)) {
+      locked_free(payload);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&heap_lock);
+
+  return payload_to_give;
+}
+
+// Caches a heap block or slot holding size bytes for the CPU, first emptying a batch of the
+// cache if it is full. Returns 0 when it could not be cached.
+int percpu_put(void* ptr, size_t size)
+{
+  size_t idx = bin_index(size);
+  if (percpu_push(idx, ptr)) {
+    return 1;
+  }
+  unsigned int batch = __atomic_load_n(&percpu_max_count, __ATOMIC_RELAXED) / TCACHE_BATCH_DIVISOR;
+  if (batch == 0) {
+    return 0;
+  }
+  percpu_drain(idx, batch);
+  return percpu_push(idx, ptr);
+}
+
+// Returns the most recently cached num_blocks blocks of a size class of the CPU's cache to the heap.
+// They are popped first so the heap is locked once.
+void percpu_drain(size_t idx, unsigned int num_blocks)
+{
+  void* drained[PERCPU_MAX_COUNT];
+  unsigned int count = 0;
+  while (count < num_blocks && count < PERCPU_MAX_COUNT && (drained[count] = percpu_pop(idx))) {
+    count++;
+  }
+  if (!count) {
+    return;
+  }
+
+  pthread_mutex_lock(&heap_lock);
+  for (unsigned int drained_idx = 0; drained_idx < count; drained_idx++) {
+    locked_free(drained[drained_idx]);
+  }
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// Returns every block the calling thread's CPU has cached to the heap. Another CPU's cache can only
+// be changed from that CPU, so it is left alone.
+void percpu_flush(void)
+{
+  for (size_t idx = 0; idx < NUM_SMALL_BINS; idx++) {
+    percpu_drain(idx, PERCPU_MAX_COUNT);
+  }
+}
+
+// Stores a new count, first emptying every CPU's cache and the spare back to the heap if it goes down.
+// Must be called with heap_lock held, after percpu_enable.
+void percpu_set_count(unsigned int count)
+{
+  if (count < __atomic_load_n(&percpu_max_count, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&percpu_max_count, 0, __ATOMIC_RELEASE);
+#ifdef LKL_HAVE_RSEQ
+    if (percpu_use_rseq) {
+      syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+    }
+#endif
+    for (size_t cpu = 0; cpu <= num_cpus; cpu++) {
+      struct cpu_cache* cache = &cpu_caches[cpu];
+      percpu_lock_cache(cache);
+      for (size_t idx = 0; idx < NUM_SMALL_BINS; idx++) {
+        while (cache->counts[idx]) {
+          locked_free(cache->entries[idx][--cache->counts[idx]]);
+        }
+      }
+      percpu_unlock(cache);
+    }
+  }
+  __atomic_store_n(&percpu_max_count, count, __ATOMIC_RELEASE);
+}
+
+#ifdef LKL_HAVE_RSEQ
+
+static_assert(RSEQ_SIG == 0x53053053, "the abort handlers below are preceded by the x86 rseq signature");
+
+struct rseq* rseq_area(void)
+{
+  return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+// Each sequence is described by a struct rseq_cs in the __rseq_cs section (label 3) giving where it starts
+// (1), where it ends just after the committing store (2) and where to go if the kernel interrupts it (4).
+// The abort handler must be preceded by RSEQ_SIG and goes back to point the rseq area at the descriptor
+// again (0), which the kernel clears when it aborts a sequence. A CPU number at or past num_cpus has no
+// cache to index, so the sequence ends (2) without touching one and returns 0 for the spare to be used.
+// percpu_max_count is read inside the sequence, so one restarted by the fence in percpu_set_count sees 0.
+int rseq_pop(size_t idx, void** ptr)
+{
+  struct rseq* area = rseq_area();
+  int has_cache;
+  __asm__ __volatile__(".pushsection __rseq_cs, \"aw\"\n\t"
+                       ".balign 32\n\t"
+                       "3:\n\t"
+                       ".long 0, 0\n\t"
+                       ".quad 1f, 2f - 1f, 4f\n\t"
+                       ".popsection\n\t"
+                       "0:\n\t"
+                       "leaq 3b(%%rip), %%rax\n\t"
+                       "movq %%rax, %[rseq_cs]\n\t"
+                       "1:\n\t"
+                       "xorl %k[ptr], %k[ptr]\n\t"
+                       "xorl %[has_cache], %[has_cache]\n\t"
+                       "movl %[cpu_id], %%eax\n\t"
+                       "cmpq %[num_cpus], %%rax\n\t"
+                       "jae 2f\n\t"
+                       "movl $1, %[has_cache]\n\t"
+                       "cmpl $0, %[limit]\n\t"
+                       "je 2f\n\t"
+                       "imulq %[cache_size], %%rax, %%rax\n\t"
+                       "addq %[caches], %%rax\n\t"
+                       "movq (%%rax, %[count_offset]), %%rcx\n\t"
+                       "testq %%rcx, %%rcx\n\t"
+                       "jz 2f\n\t"
+                       "leaq (%%rax, %[entries_offset]), %%rdx\n\t"
+                       "movq -8(%%rdx, %%rcx, 8), %[ptr]\n\t"
+                       "decq %%rcx\n\t"
+                       "movq %%rcx, (%%rax, %[count_offset])\n\t"
+                       "2:\n\t"
+                       ".pushsection __rseq_failure, \"ax\"\n\t"
+                       ".long 0x53053053\n\t"
+                       "4:\n\t"
+                       "jmp 0b\n\t"
+                       ".popsection\n\t"
+                       : [ptr] "=&r"(*ptr), [has_cache] "=&r"(has_cache), [rseq_cs] "=m"(area->rseq_cs)
+                       : [cpu_id] "m"(area->cpu_id), [num_cpus] "r"(num_cpus), [cache_size] "i"(sizeof(struct cpu_cache)),
+                         [caches] "r"(cpu_caches),
+                         [count_offset] "r"(offsetof(struct cpu_cache, counts) + idx * sizeof(size_t)),
+                         [entries_offset] "r"(offsetof(struct cpu_cache, entries) + idx * PERCPU_MAX_COUNT * sizeof(void*)),
+                         [limit] "m"(percpu_max_count)
+                       : "rax", "rcx", "rdx", "memory", "cc");
+  return has_cache;
+}
+
+// pushed is set before the committing store, so a sequence aborted in between starts over with it cleared.
+int rseq_push(size_t idx, void* ptr, int* pushed)
+{
+  struct rseq* area = rseq_area();
+  int has_cache;
+  __asm__ __volatile__(".pushsection __rseq_cs, \"aw\"\n\t"
+                       ".balign 32\n\t"
+                       "3:\n\t"
+                       ".long 0, 0\n\t"
+                       ".quad 1f, 2f - 1f, 4f\n\t"
+                       ".popsection\n\t"
+                       "0:\n\t"
+                       "leaq 3b(%%rip), %%rax\n\t"
+                       "movq %%rax, %[rseq_cs]\n\t"
+                       "1:\n\t"
+                       "xorl %[pushed], %[pushed]\n\t"
+                       "xorl %[has_cache], %[has_cache]\n\t"
+                       "movl %[cpu_id], %%eax\n\t"
+                       "cmpq %[num_cpus], %%rax\n\t"
+                       "jae 2f\n\t"
+                       "movl $1, %[has_cache]\n\t"
+                       "imulq %[cache_size], %%rax, %%rax\n\t"
+                       "addq %[caches], %%rax\n\t"
+                       "movq (%%rax, %[count_offset]), %%rcx\n\t"
+                       "movl %[limit], %%edx\n\t"
+                       "cmpq %%rdx, %%rcx\n\t"
+                       "jae 2f\n\t"
+                       "leaq (%%rax, %[entries_offset]), %%rdx\n\t"
+                       "movq %[ptr], (%%rdx, %%rcx, 8)\n\t"
+                       "incq %%rcx\n\t"
+                       "movl $1, %[pushed]\n\t"
+                       "movq %%rcx, (%%rax, %[count_offset])\n\t"
+                       "2:\n\t"
+                       ".pushsection __rseq_failure, \"ax\"\n\t"
+                       ".long 0x53053053\n\t"
+                       "4:\n\t"
+                       "jmp 0b\n\t"
+                       ".popsection\n\t"
+                       : [pushed] "=&r"(*pushed), [has_cache] "=&r"(has_cache), [rseq_cs] "=m"(area->rseq_cs)
+                       : [cpu_id] "m"(area->cpu_id), [num_cpus] "r"(num_cpus), [cache_size] "i"(sizeof(struct cpu_cache)),
+                         [caches] "r"(cpu_caches),
+                         [count_offset] "r"(offsetof(struct cpu_cache, counts) + idx * sizeof(size_t)),
+                         [entries_offset] "r"(offsetof(struct cpu_cache, entries) + idx * PERCPU_MAX_COUNT * sizeof(void*)),
+                         [limit] "m"(percpu_max_count), [ptr] "r"(ptr)
+                       : "rax", "rcx", "rdx", "memory", "cc");
+  return has_cache;
+}
+
+#endif
+
+// Only the calling thread writes its own counters, so a relaxed store is enough for lkl_get_stats to read
+// them from another thread without the cost of an atomic add.
+void stats_add(enum thread_stat stat, size_t amount)
+{
+  if (tcache.state == TCACHE_ACTIVE) {
+    __atomic_store_n(&tcache.stats[stat], tcache.stats[stat] + amount, __ATOMIC_RELAXED);
+  } else {
+    __atomic_fetch_add(&retired_stats[stat], amount, __ATOMIC_RELAXED);
+  }
+}
+
+// Counts an allocation about to be handed out, if there is one, and returns it.
+void* stats_malloc(void* payload)
+{
+  if (payload) {
+    stats_add(STAT_ALLOCATIONS, 1);
+    stats_add(STAT_ALLOCATED_BYTES, lkl_malloc_usable_size(payload));
+  }
+  return payload;
+}
+
+// Counts an allocation about to be freed.
+void stats_free(void* ptr)
+{
+  stats_add(STAT_FREES, 1);
+  stats_add(STAT_FREED_BYTES, lkl_malloc_usable_size(ptr));
+}
+
+// Counts an allocation resized where it is.
+void stats_resize(size_t old_size, size_t new_size)
+{
+  if (new_size > old_size) {
+    stats_add(STAT_ALLOCATED_BYTES, new_size - old_size);
+  } else {
+    stats_add(STAT_FREED_BYTES, old_size - new_size);
+  }
+}
+
+// Adds a search of the free lists that looked at length blocks to the histogram. Must be called with heap_lock held.
+void stats_search(size_t length)
+{
+  size_t bucket = 0;
+  if (length) {
+    bucket = (sizeof(unsigned long long) * 8) - (size_t)__builtin_clzll((unsigned long long)length);
+  }
+  search_lengths[bucket < LKL_STATS_SEARCH_BUCKETS ? bucket : LKL_STATS_SEARCH_BUCKETS - 1]++;
+}
+
+__attribute__((constructor)) static void register_fork_handlers(void)
+{
+  pthread_atfork(heap_lock_prepare, heap_lock_parent, heap_lock_child);
+}
+
+void heap_lock_prepare(void)
+{
+  pthread_mutex_lock(&heap_lock);
+}
+
+void heap_lock_parent(void)
+{
+  pthread_mutex_unlock(&heap_lock);
+}
+
+// Only the forking thread exists in the child so the lock is simply made fresh, as are the per CPU locks.
+void heap_lock_child(void)
+{
+  pthread_mutex_init(&heap_lock, NULL);
+  for (size_t cpu = 0; cpu_caches && cpu <= num_cpus; cpu++) {
+    cpu_caches[cpu].lock = 0;
+  }
+}
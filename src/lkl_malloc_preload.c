@@ -0,0 +1,274 @@
+// Exports the standard malloc family on top of lkl_malloc so an unmodified program can be run on it with
+//
+//     LD_PRELOAD=liblkl_malloc.so <program>
+//
+// These can be called by libc and the dynamic loader before main, and before any constructor in this
+// library has run, so nothing here or in lkl_malloc.c may depend on being initialised first.
+// Everything the allocator shares is statically initialised and its thread cache uses initial-exec TLS.
+//
+// Unlike lkl_malloc, zero sized requests are given a unique pointer as glibc does, since many
+// programs treat NULL from malloc(0) as running out of memory.
+//
+// Setting LKL_TRACE to a file name records every call to that file in the format of lkl_trace.h, from
+// when this library's constructor runs. LKL_TRACE_RECORDS sets how many records the file has room for.
+// Child processes inherit the variable, so a %p in the name is replaced by the process id. A process
+// leaves a file that another process is still recording to alone and records nothing.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // valloc, pvalloc, memalign
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "custom_allocator/lkl_malloc.h"
+#include "custom_allocator/lkl_trace.h"
+
+// Only these are visible outside the library, so calls within it to lkl_malloc cannot be interposed.
+#define LKL_EXPORT __attribute__((visibility("default")))
+
+// The trace file is mapped shared and each call claims the next record with an atomic add on the count in
+// its header, so recording takes no lock and never allocates. The file is created at full capacity but
+// stays sparse until records are written to it. trace is NULL while nothing is being recorded.
+#define TRACE_DEFAULT_RECORDS ((uint64_t)1 << 24)
+
+static struct lkl_trace_header* trace = NULL;
+static uint64_t trace_start_time;
+static __thread uint32_t trace_thread __attribute__((tls_model("initial-exec")));
+
+static inline void* set_errno_on_failure(void* ptr);
+static inline int is_power_of_two(size_t value);
+static inline void trace_record(enum lkl_trace_op op, void* object, uint64_t argument, size_t size);
+static inline uint64_t trace_now(void);
+static inline int trace_path(const char* pattern, char* path);
+static void trace_stop_in_child(void);
+
+LKL_EXPORT void* malloc(size_t size)
+{
+  void* ptr = set_errno_on_failure(lkl_malloc(size ? size : 1));
+  trace_record(LKL_TRACE_MALLOC, ptr, 0, size);
+  return ptr;
+}
+
+LKL_EXPORT void free(void* ptr)
+{
+  // Recorded first so a later allocation given the same address is recorded after it
+  if (ptr) {
+    trace_record(LKL_TRACE_FREE, ptr, 0, 0);
+  }
+  lkl_free(ptr);
+}
+
+LKL_EXPORT void* calloc(size_t num_elem, size_t elem_size)
+{
+  void* ptr;
+  if (num_elem == 0 || elem_size == 0) {
+    ptr = set_errno_on_failure(lkl_calloc(1, 1));
+  } else {
+    ptr = set_errno_on_failure(lkl_calloc(num_elem, elem_size));
+  }
+  trace_record(LKL_TRACE_CALLOC, ptr, 0, num_elem * elem_size);
+  return ptr;
+}
+
+LKL_EXPORT void* realloc(void* ptr, size_t size)
+{
+  if (!ptr) {
+    return malloc(size);
+  }
+  void* new_ptr = set_errno_on_failure(lkl_realloc(ptr, size));
+  trace_record(LKL_TRACE_REALLOC, new_ptr, (uintptr_t)ptr, size);
+  return new_ptr;
+}
+
+LKL_EXPORT int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+  int result = lkl_posix_memalign(memptr, alignment, size ? size : 1);
+  if (result != EINVAL) {
+    trace_record(LKL_TRACE_MEMALIGN, result ? NULL : *memptr, alignment, size);
+  }
+  return result;
+}
+
+LKL_EXPORT void* aligned_alloc(size_t alignment, size_t size)
+{
+  if (!is_power_of_two(alignment)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  void* ptr = set_errno_on_failure(lkl_aligned_alloc(alignment, size ? size : 1));
+  trace_record(LKL_TRACE_MEMALIGN, ptr, alignment, size);
+  return ptr;
+}
+
+// Like glibc, an alignment that is not a power of two is rounded up to one.
+LKL_EXPORT void* memalign(size_t alignment, size_t size)
+{
+  if (alignment > ((size_t)-1 >> 1) + 1) {
+    errno = EINVAL;
+    return NULL;
+  }
+  while (!is_power_of_two(alignment)) {
+    alignment = (alignment | (alignment - 1)) + 1;
+  }
+  void* ptr = set_errno_on_failure(lkl_memalign(alignment, size ? size : 1));
+  trace_record(LKL_TRACE_MEMALIGN, ptr, alignment, size);
+  return ptr;
+}
+
+LKL_EXPORT void* valloc(size_t size)
+{
+  return memalign((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+LKL_EXPORT void* pvalloc(size_t size)
+{
+  size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  if (size > (size_t)-1 - (page_size - 1)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+LKL_EXPORT size_t malloc_usable_size(void* ptr)
+{
+  return lkl_malloc_usable_size(ptr);
+}
+
+void* set_errno_on_failure(void* ptr)
+{
+  if (!ptr) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+int is_power_of_two(size_t value)
+{
+  return value != 0 && (value & (value - 1)) == 0;
+}
+
+void trace_record(enum lkl_trace_op op, void* object, uint64_t argument, size_t size)
+{
+  struct lkl_trace_header* header = __atomic_load_n(&trace, __ATOMIC_ACQUIRE);
+  if (!header) {
+    return;
+  }
+
+  uint64_t idx = __atomic_fetch_add(&header->num_records, 1, __ATOMIC_RELAXED);
+  if (idx >= header->capacity) {
+    return;
+  }
+  if (!trace_thread) {
+    trace_thread = (uint32_t)syscall(SYS_gettid);
+  }
+
+  struct lkl_trace_record* record = (struct lkl_trace_record*)(header + 1) + idx;
+  record->timestamp = trace_now() - trace_start_time;
+  record->object = (uintptr_t)object;
+  record->argument = argument;
+  record->size = size;
+  record->thread = trace_thread;
+  record->op = op;
+}
+
+uint64_t trace_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+// Nothing here allocates, as the malloc family may be called by what runs before it.
+__attribute__((constructor)) static void trace_start(void)
+{
+  const char* pattern = getenv("LKL_TRACE");
+  char path[PATH_MAX];
+  if (!pattern || !*pattern || !trace_path(pattern, path)) {
+    return;
+  }
+
+  uint64_t capacity = TRACE_DEFAULT_RECORDS;
+  const char* records = getenv("LKL_TRACE_RECORDS");
+  if (records && *records) {
+    capacity = strtoull(records, NULL, 10);
+  }
+  if (capacity == 0 || capacity > (SIZE_MAX - sizeof(struct lkl_trace_header)) / sizeof(struct lkl_trace_record)) {
+    return;
+  }
+  size_t file_size = sizeof(struct lkl_trace_header) + capacity * sizeof(struct lkl_trace_record);
+
+  // The lock is held until the process exits, so the file is left open
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0 || ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)file_size) != 0) {
+    close(fd);
+    return;
+  }
+  void* mapping = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    close(fd);
+    return;
+  }
+
+  struct lkl_trace_header* header = (struct lkl_trace_header*)mapping;
+  memcpy(header->magic, LKL_TRACE_MAGIC, sizeof(header->magic));
+  header->version = LKL_TRACE_VERSION;
+  header->record_size = sizeof(struct lkl_trace_record);
+  header->capacity = capacity;
+  header->num_records = 0;
+
+  // A child's objects would share addresses with the parent's, so it is not recorded
+  pthread_atfork(NULL, NULL, trace_stop_in_child);
+  trace_start_time = trace_now();
+  __atomic_store_n(&trace, header, __ATOMIC_RELEASE);
+}
+
+void trace_stop_in_child(void)
+{
+  trace = NULL;
+}
+
+// Copies pattern to path, which holds PATH_MAX bytes, with each %p replaced by the process id.
+// Returns 0 if it does not fit.
+int trace_path(const char* pattern, char* path)
+{
+  char pid[24];
+  size_t pid_length = 0;
+  for (unsigned long value = (unsigned long)getpid(); value || !pid_length; value /= 10) {
+    pid[pid_length++] = (char)('0' + value % 10);
+  }
+
+  size_t length = 0;
+  for (; *pattern; pattern++) {
+    if (pattern[0] == '%' && pattern[1] == 'p') {
+      if (length + pid_length >= PATH_MAX) {
+        return 0;
+      }
+      for (size_t digit = pid_length; digit-- > 0;) {
+        path[length++] = pid[digit];
+      }
+      pattern++;
+    } else {
+      if (length + 1 >= PATH_MAX) {
+        return 0;
+      }
+      path[length++] = *pattern;
+    }
+  }
+  path[length] = '\0';
+  return 1;
+}
@@ -0,0 +1,137 @@
+// Fixed size object pools on top of lkl_malloc
+#include "custom_allocator/lkl_pool.h"
+
+#include <stddef.h>
+
+#include "custom_allocator/lkl_malloc.h"
+
+// Slabs are sized to hold at least POOL_MIN_SLAB_OBJECTS objects and are at least POOL_SLAB_SIZE bytes,
+// which keeps them below the mmap threshold for small objects so they come from the heap.
+#define POOL_SLAB_SIZE (16 * 1024)
+#define POOL_MIN_SLAB_OBJECTS 8
+
+// Every slab starts with a link to the one before it, padded out so the first object is aligned.
+struct pool_slab
+{
+  struct pool_slab* next;
+};
+
+// A freed object's first word points at the next free object
+struct pool_free_obj
+{
+  struct pool_free_obj* next;
+};
+
+struct lkl_pool
+{
+  struct pool_free_obj* free_list;
+  char* bump;  // Objects in the newest slab that have never been handed out start here
+  char* slab_end;
+  struct pool_slab* slabs;
+  size_t obj_size;
+  size_t align;
+  size_t slab_size;
+  size_t slab_header_size;
+};
+
+static inline void* alloc_from_new_slab(struct lkl_pool* pool);
+
+struct lkl_pool* lkl_pool_create(size_t obj_size, size_t align)
+{
+  if (align == 0) {
+    align = __alignof__(max_align_t);
+  }
+  if (obj_size == 0 || (align & (align - 1)) != 0) {
+    return NULL;
+  }
+
+  // Each object must be able to hold the free list link when it is free
+  if (obj_size < sizeof(struct pool_free_obj)) {
+    obj_size = sizeof(struct pool_free_obj);
+  }
+  if (align < __alignof__(struct pool_free_obj)) {
+    align = __alignof__(struct pool_free_obj);
+  }
+  if (obj_size > (size_t)-1 - (align - 1)) {
+    return NULL;
+  }
+  obj_size = (obj_size + align - 1) & ~(align - 1);
+
+  size_t slab_header_size = (sizeof(struct pool_slab) + align - 1) & ~(align - 1);
+  if (obj_size > ((size_t)-1 - slab_header_size) / POOL_MIN_SLAB_OBJECTS) {
+    return NULL;
+  }
+  size_t slab_size = slab_header_size + obj_size * POOL_MIN_SLAB_OBJECTS;
+  if (slab_size < POOL_SLAB_SIZE) {
+    // Fill the rest of the slab with whole objects
+    slab_size += (POOL_SLAB_SIZE - slab_size) / obj_size * obj_size;
+  }
+
+  struct lkl_pool* pool = (struct lkl_pool*)lkl_malloc(sizeof(struct lkl_pool));
+  if (!pool) {
+    return NULL;
+  }
+  pool->free_list = NULL;
+  pool->bump = NULL;
+  pool->slab_end = NULL;
+  pool->slabs = NULL;
+  pool->obj_size = obj_size;
+  pool->align = align;
+  pool->slab_size = slab_size;
+  pool->slab_header_size = slab_header_size;
+  return pool;
+}
+
+void* lkl_pool_alloc(struct lkl_pool* pool)
+{
+  struct pool_free_obj* obj = pool->free_list;
+  if (obj) {
+    pool->free_list = obj->next;
+    return obj;
+  }
+
+  // Objects in the newest slab are handed out in order rather than all being pushed onto the free list
+  // when it is made, so a slab is only touched as far as it is used.
+  if ((size_t)(pool->slab_end - pool->bump) >= pool->obj_size) {
+    void* fresh = pool->bump;
+    pool->bump += pool->obj_size;
+    return fresh;
+  }
+  return alloc_from_new_slab(pool);
+}
+
+void lkl_pool_free(struct lkl_pool* pool, void* obj)
+{
+  if (!obj) {
+    return;
+  }
+  struct pool_free_obj* freed = (struct pool_free_obj*)obj;
+  freed->next = pool->free_list;
+  pool->free_list = freed;
+}
+
+void lkl_pool_destroy(struct lkl_pool* pool)
+{
+  struct pool_slab* slab = pool->slabs;
+  while (slab) {
+    struct pool_slab* next = slab->next;
+    lkl_free(slab);
+    slab = next;
+  }
+  lkl_free(pool);
+}
+
+void* alloc_from_new_slab(struct lkl_pool* pool)
+{
+  struct pool_slab* slab = (struct pool_slab*)lkl_memalign(pool->align, pool->slab_size);
+  if (!slab) {
+    return NULL;
+  }
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+
+  char* first_obj = (char*)slab + pool->slab_header_size;
+  pool->bump = first_obj + pool->obj_size;
+  pool->slab_end = (char*)slab + pool->slab_size;
+  return first_obj;
+}
@@ -0,0 +1,204 @@
+// Unit tests for the binary buddy implementation of malloc.
+// Like lkl_malloc_test.cpp, sbrk is mocked in mock_sbrk.cpp.
+
+#include <catch2/catch.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+extern "C" {
+#include "buddy_malloc.c"
+#include "mock_sbrk.h"
+}
+
+namespace {
+
+// A heap of its own for each test, starting on a top block boundary so offsets are easy to check
+struct test_heap
+{
+  test_heap(std::size_t num_top_blocks)
+    : memory((num_top_blocks + 1) * BUDDY_TOP_SIZE)
+  {
+    buddy_base = NULL;
+    nonempty_orders = 0;
+    mmap_threshold = MMAP_DEFAULT_THRESHOLD;
+
+    auto start = reinterpret_cast<std::uintptr_t>(memory.data());
+    std::size_t padding = (BUDDY_TOP_SIZE - start % BUDDY_TOP_SIZE) % BUDDY_TOP_SIZE;
+    init_heap(memory.data() + padding, memory.size() - padding);
+  }
+
+  std::vector<char> memory;
+};
+
+unsigned int order_bit(unsigned int order) { return 1u << (order - BUDDY_MIN_ORDER); }
+
+// Orders from low to high inclusive
+unsigned int order_bits(unsigned int low, unsigned int high)
+{
+  unsigned int bits = 0;
+  for (unsigned int order = low; order <= high; order++) {
+    bits |= order_bit(order);
+  }
+  return bits;
+}
+
+// Free blocks of a fresh top block, everything but the bitmap
+const unsigned int fresh_top_block = order_bits(BUDDY_BITMAP_ORDER, BUDDY_MAX_ORDER - 1);
+
+char* block_of(void* ptr) { return block_start(get_header(ptr)); }
+
+}  // namespace
+
+TEST_CASE("buddy order_for", "[buddy_malloc]")
+{
+  REQUIRE(order_for(1) == BUDDY_MIN_ORDER);
+  REQUIRE(order_for(32) == 5);
+  REQUIRE(order_for(33) == 6);
+  REQUIRE(order_for(4096) == 12);
+  REQUIRE(order_for(4097) == 13);
+  REQUIRE(order_for(BUDDY_TOP_SIZE) == BUDDY_MAX_ORDER);
+  REQUIRE(order_for(BUDDY_TOP_SIZE + 1) > BUDDY_MAX_ORDER);
+}
+
+TEST_CASE("buddy split and merge", "[buddy_malloc]")
+{
+  test_heap heap(2);
+
+  // Freeing a block overwrites its header with free list links, so blocks are found up front
+  void* first = lkl_malloc(16);
+  REQUIRE(first != NULL);
+  char* top = buddy_base;
+  const std::size_t first_offset = static_cast<std::size_t>(block_of(first) - top);
+
+  SECTION("first block comes after the bitmap and its split off halves are free")
+  {
+    REQUIRE(block_of(first) == top + (1 << BUDDY_BITMAP_ORDER));
+    REQUIRE(get_header(first)->block_size == 32);
+    REQUIRE(nonempty_orders == (order_bits(BUDDY_MIN_ORDER, BUDDY_BITMAP_ORDER - 1) | order_bits(BUDDY_BITMAP_ORDER + 1, BUDDY_MAX_ORDER - 1)));
+    REQUIRE(is_free_block(top, BUDDY_MIN_ORDER, (1 << BUDDY_BITMAP_ORDER) + 32));
+    REQUIRE(!is_free_block(top, BUDDY_MIN_ORDER, 1 << BUDDY_BITMAP_ORDER));
+  }
+
+  SECTION("freeing merges all the way back up")
+  {
+    lkl_free(first);
+    REQUIRE(nonempty_orders == fresh_top_block);
+    REQUIRE(is_free_block(top, BUDDY_BITMAP_ORDER, 1 << BUDDY_BITMAP_ORDER));
+  }
+
+  SECTION("buddies are handed out next to each other and merge once both are free")
+  {
+    void* second = lkl_malloc(16);
+    REQUIRE(block_of(second) == block_of(first) + 32);
+
+    lkl_free(first);
+    REQUIRE(is_free_block(top, BUDDY_MIN_ORDER, first_offset));
+    REQUIRE((nonempty_orders & order_bit(BUDDY_MIN_ORDER)) != 0);
+
+    lkl_free(second);
+    REQUIRE(nonempty_orders == fresh_top_block);
+  }
+
+  SECTION("neighbours that are not buddies do not merge")
+  {
+    void* second = lkl_malloc(16);
+    void* third = lkl_malloc(16);
+    REQUIRE(block_of(second) == block_of(first) + 32);
+    REQUIRE(block_of(third) == block_of(first) + 64);
+
+    // second is first's buddy, so it stays on its own while first is allocated
+    lkl_free(second);
+    lkl_free(third);
+    REQUIRE(is_free_block(top, BUDDY_MIN_ORDER, first_offset + 32));
+    REQUIRE(is_free_block(top, BUDDY_MIN_ORDER + 1, first_offset + 64));
+
+    lkl_free(first);
+    REQUIRE(nonempty_orders == fresh_top_block);
+  }
+
+  SECTION("realloc shrinking frees the upper halves")
+  {
+    void* large = lkl_malloc(4000);
+    REQUIRE(get_header(large)->block_size == 4096);
+    std::memset(large, 7, 4000);
+
+    REQUIRE(lkl_realloc(large, 100) == large);
+    REQUIRE(get_header(large)->block_size == 128);
+    const std::size_t large_offset = static_cast<std::size_t>(block_of(large) - top);
+    REQUIRE(is_free_block(top, 7, large_offset + 128));
+    REQUIRE(is_free_block(top, 11, large_offset + 2048));
+
+    lkl_free(large);
+    lkl_free(first);
+    REQUIRE(nonempty_orders == fresh_top_block);
+  }
+}
+
+TEST_CASE("buddy top blocks", "[buddy_malloc]")
+{
+  test_heap heap(4);
+  REQUIRE(lkl_mallopt(LKL_M_MMAP_THRESHOLD, BUDDY_TOP_SIZE) == 1);
+
+  constexpr std::size_t half_top = BUDDY_TOP_SIZE / 2 - 64;
+  void* first = lkl_malloc(half_top);
+  REQUIRE(first != NULL);
+  REQUIRE(get_header(first)->is_mmapped == 0);
+
+  SECTION("another top block is added when the first is full")
+  {
+    void* second = lkl_malloc(half_top);
+    REQUIRE(second != NULL);
+    REQUIRE(block_of(second) == buddy_base + BUDDY_TOP_SIZE + BUDDY_TOP_SIZE / 2);
+  }
+
+  SECTION("top blocks stay on a boundary after a foreign sbrk")
+  {
+    move_heap_break(100);
+    void* second = lkl_malloc(half_top);
+    REQUIRE(second != NULL);
+    REQUIRE(block_of(second) == buddy_base + 2 * BUDDY_TOP_SIZE + BUDDY_TOP_SIZE / 2);
+  }
+
+  SECTION("no space for another top block")
+  {
+    std::vector<void*> blocks;
+    for (void* res = lkl_malloc(half_top); res; res = lkl_malloc(half_top)) {
+      blocks.push_back(res);
+    }
+    REQUIRE(blocks.size() == 3);
+  }
+
+  SECTION("requests larger than half a top block are mapped")
+  {
+    void* mapped = lkl_malloc(BUDDY_TOP_SIZE / 2);
+    REQUIRE(mapped != NULL);
+    REQUIRE(get_header(mapped)->is_mmapped == 1);
+    lkl_free(mapped);
+  }
+
+  SECTION("a mapped block that has to move to grow keeps its contents")
+  {
+    void* mapped = lkl_malloc(BUDDY_TOP_SIZE / 2);
+    REQUIRE(mapped != NULL);
+    std::memset(mapped, 0x5a, BUDDY_TOP_SIZE / 2);
+
+    // Whatever is mapped right after the block makes mremap move it
+    struct buddy_header* header = get_header(mapped);
+    char* end = block_start(header) + header->block_size;
+    void* guard = mmap(end, page_align(1), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    REQUIRE((guard != MAP_FAILED || errno == EEXIST));
+
+    auto* grown = static_cast<unsigned char*>(lkl_realloc(mapped, BUDDY_TOP_SIZE));
+    REQUIRE(grown != NULL);
+    REQUIRE(grown != mapped);
+    REQUIRE(get_header(grown)->block_size >= BUDDY_TOP_SIZE);
+    REQUIRE(grown[0] == 0x5a);
+    REQUIRE(grown[BUDDY_TOP_SIZE / 2 - 1] == 0x5a);
+    lkl_free(grown);
+    if (guard != MAP_FAILED) {
+      munmap(guard, page_align(1));
+    }
+  }
+}
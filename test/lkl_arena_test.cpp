@@ -0,0 +1,215 @@
+// Unit tests for the arena allocator. Arenas take their chunks from lkl_malloc,
+// which in turn uses the mocked sbrk in mock_sbrk.cpp.
+
+#include <catch2/catch.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+#include "lkl_arena.c"
+#include "lkl_malloc.c"
+#include "mock_sbrk.h"
+}
+
+// Keeps chunks freed by one test from sitting in a thread cache once the next test's heap is in place
+static const int tcache_disabled = lkl_mallopt(LKL_M_TCACHE_COUNT, 0);
+
+namespace {
+
+bool is_aligned(const void* ptr, std::size_t alignment) { return reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0; }
+
+bool in_chunk(const void* ptr, std::size_t size, const struct arena_chunk* chunk)
+{
+  auto* start = reinterpret_cast<const char*>(ptr);
+  return start > reinterpret_cast<const char*>(chunk) && start + size <= chunk->end;
+}
+
+}  // namespace
+
+TEST_CASE("lkl_arena bump allocation", "[lkl_arena]")
+{
+  global_base = NULL;
+
+  constexpr std::size_t heap_size = 0x4000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr std::size_t chunk_size = 1024;
+  struct lkl_arena* arena = lkl_arena_create(chunk_size);
+  REQUIRE(arena != NULL);
+
+  SECTION("invalid requests")
+  {
+    REQUIRE(lkl_arena_alloc(arena, 0) == NULL);
+    REQUIRE(lkl_arena_alloc_aligned(arena, 8, 0) == NULL);
+    REQUIRE(lkl_arena_alloc_aligned(arena, 8, 24) == NULL);
+  }
+
+  SECTION("allocations follow each other in the chunk")
+  {
+    char* first = static_cast<char*>(lkl_arena_alloc(arena, 32));
+    char* second = static_cast<char*>(lkl_arena_alloc(arena, 16));
+
+    REQUIRE(first != NULL);
+    REQUIRE(second == first + 32);
+    REQUIRE(in_chunk(second, 16, arena->first));
+  }
+
+  SECTION("allocations are aligned")
+  {
+    REQUIRE(lkl_arena_alloc(arena, 1) != NULL);
+    REQUIRE(is_aligned(lkl_arena_alloc(arena, 24), alignof(std::max_align_t)));
+    REQUIRE(is_aligned(lkl_arena_alloc_aligned(arena, 8, 128), 128));
+  }
+
+  SECTION("a full chunk is followed by a new one")
+  {
+    void* first = lkl_arena_alloc(arena, chunk_size / 2);
+    void* second = lkl_arena_alloc(arena, chunk_size / 2);
+
+    REQUIRE(first != NULL);
+    REQUIRE(second != NULL);
+    REQUIRE(arena->current != arena->first);
+    REQUIRE(in_chunk(second, chunk_size / 2, arena->current));
+  }
+
+  SECTION("a request larger than a chunk gets a chunk big enough for it")
+  {
+    void* large = lkl_arena_alloc(arena, 4 * chunk_size);
+
+    REQUIRE(large != NULL);
+    REQUIRE(in_chunk(large, 4 * chunk_size, arena->current));
+  }
+
+  SECTION("no space")
+  {
+    REQUIRE(lkl_arena_alloc(arena, heap_size) == NULL);
+    REQUIRE(lkl_arena_alloc(arena, 16) != NULL);
+  }
+
+  lkl_arena_destroy(arena);
+}
+
+TEST_CASE("lkl_arena reset and destroy", "[lkl_arena]")
+{
+  global_base = NULL;
+
+  constexpr std::size_t heap_size = 0x4000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr std::size_t chunk_size = 1024;
+  struct lkl_arena* arena = lkl_arena_create(chunk_size);
+  REQUIRE(arena != NULL);
+
+  SECTION("reset reuses the same memory")
+  {
+    void* first = lkl_arena_alloc(arena, 64);
+    lkl_arena_alloc(arena, 64);
+    lkl_arena_reset(arena);
+
+    REQUIRE(lkl_arena_alloc(arena, 64) == first);
+  }
+
+  SECTION("reset keeps every chunk so refilling does not grow the heap")
+  {
+    for (int round = 0; round < 4; round++) {
+      for (int alloc = 0; alloc < 20; alloc++) {
+        REQUIRE(lkl_arena_alloc(arena, 200) != NULL);
+      }
+      const std::size_t filled_heap_top = heap_top;
+      lkl_arena_reset(arena);
+
+      for (int alloc = 0; alloc < 20; alloc++) {
+        REQUIRE(lkl_arena_alloc(arena, 200) != NULL);
+      }
+      REQUIRE(heap_top == filled_heap_top);
+      lkl_arena_reset(arena);
+    }
+  }
+
+  SECTION("reset chunks too small for a request are skipped over")
+  {
+    lkl_arena_alloc(arena, chunk_size / 2);
+    lkl_arena_alloc(arena, chunk_size / 2);
+    lkl_arena_reset(arena);
+
+    void* large = lkl_arena_alloc(arena, 2 * chunk_size);
+    REQUIRE(large != NULL);
+    REQUIRE(in_chunk(large, 2 * chunk_size, arena->current));
+  }
+
+  SECTION("destroy gives the chunks back to the heap")
+  {
+    for (int alloc = 0; alloc < 20; alloc++) {
+      REQUIRE(lkl_arena_alloc(arena, 200) != NULL);
+    }
+    const std::size_t filled_heap_top = heap_top;
+    lkl_arena_destroy(arena);
+
+    arena = lkl_arena_create(chunk_size);
+    for (int alloc = 0; alloc < 20; alloc++) {
+      REQUIRE(lkl_arena_alloc(arena, 200) != NULL);
+    }
+    REQUIRE(heap_top == filled_heap_top);
+  }
+
+  lkl_arena_destroy(arena);
+}
+
+TEST_CASE("lkl_arena child arenas", "[lkl_arena]")
+{
+  global_base = NULL;
+
+  constexpr std::size_t heap_size = 0x8000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr std::size_t chunk_size = 4096;
+  struct lkl_arena* parent = lkl_arena_create(chunk_size);
+  REQUIRE(parent != NULL);
+
+  constexpr std::size_t child_chunk_size = 512;
+  struct lkl_arena* child = lkl_arena_create_child(parent, child_chunk_size);
+  REQUIRE(child != NULL);
+
+  SECTION("child memory comes from the parent")
+  {
+    REQUIRE(in_chunk(child->first, child_chunk_size, parent->first));
+
+    for (int alloc = 0; alloc < 10; alloc++) {
+      void* res = lkl_arena_alloc(child, 100);
+      REQUIRE(res != NULL);
+      REQUIRE(in_chunk(res, 100, parent->first));
+    }
+  }
+
+  SECTION("child reset reuses its own chunks")
+  {
+    void* first = lkl_arena_alloc(child, 100);
+    for (int alloc = 0; alloc < 10; alloc++) {
+      lkl_arena_alloc(child, 100);
+    }
+    char* parent_bump = parent->bump;
+    lkl_arena_reset(child);
+
+    REQUIRE(lkl_arena_alloc(child, 100) == first);
+    for (int alloc = 0; alloc < 10; alloc++) {
+      lkl_arena_alloc(child, 100);
+    }
+    REQUIRE(parent->bump == parent_bump);
+  }
+
+  SECTION("parent reset takes back the child's memory")
+  {
+    lkl_arena_alloc(child, 100);
+    lkl_arena_destroy(child);
+    lkl_arena_reset(parent);
+
+    void* reused = lkl_arena_alloc(parent, 100);
+    REQUIRE(reinterpret_cast<char*>(reused) <= reinterpret_cast<char*>(child));
+  }
+
+  lkl_arena_destroy(parent);
+}
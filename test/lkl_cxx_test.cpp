@@ -0,0 +1,252 @@
+// Tests of the C++ layer in lkl_cxx.h. This file also replaces the global operator new and delete, so
+// everything the test process allocates with new, Catch included, is served by lkl_malloc on the real heap.
+
+#define LKL_REPLACE_GLOBAL_NEW
+#include "custom_allocator/lkl_cxx.h"
+
+#include <catch2/catch.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+bool is_aligned(const void* ptr, std::size_t alignment) { return reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0; }
+
+struct alignas(128) over_aligned
+{
+  char bytes[200];
+};
+
+// Counts what passes through to the heap resource
+class counting_resource : public std::pmr::memory_resource
+{
+public:
+  std::size_t allocations = 0;
+  std::size_t deallocations = 0;
+
+protected:
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    allocations++;
+    return lkl::heap_memory_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override
+  {
+    deallocations++;
+    lkl::heap_memory_resource()->deallocate(ptr, bytes, alignment);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+};
+
+}  // namespace
+
+TEST_CASE("heap_memory_resource", "[lkl_cxx]")
+{
+  std::pmr::memory_resource* resource = lkl::heap_memory_resource();
+
+  SECTION("containers allocate from it")
+  {
+    std::pmr::vector<std::pmr::string> strings(resource);
+    for (int idx = 0; idx < 1000; idx++) {
+      strings.emplace_back(std::to_string(idx) + " a string too long to be stored inline");
+    }
+    REQUIRE(strings[999] == "999 a string too long to be stored inline");
+    REQUIRE(lkl_malloc_usable_size(strings.data()) >= strings.capacity() * sizeof(std::pmr::string));
+  }
+
+  SECTION("alignment above max_align_t is honoured")
+  {
+    void* ptr = resource->allocate(100, 256);
+    REQUIRE(is_aligned(ptr, 256));
+    resource->deallocate(ptr, 100, 256);
+  }
+
+  SECTION("every heap resource is equal")
+  {
+    lkl::heap_resource other;
+    REQUIRE(resource->is_equal(other));
+    REQUIRE_FALSE(resource->is_equal(*std::pmr::new_delete_resource()));
+  }
+}
+
+TEST_CASE("arena_resource", "[lkl_cxx]")
+{
+  lkl::arena_resource arena(4096);
+
+  void* first = arena.allocate(24, 8);
+  void* aligned = arena.allocate(8, 64);
+  REQUIRE(first != aligned);
+  REQUIRE(is_aligned(aligned, 64));
+
+  SECTION("deallocating does not reuse memory")
+  {
+    arena.deallocate(first, 24, 8);
+    REQUIRE(arena.allocate(24, 8) != first);
+  }
+
+  SECTION("release makes all of it available again")
+  {
+    arena.release();
+    REQUIRE(arena.allocate(24, 8) == first);
+  }
+
+  SECTION("containers allocate from it")
+  {
+    std::pmr::vector<int> numbers(&arena);
+    for (int idx = 0; idx < 10000; idx++) {
+      numbers.push_back(idx);
+    }
+    REQUIRE(numbers[9999] == 9999);
+  }
+}
+
+TEST_CASE("pool_resource", "[lkl_cxx]")
+{
+  counting_resource upstream;
+  lkl::pool_resource pool(32, alignof(std::max_align_t), &upstream);
+
+  SECTION("objects that fit come from the pool")
+  {
+    void* first = pool.allocate(32);
+    void* second = pool.allocate(16);
+    REQUIRE(first != second);
+    pool.deallocate(first, 32);
+    REQUIRE(pool.allocate(24) == first);
+    REQUIRE(upstream.allocations == 0);
+  }
+
+  SECTION("larger or more aligned objects go upstream")
+  {
+    void* large = pool.allocate(64);
+    void* aligned = pool.allocate(16, 64);
+    REQUIRE(is_aligned(aligned, 64));
+    REQUIRE(upstream.allocations == 2);
+    pool.deallocate(large, 64);
+    pool.deallocate(aligned, 16, 64);
+    REQUIRE(upstream.deallocations == 2);
+  }
+
+  SECTION("list nodes come from the pool")
+  {
+    std::pmr::list<int> numbers(&pool);
+    for (int idx = 0; idx < 1000; idx++) {
+      numbers.push_back(idx);
+    }
+    REQUIRE(numbers.back() == 999);
+    REQUIRE(upstream.allocations == 0);
+  }
+
+  SECTION("bad arguments are rejected") { REQUIRE_THROWS_AS(lkl::pool_resource(32, 24), std::bad_alloc); }
+}
+
+TEST_CASE("lkl::allocator", "[lkl_cxx]")
+{
+  SECTION("containers allocate from lkl_malloc")
+  {
+    std::vector<int, lkl::allocator<int>> numbers;
+    for (int idx = 0; idx < 1000; idx++) {
+      numbers.push_back(idx);
+    }
+    REQUIRE(numbers[999] == 999);
+    REQUIRE(lkl_malloc_usable_size(numbers.data()) >= numbers.capacity() * sizeof(int));
+  }
+
+  SECTION("over aligned types are aligned")
+  {
+    std::vector<over_aligned, lkl::allocator<over_aligned>> objects(3);
+    REQUIRE(is_aligned(objects.data(), alignof(over_aligned)));
+  }
+
+  SECTION("allocators of any type are equal and convert")
+  {
+    lkl::allocator<int> ints;
+    lkl::allocator<double> doubles(ints);
+    REQUIRE(ints == doubles);
+  }
+
+  SECTION("allocate_at_least says how much room there is")
+  {
+    lkl::allocator<int> ints;
+    std::size_t live_before = lkl_get_stats().live_allocations;
+    lkl::allocation_result<int> result = ints.allocate_at_least(5);
+    std::size_t live_allocated = lkl_get_stats().live_allocations;
+    std::size_t count = result.count;
+    std::size_t usable_size = lkl_malloc_usable_size(result.ptr);
+    for (std::size_t idx = 0; idx < count; idx++) {
+      result.ptr[idx] = static_cast<int>(idx);
+    }
+    int last = result.ptr[count - 1];
+    ints.deallocate(result.ptr, count);
+    std::size_t live_after = lkl_get_stats().live_allocations;
+    REQUIRE(count >= 5);
+    REQUIRE(count == usable_size / sizeof(int));
+    REQUIRE(last == static_cast<int>(count - 1));
+    REQUIRE(live_allocated == live_before + 1);
+    REQUIRE(live_after == live_before);
+  }
+
+  SECTION("overflowing counts throw") { REQUIRE_THROWS_AS(lkl::allocator<int>().allocate(SIZE_MAX / 2), std::bad_array_new_length); }
+}
+
+TEST_CASE("global operator new and delete", "[lkl_cxx]")
+{
+  // Catch allocates too, so the counts are all taken before anything is checked
+  SECTION("new and sized delete")
+  {
+    std::size_t live_before = lkl_get_stats().live_allocations;
+    auto* numbers = new std::vector<int>(100);
+    std::size_t live_allocated = lkl_get_stats().live_allocations;
+    delete numbers;
+    std::size_t live_after = lkl_get_stats().live_allocations;
+    REQUIRE(live_allocated == live_before + 2);
+    REQUIRE(live_after == live_before);
+  }
+
+  SECTION("array new and delete")
+  {
+    std::size_t live_before = lkl_get_stats().live_allocations;
+    auto* numbers = new int[300]();
+    std::size_t live_allocated = lkl_get_stats().live_allocations;
+    std::size_t usable_size = lkl_malloc_usable_size(numbers);
+    delete[] numbers;
+    std::size_t live_after = lkl_get_stats().live_allocations;
+    REQUIRE(usable_size >= 300 * sizeof(int));
+    REQUIRE(live_allocated == live_before + 1);
+    REQUIRE(live_after == live_before);
+  }
+
+  SECTION("aligned new")
+  {
+    std::size_t live_before = lkl_get_stats().live_allocations;
+    auto* object = new over_aligned();
+    std::size_t live_allocated = lkl_get_stats().live_allocations;
+    bool aligned = is_aligned(object, alignof(over_aligned));
+    delete object;
+    std::size_t live_after = lkl_get_stats().live_allocations;
+    REQUIRE(aligned);
+    REQUIRE(live_allocated == live_before + 1);
+    REQUIRE(live_after == live_before);
+  }
+
+  SECTION("nothrow new returns nullptr when there is no space")
+  {
+    REQUIRE(::operator new(SIZE_MAX / 2, std::nothrow) == nullptr);
+    REQUIRE_THROWS_AS(::operator new(SIZE_MAX / 2), std::bad_alloc);
+  }
+
+  SECTION("zero sized allocations are distinct")
+  {
+    void* first = ::operator new(0);
+    void* second = ::operator new(0);
+    REQUIRE(first != second);
+    ::operator delete(first, std::size_t{0});
+    ::operator delete(second);
+  }
+}
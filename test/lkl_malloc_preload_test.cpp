@@ -0,0 +1,153 @@
+// Tests for the shared library that stands in for the standard malloc family.
+// The test executable is linked against it, so like a program run with LD_PRELOAD every allocation
+// in the process, including those made by libc and Catch2, goes through lkl_malloc.
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include <catch2/catch.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+
+namespace {
+
+// Kept out of sight of the compiler so it does not reject sizes it can tell are too large
+volatile std::size_t max_size = std::numeric_limits<std::size_t>::max();
+
+bool is_aligned(const void* ptr, std::size_t alignment) { return reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0; }
+
+}  // namespace
+
+TEST_CASE("malloc family resolves to the preload library", "[preload]")
+{
+  for (const char* name : {"malloc", "free", "calloc", "realloc", "posix_memalign", "aligned_alloc", "memalign", "valloc", "malloc_usable_size"}) {
+    Dl_info info;
+    REQUIRE(dladdr(dlsym(RTLD_DEFAULT, name), &info) != 0);
+    INFO(name);
+    REQUIRE(std::string(info.dli_fname).find("liblkl_malloc") != std::string::npos);
+  }
+}
+
+TEST_CASE("malloc and free", "[preload]")
+{
+  SECTION("zero size gives a unique pointer")
+  {
+    void* first = std::malloc(0);
+    void* second = std::malloc(0);
+    REQUIRE(first != NULL);
+    REQUIRE(second != NULL);
+    REQUIRE(first != second);
+    std::free(first);
+    std::free(second);
+  }
+
+  SECTION("failure sets errno")
+  {
+    errno = 0;
+    REQUIRE(std::malloc(max_size) == NULL);
+    REQUIRE(errno == ENOMEM);
+  }
+
+  SECTION("memory allocated inside libc can be freed")
+  {
+    char* copy = strdup("allocated by libc");
+    REQUIRE(copy != NULL);
+    REQUIRE(malloc_usable_size(copy) >= std::strlen(copy) + 1);
+    std::free(copy);
+  }
+}
+
+TEST_CASE("calloc", "[preload]")
+{
+  SECTION("memory is zeroed")
+  {
+    constexpr std::size_t num_elem = 100;
+    auto* res = static_cast<unsigned char*>(std::calloc(num_elem, sizeof(int)));
+    REQUIRE(res != NULL);
+    for (std::size_t idx = 0; idx < num_elem * sizeof(int); idx++) {
+      REQUIRE(res[idx] == 0);
+    }
+    std::free(res);
+  }
+
+  SECTION("overflowing size fails")
+  {
+    errno = 0;
+    REQUIRE(std::calloc(max_size / 2, 4) == NULL);
+    REQUIRE(errno == ENOMEM);
+  }
+}
+
+TEST_CASE("realloc", "[preload]")
+{
+  SECTION("null pointer allocates")
+  {
+    void* res = std::realloc(NULL, 0);
+    REQUIRE(res != NULL);
+    std::free(res);
+  }
+
+  SECTION("contents are kept")
+  {
+    auto* res = static_cast<char*>(std::malloc(16));
+    std::strcpy(res, "kept contents");
+    res = static_cast<char*>(std::realloc(res, 4096));
+    REQUIRE(res != NULL);
+    REQUIRE(std::strcmp(res, "kept contents") == 0);
+    std::free(res);
+  }
+}
+
+TEST_CASE("aligned allocation", "[preload]")
+{
+  const std::size_t page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+
+  SECTION("posix_memalign")
+  {
+    void* res = NULL;
+    REQUIRE(posix_memalign(&res, 3, 64) == EINVAL);
+    REQUIRE(posix_memalign(&res, sizeof(void*) / 2, 64) == EINVAL);
+    REQUIRE(res == NULL);
+
+    for (std::size_t alignment = sizeof(void*); alignment <= page_size; alignment *= 2) {
+      REQUIRE(posix_memalign(&res, alignment, 100) == 0);
+      REQUIRE(is_aligned(res, alignment));
+      std::free(res);
+    }
+  }
+
+  SECTION("aligned_alloc")
+  {
+    errno = 0;
+    REQUIRE(aligned_alloc(24, 64) == NULL);
+    REQUIRE(errno == EINVAL);
+
+    void* res = aligned_alloc(128, 256);
+    REQUIRE(is_aligned(res, 128));
+    std::free(res);
+  }
+
+  SECTION("memalign rounds the alignment up to a power of two")
+  {
+    void* res = memalign(48, 64);
+    REQUIRE(is_aligned(res, 64));
+    std::free(res);
+  }
+
+  SECTION("valloc and pvalloc")
+  {
+    void* res = valloc(10);
+    REQUIRE(is_aligned(res, page_size));
+    std::free(res);
+
+    res = pvalloc(10);
+    REQUIRE(is_aligned(res, page_size));
+    REQUIRE(malloc_usable_size(res) >= page_size);
+    std::free(res);
+  }
+}
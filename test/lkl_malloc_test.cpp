@@ -10,16 +10,47 @@
 #include <algorithm>
 #include <array>
 #include <catch2/catch.hpp>
+#include <cerrno>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
 #include <limits>
+#include <memory>
 #include <random>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
 
 extern "C" {
 #include "lkl_malloc.c"
 #include "mock_sbrk.h"
 }
 
+#if defined(LKL_ENABLE_AVX2) && !defined(__AVX2__)
+#error "LKL_ENABLE_AVX2 is meant to test the AVX2 scan of the slab bitmap"
+#endif
+
+// Most tests check where blocks end up in the heap, which relies on every freed block going
+// straight back to it. The thread cache is switched off for those and tested on its own.
+static const int tcache_disabled = lkl_mallopt(LKL_M_TCACHE_COUNT, 0);
+
+// Likewise small requests would otherwise be served from slabs outside of the test heap. Slabs are tested on their own.
+static const int slabs_disabled = lkl_mallopt(LKL_M_SLAB_MAX, 0);
+
+// And the heap would grow a whole segment at a time rather than by exactly what each request needs
+static const int segments_disabled = lkl_mallopt(LKL_M_HEAP_SEGMENT, 0);
+
+// Size of the block a request is given, as requests are rounded up so blocks and their headers fill whole granules
+constexpr std::size_t aligned_size(std::size_t size)
+{
+  const std::size_t whole_block = (size + sizeof(struct block_meta) + SIZE_CLASS_GRANULE - 1) & ~(SIZE_CLASS_GRANULE - 1);
+  return std::max(whole_block - sizeof(struct block_meta), MIN_BLOCK_PAYLOAD);
+}
+
+// The first header goes in the last word of a granule so its payload is aligned, which skips the start of the heap
+constexpr std::size_t heap_start_pad = SIZE_CLASS_GRANULE - sizeof(struct block_meta);
+
 // Checks if the returned pointer to newly allocated memory is within the bounds of the specified heap
 bool ptr_in_bounds(const char* ptr, std::size_t alloc_size, const char* heap_start, std::size_t heap_size)
 {
@@ -35,7 +66,7 @@ TEST_CASE("lkl_malloc first allocation", "[lkl_malloc]")
   {
     constexpr std::size_t heap_size = 16;
     constexpr std::size_t request_size = 0;
-    char test_heap[heap_size];
+    alignas(16) char test_heap[heap_size];
     init_heap(test_heap, heap_size);
 
     REQUIRE(lkl_malloc(request_size) == NULL);
@@ -45,7 +76,7 @@ TEST_CASE("lkl_malloc first allocation", "[lkl_malloc]")
   {
     constexpr std::size_t heap_size = 16;
     constexpr std::size_t request_size = 32;
-    char test_heap[heap_size];
+    alignas(16) char test_heap[heap_size];
     init_heap(test_heap, heap_size);
 
     REQUIRE(lkl_malloc(request_size) == NULL);
@@ -55,7 +86,7 @@ TEST_CASE("lkl_malloc first allocation", "[lkl_malloc]")
   {
     constexpr std::size_t heap_size = 64;
     constexpr std::size_t request_size = 8;
-    char test_heap[heap_size];
+    alignas(16) char test_heap[heap_size];
     init_heap(test_heap, heap_size);
 
     void* request_res = lkl_malloc(request_size);
@@ -63,7 +94,7 @@ TEST_CASE("lkl_malloc first allocation", "[lkl_malloc]")
     REQUIRE(request_res != NULL);
 
     char* res_heap_ptr = reinterpret_cast<char*>(request_res);
-    REQUIRE(res_heap_ptr == test_heap + sizeof(struct block_meta));
+    REQUIRE(res_heap_ptr == test_heap + heap_start_pad + sizeof(struct block_meta));
 
     REQUIRE(ptr_in_bounds(res_heap_ptr, request_size, test_heap, heap_size));
   }
@@ -77,17 +108,17 @@ TEST_CASE("lkl_malloc repeat allocate until full constant size", "[lkl_malloc]")
   SECTION("Total allocations uses heap completely - no fragmentation")
   {
     constexpr std::size_t request_size = 8;
-    constexpr std::size_t single_actual_alloc_size = request_size + sizeof(struct block_meta);
-    constexpr std::size_t heap_size = 4 * single_actual_alloc_size;
+    constexpr std::size_t single_actual_alloc_size = aligned_size(request_size) + sizeof(struct block_meta);
+    constexpr std::size_t heap_size = heap_start_pad + 4 * single_actual_alloc_size;
 
-    char test_heap[heap_size];
+    alignas(16) char test_heap[heap_size];
     init_heap(test_heap, heap_size);
 
     // Should be able to request 4 times
     // Request 1
     char* req1 = reinterpret_cast<char*>(lkl_malloc(request_size));
     REQUIRE(req1 != NULL);
-    REQUIRE(req1 == test_heap + sizeof(struct block_meta));
+    REQUIRE(req1 == test_heap + heap_start_pad + sizeof(struct block_meta));
     REQUIRE(ptr_in_bounds(req1, request_size, test_heap, heap_size));
 
     // Request 2
@@ -116,10 +147,10 @@ TEST_CASE("lkl_malloc repeat allocate until full constant size", "[lkl_malloc]")
   SECTION("Total allocations uses heap partially - fragmentation")
   {
     constexpr std::size_t request_size = 16;
-    constexpr std::size_t single_actual_alloc_size = request_size + sizeof(struct block_meta);
-    constexpr std::size_t heap_size = 3 * single_actual_alloc_size + 8;
+    constexpr std::size_t single_actual_alloc_size = aligned_size(request_size) + sizeof(struct block_meta);
+    constexpr std::size_t heap_size = heap_start_pad + 3 * single_actual_alloc_size + 8;
 
-    char test_heap[heap_size];
+    alignas(16) char test_heap[heap_size];
     init_heap(test_heap, heap_size);
 
     // Should be able to request space 3 times
@@ -127,7 +158,7 @@ TEST_CASE("lkl_malloc repeat allocate until full constant size", "[lkl_malloc]")
     // Request 1
     char* req1 = reinterpret_cast<char*>(lkl_malloc(request_size));
     REQUIRE(req1 != NULL);
-    REQUIRE(req1 == test_heap + sizeof(struct block_meta));
+    REQUIRE(req1 == test_heap + heap_start_pad + sizeof(struct block_meta));
     REQUIRE(ptr_in_bounds(req1, request_size, test_heap, heap_size));
 
     // Request 2
@@ -157,21 +188,21 @@ TEST_CASE("lkl_malloc repeat allocate until full variable size", "[lkl_malloc]")
   constexpr std::size_t req_size16 = 16;
   constexpr std::size_t req_size24 = 24;
 
-  constexpr std::size_t req_size8_act = req_size8 + sizeof(struct block_meta);
-  constexpr std::size_t req_size16_act = req_size16 + sizeof(struct block_meta);
-  constexpr std::size_t req_size24_act = req_size24 + sizeof(struct block_meta);
+  constexpr std::size_t req_size8_act = aligned_size(req_size8) + sizeof(struct block_meta);
+  constexpr std::size_t req_size16_act = aligned_size(req_size16) + sizeof(struct block_meta);
+  constexpr std::size_t req_size24_act = aligned_size(req_size24) + sizeof(struct block_meta);
 
   SECTION("Total allocations uses heap completely - no fragmentation")
   {
-    constexpr std::size_t heap_size = req_size8_act + req_size16_act + req_size24_act + req_size16_act;
-    char test_heap[heap_size];
+    constexpr std::size_t heap_size = heap_start_pad + req_size8_act + req_size16_act + req_size24_act + req_size16_act;
+    alignas(16) char test_heap[heap_size];
     init_heap(test_heap, heap_size);
 
     // Should be able to request 4 times in the order of 8, 16, 24, 16
 
     char* req1 = reinterpret_cast<char*>(lkl_malloc(req_size8));
     REQUIRE(req1 != NULL);
-    REQUIRE(req1 == test_heap + sizeof(struct block_meta));
+    REQUIRE(req1 == test_heap + heap_start_pad + sizeof(struct block_meta));
     REQUIRE(ptr_in_bounds(req1, req_size8, test_heap, heap_size));
 
     char* req2 = reinterpret_cast<char*>(lkl_malloc(req_size16));
@@ -195,14 +226,14 @@ TEST_CASE("lkl_malloc repeat allocate until full variable size", "[lkl_malloc]")
 
   SECTION("Total allocations uses heap partially - fragmentation")
   {
-    constexpr std::size_t heap_size = req_size16_act + req_size24_act + req_size16_act + req_size8_act;
-    char test_heap[heap_size];
+    constexpr std::size_t heap_size = heap_start_pad + req_size16_act + req_size24_act + req_size16_act + req_size16_act - 1;
+    alignas(16) char test_heap[heap_size];
     init_heap(test_heap, heap_size);
 
     // Can allocate 16, 24, 16 but next 16 cannot allocate
     char* req1 = reinterpret_cast<char*>(lkl_malloc(req_size16));
     REQUIRE(req1 != NULL);
-    REQUIRE(req1 == test_heap + sizeof(struct block_meta));
+    REQUIRE(req1 == test_heap + heap_start_pad + sizeof(struct block_meta));
     REQUIRE(ptr_in_bounds(req1, req_size16, test_heap, heap_size));
 
     char* req2 = reinterpret_cast<char*>(lkl_malloc(req_size24));
@@ -226,7 +257,7 @@ TEST_CASE("lkl_malloc reuses freed blocks", "[lkl_malloc]")
   REQUIRE(global_base == NULL);
 
   constexpr std::size_t heap_size = 0x100;
-  char test_heap[heap_size];
+  alignas(16) char test_heap[heap_size];
   init_heap(test_heap, heap_size);
 
   SECTION("reuse previously freed block")
@@ -263,13 +294,34 @@ TEST_CASE("lkl_malloc reuses freed blocks", "[lkl_malloc]")
       alloc_ptrs[idx] = lkl_malloc(alloc_sizes[idx]);
     }
 
+    // Only free blocks that are not next to each other so they are not merged
+    lkl_free(alloc_ptrs[1]);
+    lkl_free(alloc_ptrs[3]);
+
+    constexpr std::size_t req_size = 32;
+    void* new_alloc = lkl_malloc(req_size);
+    REQUIRE(new_alloc != NULL);
+    REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(new_alloc), req_size, test_heap, heap_size));
+    REQUIRE(new_alloc == alloc_ptrs[3]);
+  }
+
+  SECTION("reuse merged run of freed blocks")
+  {
+    constexpr std::size_t num_allocs = 5;
+    constexpr std::array<std::size_t, num_allocs> alloc_sizes = {8, 16, 8, 32, 64};
+    std::array<void*, num_allocs> alloc_ptrs = {0, 0, 0, 0, 0};
+
+    for (std::size_t idx = 0; idx < num_allocs; idx++) {
+      alloc_ptrs[idx] = lkl_malloc(alloc_sizes[idx]);
+    }
+
     std::for_each(alloc_ptrs.begin(), alloc_ptrs.end(), lkl_free);
 
     constexpr std::size_t req_size = 24;
     void* new_alloc = lkl_malloc(req_size);
     REQUIRE(new_alloc != NULL);
     REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(new_alloc), req_size, test_heap, heap_size));
-    REQUIRE(new_alloc == alloc_ptrs[3]);
+    REQUIRE(new_alloc == alloc_ptrs[0]);
   }
 
   SECTION("multiple reuse")
@@ -294,6 +346,432 @@ TEST_CASE("lkl_malloc reuses freed blocks", "[lkl_malloc]")
   }
 }
 
+TEST_CASE("lkl_malloc serves requests from size class bins", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  SECTION("exact size class preferred over earlier larger free block")
+  {
+    void* large_alloc = lkl_malloc(64);
+    void* fst_separator = lkl_malloc(8);
+    void* exact_alloc = lkl_malloc(32);
+    void* sec_separator = lkl_malloc(8);
+
+    lkl_free(large_alloc);
+    lkl_free(exact_alloc);
+
+    void* res = lkl_malloc(32);
+    REQUIRE(res != NULL);
+    REQUIRE(res == exact_alloc);
+    REQUIRE(res != fst_separator);
+    REQUIRE(res != sec_separator);
+  }
+
+  SECTION("falls back to the next non-empty size class")
+  {
+    void* large_alloc = lkl_malloc(64);
+    void* separator = lkl_malloc(8);
+    lkl_free(large_alloc);
+
+    void* res = lkl_malloc(40);
+    REQUIRE(res != NULL);
+    REQUIRE(res == large_alloc);
+    REQUIRE(res != separator);
+  }
+
+  SECTION("range bins are scanned for a block that fits")
+  {
+    void* fst_alloc = lkl_malloc(1000);
+    void* fst_separator = lkl_malloc(8);
+    void* sec_alloc = lkl_malloc(600);
+    void* sec_separator = lkl_malloc(8);
+
+    // Both blocks share the [512, 1024) bin with the smaller one at the head
+    lkl_free(sec_alloc);
+    lkl_free(fst_alloc);
+
+    void* res = lkl_malloc(800);
+    REQUIRE(res != NULL);
+    REQUIRE(res == fst_alloc);
+    REQUIRE(res != fst_separator);
+    REQUIRE(res != sec_separator);
+  }
+
+  SECTION("request sizes are rounded up to the size class")
+  {
+    void* fst_alloc = lkl_malloc(5);
+    lkl_free(fst_alloc);
+
+    void* res = lkl_malloc(sizeof(std::size_t));
+    REQUIRE(res != NULL);
+    REQUIRE(res == fst_alloc);
+    REQUIRE(get_block_size(get_block_ptr(res)) == MIN_BLOCK_PAYLOAD);
+  }
+}
+
+TEST_CASE("lkl_malloc placement policies", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x4000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  // Three blocks of the [1024, 2048) bin, lowest in memory first, kept apart so they never merge
+  void* low_alloc = lkl_malloc(1500);
+  lkl_malloc(8);
+  void* mid_alloc = lkl_malloc(1100);
+  lkl_malloc(8);
+  void* high_alloc = lkl_malloc(1200);
+  lkl_malloc(8);
+
+  SECTION("first fit takes the block freed first")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_PLACEMENT_FIRST_FIT) == 1);
+    lkl_free(high_alloc);
+    lkl_free(mid_alloc);
+    lkl_free(low_alloc);
+
+    REQUIRE(lkl_malloc(1050) == high_alloc);
+  }
+
+  SECTION("best fit takes the smallest block")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_PLACEMENT_BEST_FIT) == 1);
+    lkl_free(high_alloc);
+    lkl_free(low_alloc);
+    lkl_free(mid_alloc);
+
+    REQUIRE(lkl_malloc(1050) == mid_alloc);
+    REQUIRE(lkl_malloc(1150) == high_alloc);
+  }
+
+  SECTION("best fit takes the first block of a larger small bin")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_PLACEMENT_BEST_FIT) == 1);
+    constexpr std::size_t num_small = 16;
+    std::array<void*, num_small> small_allocs;
+    for (void*& ptr : small_allocs) {
+      ptr = lkl_malloc(200);
+      lkl_malloc(8);
+    }
+    for (void* ptr : small_allocs) {
+      lkl_free(ptr);
+    }
+
+    // Every block of the bin is the same size, so only the one freed first is looked at
+    const lkl_stats before = lkl_get_stats();
+    void* res = lkl_malloc(100);
+    const lkl_stats after = lkl_get_stats();
+    REQUIRE(res == small_allocs.front());
+    REQUIRE(after.search_lengths[1] == before.search_lengths[1] + 1);
+    for (std::size_t bucket = 2; bucket < LKL_STATS_SEARCH_BUCKETS; bucket++) {
+      REQUIRE(after.search_lengths[bucket] == before.search_lengths[bucket]);
+    }
+  }
+
+  SECTION("address ordered takes the lowest block")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_PLACEMENT_ADDRESS_ORDERED) == 1);
+    lkl_free(high_alloc);
+    lkl_free(mid_alloc);
+    lkl_free(low_alloc);
+
+    REQUIRE(lkl_malloc(1050) == low_alloc);
+    REQUIRE(lkl_malloc(1050) == mid_alloc);
+  }
+
+  SECTION("switching to address ordered sorts the blocks already free")
+  {
+    lkl_free(high_alloc);
+    lkl_free(mid_alloc);
+    lkl_free(low_alloc);
+    REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_PLACEMENT_ADDRESS_ORDERED) == 1);
+
+    REQUIRE(lkl_malloc(1050) == low_alloc);
+  }
+
+  SECTION("next fit carries on from the block last taken")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_PLACEMENT_NEXT_FIT) == 1);
+    lkl_free(mid_alloc);
+    lkl_free(low_alloc);
+    lkl_free(high_alloc);
+
+    // First fit would go back to mid_alloc at the head of the bin
+    REQUIRE(lkl_malloc(1400) == low_alloc);
+    REQUIRE(lkl_malloc(1050) == high_alloc);
+    REQUIRE(lkl_malloc(1050) == mid_alloc);
+  }
+
+  SECTION("bad values are rejected")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, -1) == 0);
+    REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_PLACEMENT_ADDRESS_ORDERED + 1) == 0);
+  }
+
+  REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_DEFAULT_PLACEMENT) == 1);
+}
+
+TEST_CASE("lkl_malloc best fit finds the smallest block through the size trie", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+  REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_PLACEMENT_BEST_FIT) == 1);
+
+  constexpr std::size_t min_alloc_size = 1024;
+  constexpr std::size_t max_alloc_size = 8192;
+  constexpr std::size_t num_allocs = 128;
+  constexpr std::size_t num_iters = 20000;
+
+  constexpr std::size_t heap_size = heap_start_pad + num_allocs * (aligned_size(max_alloc_size) + MIN_BLOCK_PAYLOAD + 2 * sizeof(struct block_meta));
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  std::mt19937 gen(1234);
+  std::uniform_int_distribution<std::size_t> alloc_size_rng(min_alloc_size, max_alloc_size);
+  std::uniform_int_distribution<std::size_t> idx_access_rng(0, num_allocs - 1);
+
+  // Each block is kept apart from the next so freeing it never merges it away
+  std::array<void*, num_allocs> alloc_ptrs;
+  for (void*& ptr : alloc_ptrs) {
+    ptr = lkl_malloc(max_alloc_size);
+    REQUIRE(lkl_malloc(8) != NULL);
+  }
+
+  for (std::size_t iter = 0; iter < num_iters; iter++) {
+    std::size_t idx = idx_access_rng(gen);
+    if (alloc_ptrs[idx] != NULL) {
+      lkl_free(alloc_ptrs[idx]);
+      alloc_ptrs[idx] = NULL;
+      continue;
+    }
+
+    // The smallest free block that fits, found by walking every large bin
+    std::size_t request_size = align_request(alloc_size_rng(gen));
+    std::size_t expected_size = 0;
+    for (std::size_t bin = NUM_SMALL_BINS; bin < NUM_BINS; bin++) {
+      for (struct free_block* current = bins[bin].next; current != &bins[bin]; current = current->next) {
+        std::size_t block_size = get_block_size(&current->meta);
+        if (block_size >= request_size && (!expected_size || block_size < expected_size)) {
+          expected_size = block_size;
+        }
+      }
+    }
+
+    struct block_meta* found = find_free_block(request_size);
+    REQUIRE((found ? get_block_size(found) : 0) == expected_size);
+    if (found) {
+      alloc_ptrs[idx] = lkl_malloc(request_size);
+      REQUIRE(alloc_ptrs[idx] == found + 1);
+    }
+  }
+
+  REQUIRE(lkl_mallopt(LKL_M_PLACEMENT, LKL_DEFAULT_PLACEMENT) == 1);
+}
+
+TEST_CASE("lkl_malloc splits oversized free blocks", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr std::size_t large_size = 512;
+  void* large_alloc = lkl_malloc(large_size);
+  void* separator = lkl_malloc(8);
+  lkl_free(large_alloc);
+
+  SECTION("remainder is handed out by the next request")
+  {
+    constexpr std::size_t small_size = 64;
+    char* fst_alloc = reinterpret_cast<char*>(lkl_malloc(small_size));
+    char* sec_alloc = reinterpret_cast<char*>(lkl_malloc(small_size));
+
+    REQUIRE(fst_alloc == large_alloc);
+    REQUIRE(get_block_size(get_block_ptr(fst_alloc)) == aligned_size(small_size));
+    REQUIRE(sec_alloc == fst_alloc + aligned_size(small_size) + sizeof(struct block_meta));
+    REQUIRE(get_block_size(get_block_ptr(sec_alloc)) == aligned_size(small_size));
+    REQUIRE(sec_alloc != separator);
+  }
+
+  SECTION("remainder too small for a block is kept")
+  {
+    constexpr std::size_t almost_large_size = large_size - sizeof(struct block_meta);
+    void* res = lkl_malloc(almost_large_size);
+
+    REQUIRE(res == large_alloc);
+    REQUIRE(get_block_size(get_block_ptr(res)) == aligned_size(large_size));
+  }
+}
+
+TEST_CASE("lkl_free merges adjacent free blocks", "[lkl_free]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr std::size_t req_size = 64;
+  constexpr std::size_t merged_size = 2 * aligned_size(req_size) + sizeof(struct block_meta);
+  void* fst_alloc = lkl_malloc(req_size);
+  void* sec_alloc = lkl_malloc(req_size);
+  void* trd_alloc = lkl_malloc(req_size);
+  void* separator = lkl_malloc(8);
+
+  SECTION("merge with following block")
+  {
+    lkl_free(sec_alloc);
+    lkl_free(fst_alloc);
+
+    REQUIRE(get_block_flag(get_block_ptr(fst_alloc), BLOCK_FREE) == 1);
+    REQUIRE(get_block_size(get_block_ptr(fst_alloc)) == merged_size);
+    REQUIRE(lkl_malloc(merged_size) == fst_alloc);
+  }
+
+  SECTION("merge with preceding block")
+  {
+    lkl_free(fst_alloc);
+    lkl_free(sec_alloc);
+
+    REQUIRE(get_block_flag(get_block_ptr(fst_alloc), BLOCK_FREE) == 1);
+    REQUIRE(get_block_size(get_block_ptr(fst_alloc)) == merged_size);
+    REQUIRE(lkl_malloc(merged_size) == fst_alloc);
+  }
+
+  SECTION("merge with both neighbours")
+  {
+    lkl_free(fst_alloc);
+    lkl_free(trd_alloc);
+    lkl_free(sec_alloc);
+
+    constexpr std::size_t all_merged_size = 3 * aligned_size(req_size) + 2 * sizeof(struct block_meta);
+    REQUIRE(get_block_size(get_block_ptr(fst_alloc)) == all_merged_size);
+    REQUIRE(lkl_malloc(all_merged_size) == fst_alloc);
+  }
+
+  SECTION("allocated neighbours are left alone")
+  {
+    lkl_free(sec_alloc);
+
+    REQUIRE(get_block_flag(get_block_ptr(fst_alloc), BLOCK_FREE) == 0);
+    REQUIRE(get_block_size(get_block_ptr(sec_alloc)) == aligned_size(req_size));
+    REQUIRE(get_block_flag(get_block_ptr(trd_alloc), BLOCK_FREE) == 0);
+    REQUIRE(get_block_flag(get_block_ptr(separator), BLOCK_FREE) == 0);
+  }
+
+  SECTION("blocks separated by a foreign sbrk are not merged")
+  {
+    lkl_free(separator);
+    move_heap_break(req_size);
+    void* after_gap = lkl_malloc(req_size);
+    REQUIRE(reinterpret_cast<char*>(after_gap)
+            == reinterpret_cast<char*>(separator) + aligned_size(8) + req_size + sizeof(struct block_meta));
+
+    lkl_free(after_gap);
+
+    REQUIRE(get_block_size(get_block_ptr(separator)) == aligned_size(8));
+    REQUIRE(get_block_size(get_block_ptr(after_gap)) == aligned_size(req_size));
+  }
+}
+
+TEST_CASE("lkl_malloc_batch and lkl_free_batch", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t req_size = 40;
+  constexpr std::size_t stride = aligned_size(req_size) + sizeof(struct block_meta);
+  constexpr std::size_t heap_size = heap_start_pad + 7 * stride;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  std::array<void*, 10> allocs{};
+
+  SECTION("blocks are carved from a single heap extension")
+  {
+    const unsigned long long calls_before = sbrk_calls;
+    REQUIRE(lkl_malloc_batch(req_size, 5, allocs.data()) == 5);
+    REQUIRE(sbrk_calls - calls_before <= 2);  // Aligning the break, then growing it once
+
+    for (std::size_t idx = 0; idx < 5; idx++) {
+      REQUIRE(allocs[idx] == test_heap + heap_start_pad + sizeof(struct block_meta) + idx * stride);
+      REQUIRE(get_block_size(get_block_ptr(allocs[idx])) == aligned_size(req_size));
+      REQUIRE(get_block_flag(get_block_ptr(allocs[idx]), BLOCK_FREE) == 0);
+      REQUIRE(get_block_flag(get_block_ptr(allocs[idx]), BLOCK_LAST) == (idx == 4));
+    }
+    REQUIRE(heap_tail == get_block_ptr(allocs[4]));
+
+    SECTION("freeing the batch merges it back into one block")
+    {
+      lkl_free_batch(allocs.data(), 5);
+
+      struct block_meta* block = get_block_ptr(allocs[0]);
+      REQUIRE(get_block_flag(block, BLOCK_FREE) == 1);
+      REQUIRE(get_block_flag(block, BLOCK_LAST) == 1);
+      REQUIRE(get_block_size(block) == 5 * stride - sizeof(struct block_meta));
+
+      SECTION("and a later batch is carved from that free block")
+      {
+        const unsigned long long calls_after = sbrk_calls;
+        REQUIRE(lkl_malloc_batch(req_size, 3, allocs.data()) == 3);
+        REQUIRE(sbrk_calls == calls_after);
+        REQUIRE(allocs[0] == block + 1);
+        REQUIRE(allocs[2] == static_cast<char*>(allocs[0]) + 2 * stride);
+        REQUIRE(get_block_flag(next_block(get_block_ptr(allocs[2])), BLOCK_FREE) == 1);
+      }
+    }
+  }
+
+  SECTION("as many blocks as there is space for are allocated")
+  {
+    REQUIRE(lkl_malloc_batch(req_size, allocs.size(), allocs.data()) == 7);
+    REQUIRE(heap_top == heap_size);
+    for (std::size_t idx = 0; idx < 7; idx++) {
+      REQUIRE(ptr_in_bounds(static_cast<char*>(allocs[idx]), req_size, test_heap, heap_size));
+      REQUIRE(std::count(allocs.begin(), allocs.begin() + 7, allocs[idx]) == 1);
+    }
+  }
+
+  SECTION("NULL pointers are skipped")
+  {
+    allocs[1] = lkl_malloc(req_size);
+    lkl_free_batch(allocs.data(), 3);
+    REQUIRE(get_block_flag(get_block_ptr(allocs[1]), BLOCK_FREE) == 1);
+  }
+}
+
+TEST_CASE("lkl_malloc heap does not grow under churn", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  // Enough room for the largest allocation once, but not for holes left by smaller ones
+  constexpr std::size_t max_alloc_size = 1024;
+  constexpr std::size_t heap_size = 2 * (max_alloc_size + sizeof(struct block_meta));
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  for (std::size_t alloc_size = 8; alloc_size <= max_alloc_size; alloc_size += 8) {
+    void* fst_alloc = lkl_malloc(alloc_size);
+    void* sec_alloc = lkl_malloc(max_alloc_size - alloc_size + 8);
+    REQUIRE(fst_alloc != NULL);
+    REQUIRE(sec_alloc != NULL);
+    lkl_free(fst_alloc);
+    lkl_free(sec_alloc);
+  }
+}
+
 TEST_CASE("lkl_malloc various workloads", "[lkl_malloc]")
 {
   global_base = NULL;
@@ -303,10 +781,10 @@ TEST_CASE("lkl_malloc various workloads", "[lkl_malloc]")
   {
     constexpr std::size_t alloc_size = 4096 - sizeof(struct block_meta);
     constexpr std::size_t num_allocs = 1000;
-    constexpr std::size_t heap_size = (alloc_size + sizeof(struct block_meta)) * num_allocs;
+    constexpr std::size_t heap_size = heap_start_pad + (alloc_size + sizeof(struct block_meta)) * num_allocs;
     constexpr std::size_t num_iter = 1000;
 
-    char test_heap[heap_size];
+    alignas(16) char test_heap[heap_size];
     init_heap(test_heap, heap_size);
 
     std::array<void*, num_allocs> alloc_ptrs;
@@ -336,8 +814,8 @@ TEST_CASE("lkl_malloc various workloads", "[lkl_malloc]")
     constexpr std::size_t num_rand_allocs = 1024;
     constexpr std::size_t num_rand_iters = 1000000;
 
-    constexpr std::size_t heap_size = num_rand_allocs * (max_alloc_size + sizeof(struct block_meta));
-    char test_heap[heap_size];
+    constexpr std::size_t heap_size = heap_start_pad + num_rand_allocs * (aligned_size(max_alloc_size) + sizeof(struct block_meta));
+    alignas(16) char test_heap[heap_size];
     init_heap(test_heap, heap_size);
 
     std::string seed_str("3458755949");  // Some random string
@@ -376,7 +854,7 @@ TEST_CASE("lkl_free NULL pointer argument is valid", "[lkl_free]")
   REQUIRE(global_base == NULL);
 
   constexpr std::size_t heap_size = 4096;
-  char test_heap[heap_size];
+  alignas(16) char test_heap[heap_size];
   init_heap(test_heap, heap_size);
 
   void* req = lkl_malloc(128);
@@ -403,7 +881,7 @@ TEST_CASE("lkl_calloc single allocation", "[lkl_calloc]")
   REQUIRE(global_base == NULL);
 
   constexpr std::size_t heap_size = 4096;
-  char test_heap[heap_size];
+  alignas(16) char test_heap[heap_size];
   init_heap(test_heap, heap_size);
 
   SECTION("first allocation")
@@ -449,7 +927,7 @@ TEST_CASE("lkl_calloc single allocation", "[lkl_calloc]")
     void* res = lkl_calloc(num_elem, elem_size);
 
     REQUIRE(res != NULL);
-    REQUIRE(reinterpret_cast<char*>(res) == reinterpret_cast<char*>(sec_alloc) + lkl_malloc_size + sizeof(struct block_meta));
+    REQUIRE(reinterpret_cast<char*>(res) == reinterpret_cast<char*>(sec_alloc) + aligned_size(lkl_malloc_size) + sizeof(struct block_meta));
     REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(res), alloc_size, test_heap, heap_size));
     REQUIRE(is_mem_block_zero(reinterpret_cast<char*>(res), alloc_size));
   }
@@ -461,7 +939,7 @@ TEST_CASE("lkl_calloc reuses freed segments", "[lkl_calloc]")
   REQUIRE(global_base == NULL);
 
   constexpr std::size_t heap_size = 4096;
-  char test_heap[heap_size];
+  alignas(16) char test_heap[heap_size];
   init_heap(test_heap, heap_size);
 
   SECTION("zeros out previous values")
@@ -500,9 +978,9 @@ TEST_CASE("lkl_calloc reuses freed segments", "[lkl_calloc]")
       ptrs[idx] = ptr;
     }
 
-    for (std::size_t idx = 0; idx < num_allocs; idx++) {
-      lkl_free(ptrs[idx]);
-    }
+    // Free blocks that are not next to each other so they are not merged
+    lkl_free(ptrs[1]);
+    lkl_free(ptrs[3]);
 
     char* res = reinterpret_cast<char*>(lkl_calloc(num_elem, elem_size));
 
@@ -519,7 +997,7 @@ TEST_CASE("lkl_realloc given null pointer", "[lkl_realloc]")
   REQUIRE(global_base == NULL);
 
   constexpr std::size_t heap_size = 4096;
-  char test_heap[heap_size];
+  alignas(16) char test_heap[heap_size];
   init_heap(test_heap, heap_size);
 
   SECTION("resize to 0")
@@ -554,7 +1032,7 @@ TEST_CASE("lkl_realloc valid pointer fittable in current block", "[lkl_malloc]")
   REQUIRE(global_base == NULL);
 
   constexpr std::size_t heap_size = 4096;
-  char test_heap[heap_size];
+  alignas(16) char test_heap[heap_size];
   init_heap(test_heap, heap_size);
 
   constexpr std::size_t req_size = 1024;
@@ -587,6 +1065,10 @@ TEST_CASE("lkl_realloc valid pointer fittable in current block", "[lkl_malloc]")
     REQUIRE(resized == res);
     REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(resized), resize_val, test_heap, heap_size));
     REQUIRE(mem_chunk_equal(reinterpret_cast<char*>(resized), reinterpret_cast<char*>(res), resize_val));
+
+    // The tail past the new size is released
+    REQUIRE(get_block_size(get_block_ptr(resized)) == aligned_size(resize_val));
+    REQUIRE(get_block_flag(next_block(get_block_ptr(resized)), BLOCK_FREE) == 1);
   }
 
   SECTION("resize to same size as original allocation")
@@ -599,19 +1081,24 @@ TEST_CASE("lkl_realloc valid pointer fittable in current block", "[lkl_malloc]")
     REQUIRE(mem_chunk_equal(reinterpret_cast<char*>(resized), reinterpret_cast<char*>(res), req_size));
   }
 
-  SECTION("resize to larger value in fragmented block")
+  SECTION("resize to larger value in split block")
   {
     lkl_free(res);
     void* req = lkl_malloc(req_size / 4);
     std::memset(req, 5, req_size / 4);
     REQUIRE(req == res);
 
+    // The rest of the original block was split off and is free so the allocation grows into it
     void* resized = lkl_realloc(req, req_size / 2);
 
     REQUIRE(resized != NULL);
     REQUIRE(resized == res);
+    REQUIRE(get_block_size(get_block_ptr(resized)) == aligned_size(req_size / 2));
     REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(resized), req_size / 2, test_heap, heap_size));
-    REQUIRE(mem_chunk_equal(reinterpret_cast<char*>(resized), reinterpret_cast<char*>(req), req_size / 4));
+
+    std::array<char, req_size / 4> expected;
+    expected.fill(5);
+    REQUIRE(mem_chunk_equal(reinterpret_cast<char*>(resized), expected.data(), req_size / 4));
   }
 }
 
@@ -621,7 +1108,7 @@ TEST_CASE("lkl_realloc valid pointer increase space", "[lkl_malloc]")
   REQUIRE(global_base == NULL);
 
   constexpr std::size_t heap_size = 4096;
-  char test_heap[heap_size];
+  alignas(16) char test_heap[heap_size];
   init_heap(test_heap, heap_size);
 
   constexpr std::size_t req_size = 1024;
@@ -636,27 +1123,1225 @@ TEST_CASE("lkl_realloc valid pointer increase space", "[lkl_malloc]")
     reinterpret_cast<char*>(res)[idx] = rng(gen);
   }
 
+  // Freed memory holds free list bookkeeping so compare against a copy
+  std::array<char, req_size> original;
+  std::memcpy(original.data(), res, req_size);
+
   SECTION("request size too large")
   {
+    errno = 0;
     void* resized = lkl_realloc(res, heap_size);
 
     REQUIRE(resized == NULL);
+    REQUIRE(errno == ENOMEM);
 
     // Original value should not be freed
-    REQUIRE((reinterpret_cast<struct block_meta*>(res) - 1)->is_free == 0);
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_FREE) == 0);
   }
 
-  SECTION("request size can be satisfied")
+  SECTION("request size can be satisfied by growing the top of the heap")
   {
     void* resized = lkl_realloc(res, req_size * 2);
 
     REQUIRE(resized != NULL);
+    REQUIRE(resized == res);
     REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(resized), req_size * 2, test_heap, heap_size));
+    REQUIRE(get_block_size(get_block_ptr(resized)) == aligned_size(req_size * 2));
 
-    // Technically dereferencing freed memory but we know what the behaviour is.
-    REQUIRE(mem_chunk_equal(reinterpret_cast<char*>(resized), reinterpret_cast<char*>(res), req_size));
+    REQUIRE(mem_chunk_equal(reinterpret_cast<char*>(resized), original.data(), req_size));
+  }
 
-    // Original value should not be freed
-    REQUIRE((reinterpret_cast<struct block_meta*>(res) - 1)->is_free == 1);
+  SECTION("request size can be satisfied by moving")
+  {
+    void* separator = lkl_malloc(8);
+    void* resized = lkl_realloc(res, req_size * 2);
+
+    REQUIRE(resized != NULL);
+    REQUIRE(resized != res);
+    REQUIRE(resized != separator);
+    REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(resized), req_size * 2, test_heap, heap_size));
+
+    REQUIRE(mem_chunk_equal(reinterpret_cast<char*>(resized), original.data(), req_size));
+
+    // Original value should be freed
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_FREE) == 1);
+  }
+
+  SECTION("free block that follows is taken over before moving the break")
+  {
+    void* following = lkl_malloc(req_size / 2);
+    lkl_free(following);
+    void* resized = lkl_realloc(res, req_size * 2);
+
+    REQUIRE(resized == res);
+    REQUIRE(get_block_size(get_block_ptr(resized)) == aligned_size(req_size * 2));
+    REQUIRE(get_block_flag(get_block_ptr(resized), BLOCK_LAST) == 1);
+    REQUIRE(mem_chunk_equal(reinterpret_cast<char*>(resized), original.data(), req_size));
+  }
+
+  SECTION("break moved by someone else")
+  {
+    move_heap_break(8);
+    void* resized = lkl_realloc(res, req_size + req_size / 2);
+
+    REQUIRE(resized != NULL);
+    REQUIRE(resized != res);
+    REQUIRE(mem_chunk_equal(reinterpret_cast<char*>(resized), original.data(), req_size));
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_FREE) == 1);
+  }
+}
+
+TEST_CASE("lkl_malloc large requests get a mapping of their own", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x4000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr std::size_t threshold = 0x2000;
+  REQUIRE(lkl_mallopt(LKL_M_MMAP_THRESHOLD, threshold) == 1);
+  const std::size_t page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+
+  SECTION("requests below the threshold come from the heap")
+  {
+    constexpr std::size_t req_size = threshold - SIZE_CLASS_GRANULE;
+    void* res = lkl_malloc(req_size);
+
+    REQUIRE(res != NULL);
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_MMAPPED) == 0);
+    REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(res), req_size, test_heap, heap_size));
+    lkl_free(res);
+  }
+
+  SECTION("requests at the threshold are mapped")
+  {
+    char* res = reinterpret_cast<char*>(lkl_malloc(threshold));
+
+    REQUIRE(res != NULL);
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_MMAPPED) == 1);
+    REQUIRE(!ptr_in_bounds(res, threshold, test_heap, heap_size));
+    REQUIRE(reinterpret_cast<std::uintptr_t>(get_block_ptr(res)) % page_size == heap_start_pad);
+    REQUIRE(get_block_size(get_block_ptr(res)) >= threshold);
+
+    std::memset(res, 7, threshold);
+    lkl_free(res);
+  }
+
+  SECTION("calloc of a mapped block is zeroed")
+  {
+    constexpr std::size_t num_elem = 4;
+    char* res = reinterpret_cast<char*>(lkl_calloc(num_elem, threshold));
+
+    REQUIRE(res != NULL);
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_MMAPPED) == 1);
+    REQUIRE(is_mem_block_zero(res, num_elem * threshold));
+    lkl_free(res);
   }
-}
\ No newline at end of file
+
+  SECTION("realloc grows a mapping keeping its contents")
+  {
+    constexpr std::size_t grown_size = 0x100000;
+    char* res = reinterpret_cast<char*>(lkl_malloc(threshold));
+    for (std::size_t idx = 0; idx < threshold; idx++) {
+      res[idx] = static_cast<char>(idx);
+    }
+    std::vector<char> original(res, res + threshold);
+
+    char* resized = reinterpret_cast<char*>(lkl_realloc(res, grown_size));
+
+    REQUIRE(resized != NULL);
+    REQUIRE(get_block_flag(get_block_ptr(resized), BLOCK_MMAPPED) == 1);
+    REQUIRE(get_block_size(get_block_ptr(resized)) >= grown_size);
+    REQUIRE(mem_chunk_equal(resized, original.data(), threshold));
+
+    std::memset(resized, 7, grown_size);
+    lkl_free(resized);
+  }
+
+  SECTION("an ordinary mapping spanning whole huge pages grows by normal pages")
+  {
+    // A block filling a mapping that starts on a huge page boundary and is a huge page long
+    char* reserved = static_cast<char*>(mmap(NULL, 2 * HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    REQUIRE(reserved != MAP_FAILED);
+    char* start = reinterpret_cast<char*>((reinterpret_cast<std::uintptr_t>(reserved) + HUGE_PAGE_SIZE - 1) & ~std::uintptr_t{HUGE_PAGE_SIZE - 1});
+    if (start != reserved) {
+      munmap(reserved, static_cast<std::size_t>(start - reserved));
+    }
+    munmap(start + HUGE_PAGE_SIZE, static_cast<std::size_t>(reserved + 2 * HUGE_PAGE_SIZE - (start + HUGE_PAGE_SIZE)));
+    struct block_meta* block = reinterpret_cast<struct block_meta*>(start + heap_start_pad);
+    init_block(block, HUGE_PAGE_SIZE - SIZE_CLASS_GRANULE, BLOCK_LAST | BLOCK_MMAPPED);
+    mapped_bytes += HUGE_PAGE_SIZE;
+
+    block = mremap_block(block, HUGE_PAGE_SIZE);
+    REQUIRE(block != NULL);
+    REQUIRE(get_block_size(block) >= HUGE_PAGE_SIZE);
+    REQUIRE(get_block_size(block) < HUGE_PAGE_SIZE + page_size);
+    munmap_block(block);
+  }
+
+  SECTION("realloc shrinks a mapping")
+  {
+    constexpr std::size_t large_size = 16 * threshold;
+    char* res = reinterpret_cast<char*>(lkl_malloc(large_size));
+    std::memset(res, 7, large_size);
+
+    char* resized = reinterpret_cast<char*>(lkl_realloc(res, threshold));
+
+    REQUIRE(resized == res);
+    REQUIRE(get_block_size(get_block_ptr(resized)) < large_size);
+    REQUIRE(get_block_size(get_block_ptr(resized)) >= threshold);
+    lkl_free(resized);
+  }
+
+  SECTION("heap block grown past the threshold moves to a mapping")
+  {
+    constexpr std::size_t req_size = 64;
+    char* res = reinterpret_cast<char*>(lkl_malloc(req_size));
+    std::memset(res, 7, req_size);
+
+    char* resized = reinterpret_cast<char*>(lkl_realloc(res, threshold));
+
+    REQUIRE(resized != NULL);
+    REQUIRE(get_block_flag(get_block_ptr(resized), BLOCK_MMAPPED) == 1);
+    REQUIRE(std::count(resized, resized + req_size, 7) == req_size);
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_FREE) == 1);
+    lkl_free(resized);
+  }
+
+  REQUIRE(lkl_mallopt(LKL_M_MMAP_THRESHOLD, MMAP_DEFAULT_THRESHOLD) == 1);
+}
+
+TEST_CASE("lkl_free gives memory back to the OS", "[lkl_free]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x10000;
+  alignas(4096) static char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr std::size_t threshold = 0x2000;
+  const std::size_t page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  REQUIRE(lkl_mallopt(LKL_M_TRIM_THRESHOLD, threshold) == 1);
+  REQUIRE(lkl_mallopt(LKL_M_TOP_PAD, 0) == 1);
+
+  constexpr std::size_t large_size = 0x8000;
+  void* separator = lkl_malloc(8);
+
+  SECTION("a large free block at the top of the heap moves the break down")
+  {
+    void* large_alloc = lkl_malloc(large_size);
+    const std::size_t grown_top = heap_top;
+    lkl_free(large_alloc);
+
+    REQUIRE(heap_top < grown_top);
+    REQUIRE(test_heap + heap_top == heap_end);
+    REQUIRE((heap_top + sizeof(struct block_meta)) % page_size == 0);
+    REQUIRE(get_block_flag(get_block_ptr(large_alloc), BLOCK_FREE) == 1);
+    REQUIRE(get_block_flag(get_block_ptr(large_alloc), BLOCK_LAST) == 1);
+
+    // What is left at the top is grown again rather than stranded
+    REQUIRE(lkl_malloc(large_size) == large_alloc);
+    REQUIRE(heap_top == grown_top);
+  }
+
+  SECTION("the top pad is kept")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_TOP_PAD, static_cast<int>(threshold)) == 1);
+    void* large_alloc = lkl_malloc(large_size);
+    lkl_free(large_alloc);
+
+    REQUIRE(get_block_size(get_block_ptr(large_alloc)) >= threshold);
+    REQUIRE(get_block_size(get_block_ptr(large_alloc)) < threshold + page_size);
+  }
+
+  SECTION("blocks below the threshold are kept")
+  {
+    void* small_alloc = lkl_malloc(threshold / 2);
+    const std::size_t grown_top = heap_top;
+    lkl_free(small_alloc);
+
+    REQUIRE(heap_top == grown_top);
+  }
+
+  SECTION("the break is left alone once moved by someone else")
+  {
+    void* large_alloc = lkl_malloc(large_size);
+    move_heap_break(page_size);
+    const std::size_t grown_top = heap_top;
+    lkl_free(large_alloc);
+
+    REQUIRE(heap_top == grown_top);
+  }
+
+  SECTION("large free blocks within the heap drop their pages")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_RELEASE_THRESHOLD, static_cast<int>(threshold)) == 1);
+    char* large_alloc = static_cast<char*>(lkl_malloc(large_size));
+    void* top_separator = lkl_malloc(8);
+    std::memset(large_alloc, 'a', large_size);
+    lkl_free(large_alloc);
+
+    // The first page holds the bin links, every whole page after it reads back as zeros
+    char* first_whole_page = test_heap + page_size;
+    REQUIRE(first_whole_page > large_alloc);
+    REQUIRE(std::count(first_whole_page, first_whole_page + page_size, 0) == static_cast<std::ptrdiff_t>(page_size));
+    REQUIRE(get_block_size(get_block_ptr(large_alloc)) == aligned_size(large_size));
+    REQUIRE(lkl_malloc(large_size) == large_alloc);
+
+    lkl_free(top_separator);
+    REQUIRE(lkl_mallopt(LKL_M_RELEASE_THRESHOLD, RELEASE_DEFAULT_THRESHOLD) == 1);
+  }
+
+  SECTION("small blocks churned next to a released block do not drop their pages again")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_RELEASE_THRESHOLD, static_cast<int>(threshold)) == 1);
+    void* large_alloc = lkl_malloc(large_size);
+    void* top_separator = lkl_malloc(8);
+    lkl_free(large_alloc);
+
+    // Each round splits a block off the front of the released one and merges it back, so dropping the
+    // merged block's pages would fault the small block's page in every round
+    constexpr int rounds = 1000;
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    for (int round = 0; round < rounds; round++) {
+      char* small_alloc = static_cast<char*>(lkl_malloc(page_size));
+      REQUIRE(small_alloc == large_alloc);
+      std::memset(small_alloc, 'a', page_size);
+      lkl_free(small_alloc);
+    }
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    REQUIRE(after.ru_minflt - before.ru_minflt < rounds / 10);
+
+    lkl_free(top_separator);
+    REQUIRE(lkl_mallopt(LKL_M_RELEASE_THRESHOLD, RELEASE_DEFAULT_THRESHOLD) == 1);
+  }
+
+  SECTION("lkl_trim releases what the thresholds left")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_TRIM_THRESHOLD, TRIM_DEFAULT_THRESHOLD) == 1);
+    void* large_alloc = lkl_malloc(large_size);
+    const std::size_t grown_top = heap_top;
+    lkl_free(large_alloc);
+    REQUIRE(heap_top == grown_top);
+
+    REQUIRE(lkl_trim(0) == 1);
+    REQUIRE(heap_top < grown_top);
+    REQUIRE(lkl_trim(0) == 0);
+  }
+
+  SECTION("bad values are rejected")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_TRIM_THRESHOLD, 0) == 0);
+    REQUIRE(lkl_mallopt(LKL_M_TOP_PAD, -1) == 0);
+    REQUIRE(lkl_mallopt(LKL_M_RELEASE_THRESHOLD, 0) == 0);
+  }
+
+  lkl_free(separator);
+  REQUIRE(lkl_mallopt(LKL_M_TRIM_THRESHOLD, TRIM_DEFAULT_THRESHOLD) == 1);
+  REQUIRE(lkl_mallopt(LKL_M_TOP_PAD, TOP_DEFAULT_PAD) == 1);
+}
+
+TEST_CASE("lkl_malloc grows the heap a segment at a time", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+  REQUIRE(segments_disabled == 1);
+
+  constexpr std::size_t segment = 0x8000;
+  constexpr std::size_t heap_size = 7 * segment / 2;
+  alignas(segment) static char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  REQUIRE(lkl_mallopt(LKL_M_HEAP_SEGMENT, 3 * segment) == 0);
+  REQUIRE(lkl_mallopt(LKL_M_HEAP_SEGMENT, 16) == 0);
+  REQUIRE(lkl_mallopt(LKL_M_HEAP_SEGMENT, static_cast<int>(segment)) == 1);
+
+  // The break ends just below a segment boundary so the header of the next segment's first block leaves its payload aligned
+  void* fst_alloc = lkl_malloc(32);
+  REQUIRE(fst_alloc == test_heap + heap_start_pad + sizeof(struct block_meta));
+  REQUIRE(heap_top == segment - sizeof(struct block_meta));
+  REQUIRE(get_block_flag(next_block(get_block_ptr(fst_alloc)), BLOCK_FREE) == 1);
+
+  SECTION("requests that fit in the segment do not move the break")
+  {
+    const unsigned long long calls_before = sbrk_calls;
+    for (int count = 0; count < 100; count++) {
+      REQUIRE(lkl_malloc(256) != NULL);
+    }
+    REQUIRE(sbrk_calls == calls_before);
+    REQUIRE(heap_top == segment - sizeof(struct block_meta));
+  }
+
+  SECTION("a request past the end of the segment grows the heap to the next boundary")
+  {
+    void* large_alloc = lkl_malloc(segment);
+    REQUIRE(large_alloc == static_cast<char*>(fst_alloc) + aligned_size(32) + sizeof(struct block_meta));
+    REQUIRE(heap_top == 2 * segment - sizeof(struct block_meta));
+
+    SECTION("trimming gives back whole segments")
+    {
+      lkl_free(large_alloc);
+      lkl_trim(0);
+      REQUIRE(heap_top == segment - sizeof(struct block_meta));
+    }
+  }
+
+  SECTION("the heap grows by only what is needed when a whole segment does not fit")
+  {
+    void* large_alloc = lkl_malloc(3 * segment);
+    REQUIRE(large_alloc != NULL);
+    const std::size_t grown_top = heap_top;
+    REQUIRE(grown_top > 3 * segment);
+    REQUIRE(grown_top < heap_size - sizeof(struct block_meta));
+    REQUIRE(lkl_malloc(heap_size) == NULL);
+    REQUIRE(heap_top == grown_top);
+  }
+
+  REQUIRE(lkl_mallopt(LKL_M_HEAP_SEGMENT, 0) == 1);
+}
+
+TEST_CASE("lkl_get_stats", "[lkl_get_stats]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x4000;
+  alignas(16) static char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  // Counters run for the whole process so only what each section adds is checked
+  const lkl_stats before = lkl_get_stats();
+
+  SECTION("allocations are counted at their usable size until freed")
+  {
+    void* fst_alloc = lkl_malloc(100);
+    void* sec_alloc = lkl_malloc(200);
+    lkl_stats stats = lkl_get_stats();
+    REQUIRE(stats.live_allocations == before.live_allocations + 2);
+    REQUIRE(stats.live_bytes == before.live_bytes + aligned_size(100) + aligned_size(200));
+
+    lkl_free(fst_alloc);
+    stats = lkl_get_stats();
+    REQUIRE(stats.live_allocations == before.live_allocations + 1);
+    REQUIRE(stats.live_bytes == before.live_bytes + aligned_size(200));
+
+    sec_alloc = lkl_realloc(sec_alloc, 300);
+    REQUIRE(lkl_get_stats().live_bytes == before.live_bytes + aligned_size(300));
+    lkl_free(sec_alloc);
+    REQUIRE(lkl_get_stats().live_bytes == before.live_bytes);
+  }
+
+  SECTION("moving the break is counted")
+  {
+    lkl_malloc(100);
+    lkl_malloc(100);
+    const lkl_stats stats = lkl_get_stats();
+
+    REQUIRE(stats.sbrk_calls > before.sbrk_calls);
+    REQUIRE(stats.heap_bytes - before.heap_bytes == heap_top);
+  }
+
+  SECTION("free lists and fragmentation")
+  {
+    void* fst_alloc = lkl_malloc(100);
+    lkl_malloc(8);
+    void* sec_alloc = lkl_malloc(100);
+    lkl_malloc(8);
+    lkl_free(fst_alloc);
+    lkl_free(sec_alloc);
+    const lkl_stats stats = lkl_get_stats();
+
+    REQUIRE(stats.free_blocks[bin_index(aligned_size(100))] == 2);
+    REQUIRE(stats.free_bytes == 2 * aligned_size(100));
+    REQUIRE(stats.largest_free_block == aligned_size(100));
+    REQUIRE(stats.fragmentation == Approx(0.5));
+  }
+
+  SECTION("free list search lengths are counted")
+  {
+    // A large bin holds a range of sizes so it is searched past blocks that are too small
+    void* small_alloc = lkl_malloc(1100);
+    lkl_malloc(8);
+    void* large_alloc = lkl_malloc(1500);
+    lkl_malloc(8);
+    REQUIRE(bin_index(aligned_size(1100)) == bin_index(aligned_size(1500)));
+    const lkl_stats with_nothing_free = lkl_get_stats();
+    REQUIRE(with_nothing_free.search_lengths[0] == before.search_lengths[0] + 3);
+
+    lkl_free(small_alloc);
+    lkl_free(large_alloc);
+    REQUIRE(lkl_malloc(1400) == large_alloc);
+    REQUIRE(lkl_get_stats().search_lengths[2] == before.search_lengths[2] + 1);
+  }
+
+  SECTION("large mappings are counted")
+  {
+    void* mapped = lkl_malloc(MMAP_DEFAULT_THRESHOLD);
+    const lkl_stats stats = lkl_get_stats();
+    REQUIRE(stats.mmap_calls == before.mmap_calls + 1);
+    REQUIRE(stats.mapped_bytes >= before.mapped_bytes + MMAP_DEFAULT_THRESHOLD);
+
+    lkl_free(mapped);
+    REQUIRE(lkl_get_stats().mapped_bytes == before.mapped_bytes);
+  }
+
+  SECTION("counts of exited threads are kept")
+  {
+    std::array<void*, 3> allocs;
+    std::thread([&allocs]() {
+      for (void*& alloc : allocs) {
+        alloc = lkl_malloc(100);
+      }
+    }).join();
+    REQUIRE(lkl_get_stats().live_allocations == before.live_allocations + allocs.size());
+
+    std::for_each(allocs.begin(), allocs.end(), lkl_free);
+    REQUIRE(lkl_get_stats().live_allocations == before.live_allocations);
+  }
+}
+
+TEST_CASE("lkl_memalign aligned allocations", "[lkl_memalign]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x4000;
+  alignas(256) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr std::size_t threshold = 0x2000;
+  REQUIRE(lkl_mallopt(LKL_M_MMAP_THRESHOLD, threshold) == 1);
+
+  SECTION("alignment that is not a power of two is rejected")
+  {
+    REQUIRE(lkl_memalign(0, 64) == NULL);
+    REQUIRE(lkl_memalign(48, 64) == NULL);
+  }
+
+  SECTION("payload is aligned for every power of two")
+  {
+    for (std::size_t alignment = 1; alignment <= 1024; alignment *= 2) {
+      void* res = lkl_memalign(alignment, 40);
+
+      REQUIRE(res != NULL);
+      REQUIRE(reinterpret_cast<std::uintptr_t>(res) % alignment == 0);
+      REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(res), 40, test_heap, heap_size));
+      lkl_free(res);
+    }
+  }
+
+  SECTION("space skipped to align the payload is left free")
+  {
+    constexpr std::size_t alignment = 256;
+    void* res = lkl_memalign(alignment, 64);
+
+    REQUIRE(res != NULL);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(res) % alignment == 0);
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_PREV_FREE) == 1);
+
+    struct block_meta* lead = prev_block(get_block_ptr(res));
+    REQUIRE(reinterpret_cast<char*>(lead) == test_heap + heap_start_pad);
+    REQUIRE(get_block_flag(lead, BLOCK_FREE) == 1);
+
+    void* reuse = lkl_malloc(get_block_size(lead));
+    REQUIRE(reuse == lead + 1);
+    lkl_free(reuse);
+    lkl_free(res);
+  }
+
+  SECTION("space past the request is left free")
+  {
+    void* res = lkl_memalign(512, 64);
+
+    REQUIRE(get_block_size(get_block_ptr(res)) == aligned_size(64));
+    REQUIRE(get_block_flag(next_block(get_block_ptr(res)), BLOCK_FREE) == 1);
+    lkl_free(res);
+  }
+
+  SECTION("large aligned requests are mapped")
+  {
+    constexpr std::size_t alignment = 0x10000;
+    char* res = reinterpret_cast<char*>(lkl_memalign(alignment, threshold));
+
+    REQUIRE(res != NULL);
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_MMAPPED) == 1);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(res) % alignment == 0);
+    REQUIRE(get_block_size(get_block_ptr(res)) >= threshold);
+    std::memset(res, 7, threshold);
+
+    char* resized = reinterpret_cast<char*>(lkl_realloc(res, 4 * threshold));
+    REQUIRE(resized != NULL);
+    REQUIRE(std::count(resized, resized + threshold, 7) == threshold);
+    std::memset(resized, 7, 4 * threshold);
+    lkl_free(resized);
+  }
+
+  REQUIRE(lkl_mallopt(LKL_M_MMAP_THRESHOLD, MMAP_DEFAULT_THRESHOLD) == 1);
+}
+
+TEST_CASE("lkl_aligned_alloc and lkl_posix_memalign", "[lkl_memalign]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x8000;
+  alignas(4096) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+  const std::size_t page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+
+  SECTION("cache line and page alignment")
+  {
+    void* line = lkl_aligned_alloc(64, 100);
+    void* page = lkl_aligned_alloc(page_size, 100);
+
+    REQUIRE(reinterpret_cast<std::uintptr_t>(line) % 64 == 0);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(page) % page_size == 0);
+    REQUIRE(ptr_in_bounds(reinterpret_cast<char*>(page), 100, test_heap, heap_size));
+    lkl_free(line);
+    lkl_free(page);
+  }
+
+  SECTION("aligned_alloc rejects an alignment that is not a power of two")
+  {
+    REQUIRE(lkl_aligned_alloc(96, 100) == NULL);
+  }
+
+  SECTION("posix_memalign")
+  {
+    void* res = NULL;
+    REQUIRE(lkl_posix_memalign(&res, 64, 100) == 0);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(res) % 64 == 0);
+    lkl_free(res);
+
+    void* untouched = &res;
+    REQUIRE(lkl_posix_memalign(&untouched, 96, 100) == EINVAL);
+    REQUIRE(lkl_posix_memalign(&untouched, sizeof(void*) / 2, 100) == EINVAL);
+    REQUIRE(lkl_posix_memalign(&untouched, 64, heap_size) == ENOMEM);
+    REQUIRE(untouched == &res);
+
+    REQUIRE(lkl_posix_memalign(&res, 64, 0) == 0);
+    REQUIRE(res == NULL);
+  }
+
+  SECTION("padding is reused")
+  {
+    // The heap starts on a page so aligning the second allocation skips over most of a page,
+    // which is then used for the next one
+    void* first = lkl_malloc(16);
+    void* page = lkl_aligned_alloc(page_size, 16);
+    void* fill = lkl_malloc(1024);
+
+    REQUIRE(reinterpret_cast<char*>(fill) < reinterpret_cast<char*>(page));
+    lkl_free(first);
+    lkl_free(page);
+    lkl_free(fill);
+  }
+}
+
+TEST_CASE("lkl_malloc payloads are aligned for any object", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+
+  // Something else left the break unaligned
+  init_heap(test_heap + 3, heap_size - 3);
+
+  std::vector<void*> allocations;
+  constexpr std::size_t req_sizes[] = {1, 7, 8, 13, 24, 33, 100};
+  for (std::size_t req_size : req_sizes) {
+    void* res = lkl_malloc(req_size);
+    REQUIRE(res != NULL);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(res) % alignof(std::max_align_t) == 0);
+    allocations.push_back(res);
+  }
+
+  // Payloads stay aligned when a freed block is split
+  lkl_free(allocations.back());
+  allocations.pop_back();
+  void* split = lkl_malloc(9);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(split) % alignof(std::max_align_t) == 0);
+  void* remainder = lkl_malloc(40);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(remainder) % alignof(std::max_align_t) == 0);
+
+  // And after a foreign sbrk
+  move_heap_break(5);
+  void* after_gap = lkl_malloc(200);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(after_gap) % alignof(std::max_align_t) == 0);
+}
+
+TEST_CASE("lkl_malloc blocks carry a single word header", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  REQUIRE(sizeof(struct block_meta) == sizeof(std::size_t));
+
+  SECTION("small objects take up a single granule past their size")
+  {
+    char* fst_alloc = reinterpret_cast<char*>(lkl_malloc(24));
+    char* sec_alloc = reinterpret_cast<char*>(lkl_malloc(16));
+    char* trd_alloc = reinterpret_cast<char*>(lkl_malloc(32));
+
+    REQUIRE(sec_alloc == fst_alloc + 2 * SIZE_CLASS_GRANULE);
+    REQUIRE(trd_alloc == sec_alloc + 2 * SIZE_CLASS_GRANULE);
+    REQUIRE(lkl_malloc_usable_size(trd_alloc) >= 32);
+  }
+
+  SECTION("flags are kept apart from the size")
+  {
+    void* fst_alloc = lkl_malloc(100);
+    void* sec_alloc = lkl_malloc(100);
+    struct block_meta* block = get_block_ptr(sec_alloc);
+    const std::size_t block_size = get_block_size(block);
+
+    REQUIRE(get_block_flag(block, BLOCK_LAST) == 1);
+    lkl_free(fst_alloc);
+    REQUIRE(get_block_flag(block, BLOCK_PREV_FREE) == 1);
+    REQUIRE(get_block_flag(block, BLOCK_FREE) == 0);
+    REQUIRE(get_block_size(block) == block_size);
+
+    set_block_size(block, block_size - 2 * SIZE_CLASS_GRANULE);
+    REQUIRE(get_block_flag(block, BLOCK_LAST) == 1);
+    REQUIRE(get_block_flag(block, BLOCK_PREV_FREE) == 1);
+    set_block_size(block, block_size);
+  }
+
+  SECTION("free blocks keep their bin links in the payload")
+  {
+    void* fst_alloc = lkl_malloc(64);
+    void* separator = lkl_malloc(8);
+    lkl_free(fst_alloc);
+
+    struct free_block* free_block = reinterpret_cast<struct free_block*>(get_block_ptr(fst_alloc));
+    REQUIRE(reinterpret_cast<char*>(&free_block->next) == fst_alloc);
+    REQUIRE(free_block->next == &bins[bin_index(aligned_size(64))]);
+    lkl_free(separator);
+  }
+}
+
+TEST_CASE("lkl_malloc_usable_size", "[lkl_malloc_usable_size]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  REQUIRE(lkl_malloc_usable_size(NULL) == 0);
+
+  void* res = lkl_malloc(13);
+  REQUIRE(lkl_malloc_usable_size(res) >= 13);
+  REQUIRE(lkl_malloc_usable_size(res) == get_block_size(get_block_ptr(res)));
+  lkl_free(res);
+}
+
+TEST_CASE("lkl_malloc serves small requests from slabs", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+  REQUIRE(slabs_disabled == 1);
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  REQUIRE(lkl_mallopt(LKL_M_SLAB_MAX, SLAB_DEFAULT_MAX) == 1);
+
+  SECTION("slots of a size class sit next to each other without headers")
+  {
+    char* fst_alloc = static_cast<char*>(lkl_malloc(20));
+    char* sec_alloc = static_cast<char*>(lkl_malloc(24));
+
+    REQUIRE(is_slab_slot(fst_alloc));
+    REQUIRE(!ptr_in_bounds(fst_alloc, 20, test_heap, heap_size));
+    REQUIRE(sec_alloc == fst_alloc + align_granule(20));
+    REQUIRE(slab_of(fst_alloc) == slab_of(sec_alloc));
+    REQUIRE(lkl_malloc_usable_size(fst_alloc) == align_granule(20));
+
+    lkl_free(fst_alloc);
+    lkl_free(sec_alloc);
+  }
+
+  SECTION("the lowest free slot is handed out first")
+  {
+    std::array<void*, 4> allocs;
+    for (void*& alloc : allocs) {
+      alloc = lkl_malloc(48);
+    }
+    struct slab* slab = slab_of(allocs[0]);
+    const unsigned int num_free = slab->num_free;
+
+    lkl_free(allocs[2]);
+    lkl_free(allocs[1]);
+    REQUIRE(slab->num_free == num_free + 2);
+
+    REQUIRE(lkl_malloc(48) == allocs[1]);
+    REQUIRE(lkl_malloc(48) == allocs[2]);
+    REQUIRE(slab->num_free == num_free);
+
+    for (void* alloc : allocs) {
+      lkl_free(alloc);
+    }
+  }
+
+  SECTION("a slot freed with its size goes back to its slab")
+  {
+    std::array<void*, 3> allocs;
+    for (void*& alloc : allocs) {
+      alloc = lkl_malloc(40);
+    }
+    struct slab* slab = slab_of(allocs[0]);
+    const unsigned int num_free = slab->num_free;
+    const lkl_stats before = lkl_get_stats();
+
+    lkl_free_sized(allocs[0], 40);
+    lkl_free_sized(allocs[1], lkl_malloc_usable_size(allocs[1]));
+    REQUIRE(slab->num_free == num_free + 2);
+    REQUIRE(lkl_malloc(40) == allocs[0]);
+
+    const lkl_stats after = lkl_get_stats();
+    REQUIRE(after.live_allocations == before.live_allocations - 1);
+    REQUIRE(after.live_bytes == before.live_bytes - align_granule(40));
+
+    lkl_free_sized(allocs[0], 33);
+    lkl_free_sized(allocs[2], 40);
+  }
+
+  SECTION("heap blocks freed with their size go through lkl_free")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_SLAB_MAX, 0) == 1);
+    void* res = lkl_malloc(40);
+    REQUIRE(!is_slab_slot(res));
+
+    lkl_free_sized(res, 40);
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_FREE) == 1);
+  }
+
+  SECTION("slots freed by another thread wait on their slab until the next allocation")
+  {
+    std::array<void*, 3> allocs;
+    for (void*& alloc : allocs) {
+      alloc = lkl_malloc(64);
+    }
+    struct slab* slab = slab_of(allocs[0]);
+    const unsigned int num_free = slab->num_free;
+    REQUIRE(slab->owner == &tcache);
+
+    std::thread([&allocs] {
+      lkl_free(allocs[0]);
+      lkl_free(allocs[1]);
+    }).join();
+    REQUIRE(slab->num_free == num_free);
+    REQUIRE(slab->remote_frees == allocs[1]);
+    REQUIRE(*static_cast<void**>(allocs[1]) == allocs[0]);
+    REQUIRE(remote_slabs == slab);
+
+    REQUIRE(lkl_malloc(64) == allocs[0]);
+    REQUIRE(remote_slabs == NULL);
+    REQUIRE(slab->remote_frees == NULL);
+    REQUIRE(slab->num_free == num_free + 1);
+
+    lkl_free(allocs[0]);
+    lkl_free(allocs[2]);
+  }
+
+  SECTION("a full slab is followed by a new one which is given up once empty")
+  {
+    constexpr std::size_t req_size = 1008;
+    constexpr std::size_t slots_per_slab = SLAB_SIZE / req_size;
+
+    // Use up whatever is left of the current slab so the next slab starts out empty
+    std::vector<void*> allocs;
+    do {
+      allocs.push_back(lkl_malloc(req_size));
+    } while (slab_of(allocs.back())->num_free != 0);
+    struct slab* full_slab = slab_of(allocs.back());
+
+    std::vector<void*> next_allocs;
+    for (std::size_t count = 0; count < slots_per_slab; count++) {
+      next_allocs.push_back(lkl_malloc(req_size));
+      REQUIRE(slab_of(next_allocs.back()) != full_slab);
+    }
+    struct slab* next_slab = slab_of(next_allocs.front());
+    REQUIRE(next_slab->num_free == 0);
+    REQUIRE(next_slab->num_slots == slots_per_slab);
+
+    lkl_free(allocs.back());
+    for (void* alloc : next_allocs) {
+      lkl_free(alloc);
+    }
+    REQUIRE(empty_slabs == next_slab);
+
+    // The last slab of a size class with free slots is kept even when it is empty
+    allocs.pop_back();
+    for (void* alloc : allocs) {
+      lkl_free(alloc);
+    }
+    REQUIRE(full_slab->num_free == full_slab->num_slots);
+    REQUIRE(slab_lists[bin_index(req_size)].next == full_slab);
+  }
+
+  SECTION("realloc keeps an object in its slot while it fits")
+  {
+    char* res = static_cast<char*>(lkl_malloc(40));
+    std::memset(res, 'a', 40);
+
+    REQUIRE(lkl_realloc(res, 48) == res);
+    REQUIRE(lkl_realloc(res, 1) == res);
+
+    char* grown = static_cast<char*>(lkl_realloc(res, 2048));
+    REQUIRE(grown != res);
+    REQUIRE(ptr_in_bounds(grown, 2048, test_heap, heap_size));
+    REQUIRE(std::count(grown, grown + 40, 'a') == 40);
+    lkl_free(grown);
+  }
+
+  SECTION("calloc zeroes a reused slot")
+  {
+    char* res = static_cast<char*>(lkl_malloc(64));
+    std::memset(res, 'a', 64);
+    lkl_free(res);
+
+    char* zeroed = static_cast<char*>(lkl_calloc(8, 8));
+    REQUIRE(zeroed == res);
+    REQUIRE(std::count(zeroed, zeroed + 64, 0) == 64);
+    lkl_free(zeroed);
+  }
+
+  SECTION("free slots are found anywhere in the bitmap")
+  {
+    struct slab slab = {};
+    slab.free_slots[SLAB_BITMAP_WORDS - 1] = 1ULL << 63;
+    REQUIRE(slab_find_free_slot(&slab) == SLAB_MAX_SLOTS - 1);
+
+    slab.free_slots[1] = 1ULL << 5;
+    REQUIRE(slab_find_free_slot(&slab) == 64 + 5);
+  }
+
+  SECTION("larger requests come from the heap")
+  {
+    void* res = lkl_malloc(SMALL_BIN_LIMIT);
+    REQUIRE(!is_slab_slot(res));
+    REQUIRE(ptr_in_bounds(static_cast<char*>(res), SMALL_BIN_LIMIT, test_heap, heap_size));
+    lkl_free(res);
+  }
+
+  SECTION("only sizes below the smallest large bin can be served from slabs")
+  {
+    REQUIRE(lkl_mallopt(LKL_M_SLAB_MAX, SMALL_BIN_LIMIT) == 0);
+    REQUIRE(lkl_mallopt(LKL_M_SLAB_MAX, -1) == 0);
+  }
+
+  REQUIRE(lkl_mallopt(LKL_M_SLAB_MAX, 0) == 1);
+}
+
+// Empties the calling thread's cache without touching the blocks in it, which belong to an earlier test heap
+void reset_tcache()
+{
+  std::fill(std::begin(tcache.entries), std::end(tcache.entries), nullptr);
+  std::fill(std::begin(tcache.counts), std::end(tcache.counts), 0);
+}
+
+TEST_CASE("lkl_malloc thread cache", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+  REQUIRE(tcache_disabled == 1);
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr unsigned int cache_count = 4;
+  reset_tcache();
+  REQUIRE(lkl_mallopt(LKL_M_TCACHE_COUNT, cache_count) == 1);
+
+  constexpr std::size_t req_size = 32;
+  const std::size_t idx = bin_index(req_size);
+
+  SECTION("empty cache is refilled in a batch")
+  {
+    void* res = lkl_malloc(req_size);
+
+    REQUIRE(res != NULL);
+    REQUIRE(tcache.counts[idx] == cache_count / TCACHE_BATCH_DIVISOR - 1);
+    REQUIRE(tcache.entries[idx] == static_cast<char*>(res) + aligned_size(req_size) + sizeof(struct block_meta));
+  }
+
+  SECTION("freed block is reused without going back to the heap")
+  {
+    void* fst_alloc = lkl_malloc(req_size);
+    lkl_free(fst_alloc);
+
+    REQUIRE(get_block_flag(get_block_ptr(fst_alloc), BLOCK_FREE) == 0);
+    REQUIRE(lkl_malloc(req_size) == fst_alloc);
+  }
+
+  SECTION("full cache drains back to the heap")
+  {
+    std::array<void*, cache_count + 2> allocs;
+    for (void*& alloc : allocs) {
+      alloc = lkl_malloc(req_size);
+      REQUIRE(alloc != NULL);
+    }
+    for (void* alloc : allocs) {
+      lkl_free(alloc);
+      REQUIRE(tcache.counts[idx] <= cache_count);
+    }
+
+    std::size_t num_heap_free = 0;
+    for (void* alloc : allocs) {
+      num_heap_free += static_cast<std::size_t>(get_block_flag(get_block_ptr(alloc), BLOCK_FREE));
+    }
+    REQUIRE(num_heap_free > 0);
+  }
+
+  SECTION("flush returns every cached block to the heap")
+  {
+    void* fst_alloc = lkl_malloc(req_size);
+    void* sec_alloc = lkl_malloc(req_size);
+    lkl_free(fst_alloc);
+    lkl_free(sec_alloc);
+
+    tcache_flush();
+
+    REQUIRE(tcache.counts[idx] == 0);
+    REQUIRE(tcache.entries[idx] == NULL);
+    REQUIRE(get_block_flag(get_block_ptr(fst_alloc), BLOCK_FREE) == 1);
+    REQUIRE(get_block_flag(get_block_ptr(fst_alloc), BLOCK_LAST) == 1);
+  }
+
+  SECTION("large sizes are not cached")
+  {
+    void* res = lkl_malloc(SMALL_BIN_LIMIT);
+    lkl_free(res);
+
+    REQUIRE(get_block_flag(get_block_ptr(res), BLOCK_FREE) == 1);
+  }
+
+  tcache_flush();
+  REQUIRE(lkl_mallopt(LKL_M_TCACHE_COUNT, 0) == 1);
+}
+
+// The cache of the CPU the calling thread is on, which the test keeps it on
+struct cpu_cache& current_cpu_cache()
+{
+  int cpu = sched_getcpu();
+  return cpu_caches[cpu >= 0 && static_cast<std::size_t>(cpu) < num_cpus ? static_cast<std::size_t>(cpu) : num_cpus];
+}
+
+TEST_CASE("lkl_malloc per CPU cache", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+  REQUIRE(tcache_disabled == 1);
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  cpu_set_t old_affinity;
+  REQUIRE(pthread_getaffinity_np(pthread_self(), sizeof(old_affinity), &old_affinity) == 0);
+  cpu_set_t one_cpu;
+  CPU_ZERO(&one_cpu);
+  CPU_SET(static_cast<std::size_t>(sched_getcpu()), &one_cpu);
+  REQUIRE(pthread_setaffinity_np(pthread_self(), sizeof(one_cpu), &one_cpu) == 0);
+
+  constexpr unsigned int cache_count = 4;
+  REQUIRE(lkl_mallopt(LKL_M_PERCPU_COUNT, PERCPU_MAX_COUNT + 1) == 0);
+  REQUIRE(lkl_mallopt(LKL_M_PERCPU_COUNT, cache_count) == 1);
+  for (std::size_t cpu = 0; cpu <= num_cpus; cpu++) {
+    std::fill(std::begin(cpu_caches[cpu].counts), std::end(cpu_caches[cpu].counts), 0);
+  }
+
+  // Runs once through the restartable sequences, where the kernel supports them, and once through the locks
+  const int saved_use_rseq = percpu_use_rseq;
+  percpu_use_rseq = GENERATE_COPY(filter([=](int use_rseq) { return !use_rseq || saved_use_rseq; }, values({1, 0})));
+
+  constexpr std::size_t req_size = 32;
+  const std::size_t idx = bin_index(req_size);
+  struct cpu_cache& cache = current_cpu_cache();
+
+  SECTION("empty cache is refilled in a batch")
+  {
+    void* res = lkl_malloc(req_size);
+
+    REQUIRE(res != NULL);
+    REQUIRE(cache.counts[idx] == cache_count / TCACHE_BATCH_DIVISOR - 1);
+    REQUIRE(cache.entries[idx][0] == static_cast<char*>(res) + aligned_size(req_size) + sizeof(struct block_meta));
+    REQUIRE(tcache.counts[idx] == 0);
+  }
+
+  SECTION("freed block is reused without going back to the heap")
+  {
+    void* fst_alloc = lkl_malloc(req_size);
+    lkl_free(fst_alloc);
+
+    REQUIRE(get_block_flag(get_block_ptr(fst_alloc), BLOCK_FREE) == 0);
+    REQUIRE(cache.entries[idx][cache.counts[idx] - 1] == fst_alloc);
+    REQUIRE(lkl_malloc(req_size) == fst_alloc);
+  }
+
+  SECTION("a block freed by another thread on the same CPU is reused")
+  {
+    void* fst_alloc = lkl_malloc(req_size);
+    std::thread([=] { lkl_free(fst_alloc); }).join();
+
+    REQUIRE(lkl_malloc(req_size) == fst_alloc);
+  }
+
+  SECTION("full cache drains back to the heap")
+  {
+    std::array<void*, cache_count + 2> allocs;
+    for (void*& alloc : allocs) {
+      alloc = lkl_malloc(req_size);
+      REQUIRE(alloc != NULL);
+    }
+    for (void* alloc : allocs) {
+      lkl_free(alloc);
+      REQUIRE(cache.counts[idx] <= cache_count);
+    }
+
+    std::size_t num_heap_free = 0;
+    for (void* alloc : allocs) {
+      num_heap_free += static_cast<std::size_t>(get_block_flag(get_block_ptr(alloc), BLOCK_FREE));
+    }
+    REQUIRE(num_heap_free > 0);
+  }
+
+  SECTION("flush returns the CPU's cached blocks to the heap")
+  {
+    void* fst_alloc = lkl_malloc(req_size);
+    lkl_free(fst_alloc);
+
+    percpu_flush();
+
+    REQUIRE(cache.counts[idx] == 0);
+    REQUIRE(get_block_flag(get_block_ptr(fst_alloc), BLOCK_FREE) == 1);
+  }
+
+  SECTION("lowering the count empties every CPU's cache")
+  {
+    void* fst_alloc = lkl_malloc(req_size);
+    void* snd_alloc = lkl_malloc(req_size);
+    lkl_free(fst_alloc);
+
+    // As if a thread on a CPU without a cache of its own had freed it
+    struct cpu_cache& spare = cpu_caches[num_cpus];
+    spare.entries[idx][spare.counts[idx]++] = snd_alloc;
+
+    REQUIRE(lkl_mallopt(LKL_M_PERCPU_COUNT, cache_count / 2) == 1);
+    REQUIRE(cache.counts[idx] == 0);
+    REQUIRE(spare.counts[idx] == 0);
+    REQUIRE(get_block_flag(get_block_ptr(fst_alloc), BLOCK_FREE) == 1);
+    REQUIRE(get_block_flag(get_block_ptr(snd_alloc), BLOCK_FREE) == 1);
+    REQUIRE(percpu_max_count == cache_count / 2);
+  }
+
+  SECTION("a CPU without a cache of its own shares the spare under its lock")
+  {
+    // With no CPUs configured every CPU number is out of range and the spare is the only cache
+    auto spare = std::make_unique<struct cpu_cache>();
+    struct cpu_cache* const saved_caches = cpu_caches;
+    const std::size_t saved_num_cpus = num_cpus;
+    cpu_caches = spare.get();
+    num_cpus = 0;
+
+    void* fst_alloc = lkl_malloc(req_size);
+    lkl_free(fst_alloc);
+    REQUIRE(spare->entries[idx][spare->counts[idx] - 1] == fst_alloc);
+    REQUIRE(spare->lock == 0);
+    REQUIRE(lkl_malloc(req_size) == fst_alloc);
+
+    lkl_free(fst_alloc);
+    percpu_flush();
+    REQUIRE(spare->counts[idx] == 0);
+
+    cpu_caches = saved_caches;
+    num_cpus = saved_num_cpus;
+  }
+
+  percpu_flush();
+  percpu_use_rseq = saved_use_rseq;
+  REQUIRE(lkl_mallopt(LKL_M_PERCPU_COUNT, 0) == 1);
+  REQUIRE(pthread_setaffinity_np(pthread_self(), sizeof(old_affinity), &old_affinity) == 0);
+}
+
+TEST_CASE("lkl_malloc concurrent use from several threads", "[lkl_malloc]")
+{
+  global_base = NULL;
+  REQUIRE(global_base == NULL);
+
+  constexpr std::size_t num_threads = 8;
+  constexpr std::size_t num_slots = 64;
+  constexpr std::size_t num_iters = 20000;
+  constexpr std::size_t max_alloc_size = 1024;
+
+  // Room for every thread's live blocks plus what its cache may be holding on to
+  constexpr std::size_t cache_count = 16;
+  constexpr std::size_t max_cached_per_thread = cache_count * SMALL_BIN_LIMIT * NUM_SMALL_BINS;
+  std::vector<char> test_heap(num_threads * (num_slots * (max_alloc_size + sizeof(struct block_meta)) + max_cached_per_thread));
+  init_heap(test_heap.data(), test_heap.size());
+
+  reset_tcache();
+  REQUIRE(lkl_mallopt(LKL_M_TCACHE_COUNT, cache_count) == 1);
+
+  std::vector<int> failures(num_threads, 0);
+  std::vector<std::thread> threads;
+  for (std::size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([thread_idx, &failures]() {
+      std::mt19937 gen(static_cast<unsigned int>(thread_idx));
+      std::uniform_int_distribution<std::size_t> alloc_size_rng(1, max_alloc_size);
+      std::uniform_int_distribution<std::size_t> idx_access_rng(0, num_slots - 1);
+
+      std::array<char*, num_slots> ptrs;
+      std::array<std::size_t, num_slots> sizes;
+      ptrs.fill(nullptr);
+      const char pattern = static_cast<char>(thread_idx + 1);
+
+      for (std::size_t iter = 0; iter < num_iters; iter++) {
+        std::size_t idx = idx_access_rng(gen);
+        if (ptrs[idx]) {
+          // Every byte written by this thread must still be there
+          failures[thread_idx] += std::count(ptrs[idx], ptrs[idx] + sizes[idx], pattern) != static_cast<std::ptrdiff_t>(sizes[idx]);
+          lkl_free(ptrs[idx]);
+          ptrs[idx] = nullptr;
+        } else {
+          sizes[idx] = alloc_size_rng(gen);
+          ptrs[idx] = reinterpret_cast<char*>(lkl_malloc(sizes[idx]));
+          failures[thread_idx] += ptrs[idx] == nullptr;
+          if (ptrs[idx]) {
+            std::memset(ptrs[idx], pattern, sizes[idx]);
+          }
+        }
+      }
+
+      std::for_each(ptrs.begin(), ptrs.end(), lkl_free);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  REQUIRE(std::count(failures.begin(), failures.end(), 0) == static_cast<std::ptrdiff_t>(num_threads));
+
+  // Exiting threads flush their caches so everything merges back into a single free block
+  tcache_flush();
+  REQUIRE(get_block_flag(reinterpret_cast<struct block_meta*>(global_base), BLOCK_FREE) == 1);
+  REQUIRE(get_block_flag(reinterpret_cast<struct block_meta*>(global_base), BLOCK_LAST) == 1);
+
+  REQUIRE(lkl_mallopt(LKL_M_TCACHE_COUNT, 0) == 1);
+}
@@ -0,0 +1,166 @@
+// Unit tests for the fixed size object pool. Pools take their slabs from lkl_malloc,
+// which in turn uses the mocked sbrk in mock_sbrk.cpp.
+
+#include <algorithm>
+#include <catch2/catch.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <set>
+#include <vector>
+
+extern "C" {
+#include "lkl_malloc.c"
+#include "lkl_pool.c"
+#include "mock_sbrk.h"
+}
+
+// Keeps slabs freed by one test from sitting in a thread cache once the next test's heap is in place
+static const int tcache_disabled = lkl_mallopt(LKL_M_TCACHE_COUNT, 0);
+
+namespace {
+
+bool is_aligned(const void* ptr, std::size_t alignment) { return reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0; }
+
+}  // namespace
+
+TEST_CASE("lkl_pool_create", "[lkl_pool]")
+{
+  global_base = NULL;
+
+  constexpr std::size_t heap_size = 0x1000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  SECTION("invalid arguments")
+  {
+    REQUIRE(lkl_pool_create(0, 8) == NULL);
+    REQUIRE(lkl_pool_create(16, 24) == NULL);
+  }
+
+  SECTION("objects are big enough to hold the free list link")
+  {
+    struct lkl_pool* pool = lkl_pool_create(1, 1);
+    REQUIRE(pool != NULL);
+    REQUIRE(pool->obj_size == sizeof(void*));
+    lkl_pool_destroy(pool);
+  }
+
+  SECTION("object size is rounded up to the alignment")
+  {
+    struct lkl_pool* pool = lkl_pool_create(40, 32);
+    REQUIRE(pool != NULL);
+    REQUIRE(pool->obj_size == 64);
+    lkl_pool_destroy(pool);
+  }
+}
+
+TEST_CASE("lkl_pool allocation", "[lkl_pool]")
+{
+  global_base = NULL;
+
+  constexpr std::size_t heap_size = 0x40000;
+  alignas(16) char test_heap[heap_size];
+  init_heap(test_heap, heap_size);
+
+  constexpr std::size_t obj_size = 48;
+  struct lkl_pool* pool = lkl_pool_create(obj_size, 16);
+  REQUIRE(pool != NULL);
+
+  SECTION("objects are packed with no header between them")
+  {
+    char* first = static_cast<char*>(lkl_pool_alloc(pool));
+    char* second = static_cast<char*>(lkl_pool_alloc(pool));
+
+    REQUIRE(first != NULL);
+    REQUIRE(second == first + obj_size);
+  }
+
+  SECTION("objects are aligned")
+  {
+    struct lkl_pool* line_pool = lkl_pool_create(24, 64);
+    for (int alloc = 0; alloc < 100; alloc++) {
+      REQUIRE(is_aligned(lkl_pool_alloc(line_pool), 64));
+    }
+    lkl_pool_destroy(line_pool);
+  }
+
+  SECTION("freed objects are reused most recent first")
+  {
+    void* first = lkl_pool_alloc(pool);
+    void* second = lkl_pool_alloc(pool);
+    lkl_pool_free(pool, first);
+    lkl_pool_free(pool, second);
+
+    REQUIRE(lkl_pool_alloc(pool) == second);
+    REQUIRE(lkl_pool_alloc(pool) == first);
+  }
+
+  SECTION("free NULL is valid")
+  {
+    lkl_pool_free(pool, NULL);
+    REQUIRE(lkl_pool_alloc(pool) != NULL);
+  }
+
+  SECTION("objects spread over many slabs are distinct and usable")
+  {
+    std::vector<char*> objs;
+    for (int alloc = 0; alloc < 2000; alloc++) {
+      char* obj = static_cast<char*>(lkl_pool_alloc(pool));
+      REQUIRE(obj != NULL);
+      std::memset(obj, alloc % 256, obj_size);
+      objs.push_back(obj);
+    }
+    REQUIRE(std::set<char*>(objs.begin(), objs.end()).size() == objs.size());
+
+    for (std::size_t idx = 0; idx < objs.size(); idx++) {
+      REQUIRE(std::count(objs[idx], objs[idx] + obj_size, static_cast<char>(idx % 256)) == obj_size);
+    }
+  }
+
+  SECTION("churn does not add slabs")
+  {
+    std::vector<void*> objs;
+    for (int alloc = 0; alloc < 1000; alloc++) {
+      objs.push_back(lkl_pool_alloc(pool));
+    }
+    const std::size_t filled_heap_top = heap_top;
+
+    for (int round = 0; round < 10; round++) {
+      for (void* obj : objs) {
+        lkl_pool_free(pool, obj);
+      }
+      for (void*& obj : objs) {
+        obj = lkl_pool_alloc(pool);
+        REQUIRE(obj != NULL);
+      }
+    }
+    REQUIRE(heap_top == filled_heap_top);
+  }
+
+  SECTION("no space")
+  {
+    void* obj = NULL;
+    do {
+      obj = lkl_pool_alloc(pool);
+    } while (obj);
+    REQUIRE(lkl_pool_alloc(pool) == NULL);
+  }
+
+  SECTION("destroy gives the slabs back to the heap")
+  {
+    for (int alloc = 0; alloc < 1000; alloc++) {
+      lkl_pool_alloc(pool);
+    }
+    const std::size_t filled_heap_top = heap_top;
+    lkl_pool_destroy(pool);
+
+    pool = lkl_pool_create(obj_size, 16);
+    for (int alloc = 0; alloc < 1000; alloc++) {
+      REQUIRE(lkl_pool_alloc(pool) != NULL);
+    }
+    REQUIRE(heap_top == filled_heap_top);
+  }
+
+  lkl_pool_destroy(pool);
+}
@@ -0,0 +1,532 @@
+// Tests of the behaviour every malloc backend shares, written against lkl_malloc.h alone.
+// This file is linked once against each backend library, as the allocator would be selected at link time,
+// so the same tests check each of them. Their sbrk calls resolve to the mock in mock_sbrk.cpp.
+
+#include <algorithm>
+#include <catch2/catch.hpp>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "custom_allocator/lkl_malloc.h"
+
+extern "C" {
+#include "mock_sbrk.h"
+}
+
+namespace {
+
+// Every test case runs in a process of its own so the heap is shared by all of one test case's sections
+constexpr std::size_t heap_size = 16 * 1024 * 1024;
+alignas(4096) char test_heap[heap_size];
+const bool heap_ready = (init_heap(test_heap, heap_size), true);
+
+bool is_aligned(const void* ptr, std::size_t alignment) { return reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0; }
+
+void fill(void* ptr, std::size_t size, unsigned char value) { std::memset(ptr, value, size); }
+
+bool holds(const void* ptr, std::size_t size, unsigned char value)
+{
+  const auto* bytes = static_cast<const unsigned char*>(ptr);
+  return std::all_of(bytes, bytes + size, [value](unsigned char byte) { return byte == value; });
+}
+
+}  // namespace
+
+TEST_CASE("lkl_malloc", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  SECTION("zero size gives NULL")
+  {
+    REQUIRE(lkl_malloc(0) == NULL);
+  }
+
+  SECTION("impossible size gives NULL")
+  {
+    REQUIRE(lkl_malloc(static_cast<std::size_t>(-1)) == NULL);
+    REQUIRE(lkl_malloc(static_cast<std::size_t>(-1) - 64) == NULL);
+  }
+
+  SECTION("allocations are aligned, usable and do not overlap")
+  {
+    std::vector<std::pair<void*, std::size_t>> allocations;
+    for (std::size_t size = 1; size < 5000; size = size * 3 / 2 + 1) {
+      void* res = lkl_malloc(size);
+      REQUIRE(res != NULL);
+      REQUIRE(is_aligned(res, alignof(std::max_align_t)));
+      REQUIRE(lkl_malloc_usable_size(res) >= size);
+      fill(res, size, static_cast<unsigned char>(allocations.size()));
+      allocations.emplace_back(res, size);
+    }
+
+    for (std::size_t idx = 0; idx < allocations.size(); idx++) {
+      REQUIRE(holds(allocations[idx].first, allocations[idx].second, static_cast<unsigned char>(idx)));
+      lkl_free(allocations[idx].first);
+    }
+  }
+
+  SECTION("large allocations")
+  {
+    constexpr std::size_t large_size = 4 * 1024 * 1024;
+    void* res = lkl_malloc(large_size);
+    REQUIRE(res != NULL);
+    fill(res, large_size, 7);
+    REQUIRE(holds(res, large_size, 7));
+    lkl_free(res);
+  }
+
+  SECTION("freed memory is reused")
+  {
+    std::vector<void*> allocations;
+    for (int round = 0; round < 100; round++) {
+      for (int alloc = 0; alloc < 100; alloc++) {
+        allocations.push_back(lkl_malloc(1000));
+        REQUIRE(allocations.back() != NULL);
+      }
+      for (void* ptr : allocations) {
+        lkl_free(ptr);
+      }
+      allocations.clear();
+    }
+    // 100 rounds of 100KB would not fit in the heap had the memory not been reused
+  }
+
+  SECTION("free NULL is valid")
+  {
+    lkl_free(NULL);
+  }
+}
+
+TEST_CASE("lkl_calloc", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  SECTION("memory is zeroed, including reused memory")
+  {
+    void* dirty = lkl_malloc(512);
+    fill(dirty, 512, 0xff);
+    lkl_free(dirty);
+
+    void* res = lkl_calloc(128, 4);
+    REQUIRE(res != NULL);
+    REQUIRE(holds(res, 512, 0));
+    lkl_free(res);
+  }
+
+  SECTION("overflowing size gives NULL")
+  {
+    REQUIRE(lkl_calloc(static_cast<std::size_t>(-1) / 2, 4) == NULL);
+  }
+}
+
+TEST_CASE("lkl_realloc", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  SECTION("NULL pointer allocates")
+  {
+    void* res = lkl_realloc(NULL, 64);
+    REQUIRE(res != NULL);
+    lkl_free(res);
+  }
+
+  SECTION("contents are kept when growing and shrinking")
+  {
+    void* res = lkl_malloc(100);
+    fill(res, 100, 3);
+
+    constexpr std::size_t sizes[] = {200, 5000, 300000, 1000, 40, 100};
+    for (std::size_t size : sizes) {
+      res = lkl_realloc(res, size);
+      REQUIRE(res != NULL);
+      REQUIRE(holds(res, std::min<std::size_t>(size, 100), 3));
+      REQUIRE(lkl_malloc_usable_size(res) >= size);
+      fill(res, size, 3);
+    }
+    lkl_free(res);
+  }
+
+  SECTION("failure keeps the original allocation")
+  {
+    void* res = lkl_malloc(100);
+    fill(res, 100, 5);
+    REQUIRE(lkl_realloc(res, static_cast<std::size_t>(-1) - 64) == NULL);
+    REQUIRE(holds(res, 100, 5));
+    lkl_free(res);
+  }
+}
+
+TEST_CASE("batch allocation", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  const std::size_t live_before = lkl_get_stats().live_allocations;
+  constexpr std::size_t sizes[] = {8, 48, 700, 5000, 200000};
+  for (std::size_t size : sizes) {
+    std::vector<void*> allocs(64);
+    REQUIRE(lkl_malloc_batch(size, allocs.size(), allocs.data()) == allocs.size());
+    REQUIRE(lkl_get_stats().live_allocations == live_before + allocs.size());
+
+    for (std::size_t idx = 0; idx < allocs.size(); idx++) {
+      REQUIRE(is_aligned(allocs[idx], alignof(std::max_align_t)));
+      REQUIRE(lkl_malloc_usable_size(allocs[idx]) >= size);
+      fill(allocs[idx], size, static_cast<unsigned char>(idx));
+    }
+    for (std::size_t idx = 0; idx < allocs.size(); idx++) {
+      REQUIRE(holds(allocs[idx], size, static_cast<unsigned char>(idx)));
+    }
+
+    // Batches may mix in blocks from anywhere, and NULLs
+    allocs.push_back(lkl_malloc(size));
+    allocs.push_back(nullptr);
+    lkl_free_batch(allocs.data(), allocs.size());
+    REQUIRE(lkl_get_stats().live_allocations == live_before);
+  }
+
+  SECTION("empty requests allocate nothing")
+  {
+    void* res = nullptr;
+    REQUIRE(lkl_malloc_batch(0, 1, &res) == 0);
+    REQUIRE(lkl_malloc_batch(16, 0, &res) == 0);
+    lkl_free_batch(&res, 0);
+  }
+}
+
+TEST_CASE("sized free", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  const lkl_stats before = lkl_get_stats();
+  constexpr std::size_t sizes[] = {8, 48, 700, 5000, 200000};
+  for (std::size_t size : sizes) {
+    void* exact = lkl_malloc(size);
+    void* usable = lkl_malloc(size);
+    REQUIRE(exact);
+    REQUIRE(usable);
+    fill(exact, size, 1);
+    fill(usable, size, 2);
+    REQUIRE(holds(exact, size, 1));
+    REQUIRE(holds(usable, size, 2));
+
+    // The size asked for, or anything up to the usable size, rounds to the same class
+    lkl_free_sized(exact, size);
+    lkl_free_sized(usable, lkl_malloc_usable_size(usable));
+    REQUIRE(lkl_get_stats().live_allocations == before.live_allocations);
+    REQUIRE(lkl_get_stats().live_bytes == before.live_bytes);
+  }
+
+  SECTION("NULL is ignored") { lkl_free_sized(nullptr, 16); }
+}
+
+TEST_CASE("aligned allocation", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  SECTION("every power of two alignment")
+  {
+    for (std::size_t alignment = 1; alignment <= 64 * 1024; alignment *= 2) {
+      void* res = lkl_aligned_alloc(alignment, 100);
+      REQUIRE(res != NULL);
+      REQUIRE(is_aligned(res, alignment));
+      fill(res, 100, 1);
+      lkl_free(res);
+    }
+  }
+
+  SECTION("large aligned allocations")
+  {
+    void* res = lkl_aligned_alloc(4096, 1024 * 1024);
+    REQUIRE(is_aligned(res, 4096));
+    fill(res, 1024 * 1024, 1);
+    lkl_free(res);
+  }
+
+  SECTION("bad alignment")
+  {
+    void* res = NULL;
+    REQUIRE(lkl_aligned_alloc(48, 100) == NULL);
+    REQUIRE(lkl_posix_memalign(&res, 48, 100) == EINVAL);
+    REQUIRE(lkl_posix_memalign(&res, 64, 100) == 0);
+    REQUIRE(is_aligned(res, 64));
+    lkl_free(res);
+  }
+}
+
+TEST_CASE("random workload", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<std::size_t> size_rng(1, 8192);
+  std::uniform_int_distribution<std::size_t> slot_rng(0, 499);
+
+  std::vector<std::pair<unsigned char*, std::size_t>> slots(500, {nullptr, 0});
+  for (int op = 0; op < 50000; op++) {
+    // Giving memory back now and then must never touch live allocations
+    if (op % 5000 == 0) {
+      lkl_trim(0);
+    }
+
+    auto& [ptr, size] = slots[slot_rng(gen)];
+    if (ptr) {
+      REQUIRE(holds(ptr, size, static_cast<unsigned char>(size)));
+      if (op % 3 == 0) {
+        std::size_t new_size = size_rng(gen);
+        ptr = static_cast<unsigned char*>(lkl_realloc(ptr, new_size));
+        REQUIRE(ptr != NULL);
+        REQUIRE(holds(ptr, std::min(size, new_size), static_cast<unsigned char>(size)));
+        size = new_size;
+        fill(ptr, size, static_cast<unsigned char>(size));
+      } else {
+        lkl_free(ptr);
+        ptr = nullptr;
+      }
+    } else {
+      size = size_rng(gen);
+      ptr = static_cast<unsigned char*>(lkl_malloc(size));
+      REQUIRE(ptr != NULL);
+      fill(ptr, size, static_cast<unsigned char>(size));
+    }
+  }
+
+  for (auto& [ptr, size] : slots) {
+    lkl_free(ptr);
+  }
+}
+
+TEST_CASE("huge pages", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  // Backends without them reject the option. Where no huge pages are reserved normal pages are used instead.
+  if (!lkl_mallopt(LKL_M_HUGETLB, 1)) {
+    return;
+  }
+  constexpr std::size_t size = 4 * 1024 * 1024;
+  void* res = lkl_malloc(size);
+  REQUIRE(res != NULL);
+  fill(res, size, 0x5a);
+
+  void* grown = lkl_realloc(res, 2 * size);
+  REQUIRE(grown != NULL);
+  REQUIRE(holds(grown, size, 0x5a));
+
+  void* shrunk = lkl_realloc(grown, size / 2);
+  REQUIRE(shrunk != NULL);
+  REQUIRE(holds(shrunk, size / 2, 0x5a));
+  lkl_free(shrunk);
+
+  REQUIRE(lkl_mallopt(LKL_M_HUGETLB, 0) == 1);
+}
+
+TEST_CASE("lkl_trim", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  void* kept = lkl_malloc(64 * 1024);
+  void* freed = lkl_malloc(512 * 1024);
+  void* top = lkl_malloc(100);
+  REQUIRE(kept != NULL);
+  REQUIRE(freed != NULL);
+  REQUIRE(top != NULL);
+  fill(kept, 64 * 1024, 0x5a);
+  fill(top, 100, 0xa5);
+  lkl_free(freed);
+
+  lkl_trim(0);
+  REQUIRE(holds(kept, 64 * 1024, 0x5a));
+  REQUIRE(holds(top, 100, 0xa5));
+
+  // Released memory can be handed out again
+  void* reused = lkl_malloc(512 * 1024);
+  REQUIRE(reused != NULL);
+  fill(reused, 512 * 1024, 1);
+
+  lkl_free(reused);
+  lkl_free(kept);
+  lkl_free(top);
+  lkl_trim(0);
+}
+
+TEST_CASE("lkl_get_stats", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  const lkl_stats before = lkl_get_stats();
+  std::vector<void*> allocations;
+  std::size_t usable = 0;
+  for (std::size_t size = 1; size < 300000; size = size * 2 + 1) {
+    allocations.push_back(lkl_malloc(size));
+    REQUIRE(allocations.back() != NULL);
+    usable += lkl_malloc_usable_size(allocations.back());
+  }
+
+  const lkl_stats stats = lkl_get_stats();
+  REQUIRE(stats.live_allocations == before.live_allocations + allocations.size());
+  REQUIRE(stats.live_bytes == before.live_bytes + usable);
+  REQUIRE(stats.heap_bytes > 0);
+  REQUIRE(stats.sbrk_calls > 0);
+  REQUIRE(stats.mapped_bytes > before.mapped_bytes);
+  REQUIRE(stats.free_bytes >= stats.largest_free_block);
+  REQUIRE(stats.fragmentation >= 0.0);
+  REQUIRE(stats.fragmentation < 1.0);
+
+  std::for_each(allocations.begin(), allocations.end(), lkl_free);
+  const lkl_stats after = lkl_get_stats();
+  REQUIRE(after.live_allocations == before.live_allocations);
+  REQUIRE(after.live_bytes == before.live_bytes);
+  REQUIRE(after.mapped_bytes <= stats.mapped_bytes);
+}
+
+TEST_CASE("concurrent use", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  constexpr std::size_t num_threads = 4;
+  std::vector<std::thread> threads;
+  std::vector<int> failures(num_threads, 0);
+  for (std::size_t thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([thread_idx, &failures] {
+      std::vector<void*> allocations;
+      for (int round = 0; round < 50; round++) {
+        for (std::size_t size = 16; size < 2048; size += 48) {
+          void* res = lkl_malloc(size);
+          if (!res) {
+            failures[thread_idx]++;
+            continue;
+          }
+          fill(res, size, static_cast<unsigned char>(thread_idx));
+          allocations.push_back(res);
+        }
+        for (void* ptr : allocations) {
+          if (!holds(ptr, 16, static_cast<unsigned char>(thread_idx))) {
+            failures[thread_idx]++;
+          }
+          lkl_free(ptr);
+        }
+        allocations.clear();
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  REQUIRE(std::count(failures.begin(), failures.end(), 0) == static_cast<std::ptrdiff_t>(num_threads));
+}
+
+TEST_CASE("caching per CPU", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  // Backends without per CPU caches reject the option
+  if (!lkl_mallopt(LKL_M_PERCPU_COUNT, 32)) {
+    return;
+  }
+  const std::size_t live_before = lkl_get_stats().live_allocations;
+
+  // Many more threads than CPUs, so threads are preempted and moved in the middle of using a CPU's cache
+  const unsigned int num_threads = 4 * std::max(std::thread::hardware_concurrency(), 2U);
+  std::vector<std::thread> threads;
+  std::vector<int> failures(num_threads, 0);
+  for (unsigned int thread_idx = 0; thread_idx < num_threads; thread_idx++) {
+    threads.emplace_back([thread_idx, &failures] {
+      std::vector<void*> allocations;
+      for (int round = 0; round < 200; round++) {
+        for (std::size_t size = 16; size < 1024; size += 24) {
+          void* res = lkl_malloc(size);
+          if (!res) {
+            failures[thread_idx]++;
+            continue;
+          }
+          fill(res, size, static_cast<unsigned char>(thread_idx));
+          allocations.push_back(res);
+        }
+        for (void* ptr : allocations) {
+          failures[thread_idx] += !holds(ptr, 16, static_cast<unsigned char>(thread_idx));
+          lkl_free(ptr);
+        }
+        allocations.clear();
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  REQUIRE(lkl_mallopt(LKL_M_PERCPU_COUNT, 0) == 1);
+
+  REQUIRE(std::count(failures.begin(), failures.end(), 0) == static_cast<std::ptrdiff_t>(num_threads));
+  REQUIRE(lkl_get_stats().live_allocations == live_before);
+}
+
+TEST_CASE("objects freed by another thread", "[api]")
+{
+  REQUIRE(heap_ready);
+
+  // The producer hands objects over in batches while the consumer frees them, as in a pipeline. The producer
+  // waits while a few batches are queued, so a consumer that falls behind cannot run the heap out of space.
+  constexpr int num_batches = 200;
+  constexpr std::size_t batch_size = 500;
+  constexpr std::size_t max_queued = 4;
+  const std::size_t live_before = lkl_get_stats().live_allocations;
+
+  std::mutex handover_lock;
+  std::condition_variable handover_ready;
+  std::deque<std::vector<void*>> batches;
+  int failures = 0;
+
+  std::thread producer([&] {
+    for (int batch_idx = 0; batch_idx < num_batches; batch_idx++) {
+      std::vector<void*> batch;
+      for (std::size_t count = 0; count < batch_size; count++) {
+        std::size_t size = 16 + (count * 40) % 1000;
+        void* res = lkl_malloc(size);
+        if (res) {
+          fill(res, size, static_cast<unsigned char>(batch_idx));
+          batch.push_back(res);
+        }
+      }
+      std::unique_lock<std::mutex> guard(handover_lock);
+      handover_ready.wait(guard, [&] { return batches.size() < max_queued; });
+      batches.push_back(std::move(batch));
+      handover_ready.notify_all();
+    }
+  });
+
+  std::thread consumer([&] {
+    for (int batch_idx = 0; batch_idx < num_batches; batch_idx++) {
+      std::unique_lock<std::mutex> guard(handover_lock);
+      handover_ready.wait(guard, [&] { return !batches.empty(); });
+      std::vector<void*> batch = std::move(batches.front());
+      batches.pop_front();
+      handover_ready.notify_all();
+      guard.unlock();
+
+      failures += static_cast<int>(batch_size - batch.size());
+      for (void* ptr : batch) {
+        failures += !holds(ptr, 16, static_cast<unsigned char>(batch_idx));
+        lkl_free(ptr);
+      }
+    }
+  });
+
+  producer.join();
+  consumer.join();
+  REQUIRE(failures == 0);
+  REQUIRE(lkl_get_stats().live_allocations == live_before);
+
+  // Whatever the consumer freed can be allocated again
+  std::vector<void*> allocations;
+  for (std::size_t count = 0; count < batch_size; count++) {
+    allocations.push_back(lkl_malloc(16 + (count * 40) % 1000));
+    REQUIRE(allocations.back() != NULL);
+  }
+  std::for_each(allocations.begin(), allocations.end(), lkl_free);
+}
@@ -5,6 +5,7 @@
 
 extern "C" {
 #include <stddef.h>
+#include <stdint.h>
 
 char* heap_base;
 size_t heap_size;
@@ -17,13 +18,18 @@ void init_heap(char* given_heap, size_t len)
   heap_top = 0;
 }
 
-void* sbrk(size_t increment)
+void move_heap_break(size_t increment)
 {
-  if (heap_top + increment > heap_size) {
+  heap_top += increment;
+}
+
+void* sbrk(intptr_t increment)
+{
+  if (increment < 0 ? static_cast<size_t>(-increment) > heap_top : heap_top + static_cast<size_t>(increment) > heap_size) {
     return (void*)-1;
   } else {
     char* allocated_address = &heap_base[heap_top];
-    heap_top += increment;
+    heap_top += static_cast<size_t>(increment);
     return (void*)allocated_address;
   }
 }
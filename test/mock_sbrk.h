@@ -3,3 +3,9 @@
 #pragma once
 
 extern void init_heap(char* given_heap, size_t len);
+
+// Moves the break as if something other than the allocator had called sbrk
+extern void move_heap_break(size_t increment);
+
+// How far the break has been moved from the start of the heap
+extern size_t heap_top;